@@ -0,0 +1,108 @@
+//
+// Throughput of the atom table: interning new strings, interning ones
+// that are already there, and drsh_at_lookup hits and misses, at a few
+// table sizes.
+//
+//    make bench
+//    ./bench/bench_at [SIZES ...]
+//
+#define DRSH_INTERNAL static __attribute__((__unused__))
+#define main drsh_main
+#include "../drsh.c"
+#undef main
+
+static
+uint64_t
+now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+}
+
+static
+char*
+make_keys(size_t n, const char* prefix, size_t** offsets){
+    // Path-ish keys of varying length, like what ends up interned.
+    DrshGrowBuffer b = {0};
+    size_t* offs = malloc((n+1)*sizeof *offs);
+    if(!offs) abort();
+    for(size_t i = 0; i < n; i++){
+        offs[i] = b.count;
+        if(drsh_gb_sprintf(&b, "%s/usr/share/%zu/%.*s", prefix, i*2654435761u % 1000003, (int)(i%23), "abcdefghijklmnopqrstuvw"))
+            abort();
+    }
+    offs[n] = b.count;
+    *offsets = offs;
+    return b.data;
+}
+
+static
+void
+shuffle(size_t* idx, size_t n){
+    uint64_t x = 88172645463325252ull;
+    for(size_t i = n; i > 1; i--){
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        size_t j = (size_t)(x % i);
+        size_t t = idx[i-1]; idx[i-1] = idx[j]; idx[j] = t;
+    }
+}
+
+static
+void
+bench(size_t n){
+    DrshAtomTable* at = calloc(1, sizeof *at);
+    if(!at || drsh_at_init(at)) abort();
+    size_t *offs, *moffs;
+    char* keys = make_keys(n, "", &offs);
+    char* misses = make_keys(n, "!", &moffs);
+    size_t* order = malloc(n*sizeof *order);
+    if(!order) abort();
+    for(size_t i = 0; i < n; i++) order[i] = i;
+    shuffle(order, n);
+    const DrshAtom* a;
+    size_t found = 0;
+
+    uint64_t t0 = now_ns();
+    for(size_t i = 0; i < n; i++)
+        if(drsh_at_atomize(at, keys+offs[i], offs[i+1]-offs[i], &a)) abort();
+    uint64_t t1 = now_ns();
+    for(size_t k = 0; k < n; k++){
+        size_t i = order[k];
+        if(drsh_at_atomize(at, keys+offs[i], offs[i+1]-offs[i], &a)) abort();
+    }
+    uint64_t t2 = now_ns();
+    for(size_t k = 0; k < n; k++){
+        size_t i = order[k];
+        found += drsh_at_lookup(at, keys+offs[i], offs[i+1]-offs[i]) != NULL;
+    }
+    uint64_t t3 = now_ns();
+    for(size_t k = 0; k < n; k++){
+        size_t i = order[k];
+        found += drsh_at_lookup(at, misses+moffs[i], moffs[i+1]-moffs[i]) != NULL;
+    }
+    uint64_t t4 = now_ns();
+    if(found != n) abort();
+    printf("%9zu %12.1f %12.1f %12.1f %12.1f\n", n,
+        (double)(t1-t0)/(double)n, (double)(t2-t1)/(double)n,
+        (double)(t3-t2)/(double)n, (double)(t4-t3)/(double)n);
+    free(order);
+    free(keys);
+    free(misses);
+    free(offs);
+    free(moffs);
+    // The table itself is leaked, there is no way to free one.
+}
+
+int
+main(int argc, char** argv){
+    printf("%9s %12s %12s %12s %12s   (ns per op)\n", "atoms", "insert", "atomize hit", "lookup hit", "lookup miss");
+    if(argc > 1){
+        for(int i = 1; i < argc; i++)
+            bench((size_t)strtoull(argv[i], NULL, 10));
+        return 0;
+    }
+    bench(1000);
+    bench(100000);
+    bench(1000000);
+    return 0;
+}
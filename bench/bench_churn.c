@@ -0,0 +1,122 @@
+//
+// Heavy set/unset churn on the environment. Each phase sets and unsets
+// random names from a pool, then times lookups of the live variables,
+// lookups of unset ones and listing them all, which should all stay flat
+// however long the churn goes on. Afterwards most variables are unset to
+// check that the table shrinks.
+//
+//    make bench
+//    ./bench/bench_churn [POOL [PHASES [OPS_PER_PHASE]]]
+//
+#define DRSH_INTERNAL static __attribute__((__unused__))
+#define main drsh_main
+#include "../drsh.c"
+#undef main
+
+static
+uint64_t
+now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+}
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static
+uint64_t
+rng(void){
+    uint64_t x = rng_state;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return rng_state = x;
+}
+
+int
+main(int argc, char** argv){
+    size_t pool = argc > 1? (size_t)strtoull(argv[1], NULL, 10) : 20000;
+    size_t phases = argc > 2? (size_t)strtoull(argv[2], NULL, 10) : 10;
+    size_t ops = argc > 3? (size_t)strtoull(argv[3], NULL, 10) : 200000;
+    if(!pool || !phases) return 2;
+    static DrshAtomTable at;
+    static DrshEnvironment env;
+    char* empty[] = {NULL};
+    if(drsh_at_init(&at) || drsh_env_init(&env, &at, empty, 0)) abort();
+    const DrshAtom** names = malloc(pool*sizeof *names);
+    const DrshAtom** values = malloc(pool*sizeof *values);
+    _Bool* live = calloc(pool, 1);
+    if(!names || !values || !live) abort();
+    for(size_t i = 0; i < pool; i++){
+        char buff[64];
+        int n = snprintf(buff, sizeof buff, "CHURN_%zu", i);
+        if(drsh_at_atomize(&at, buff, (size_t)n, &names[i])) abort();
+        n = snprintf(buff, sizeof buff, "value %zu", i);
+        if(drsh_at_atomize(&at, buff, (size_t)n, &values[i])) abort();
+    }
+    DrshGrowBuffer pairs = {0};
+    printf("%5s %8s %10s %10s %10s %10s %12s\n", "phase", "live", "index cap", "set/unset", "hit", "miss", "list");
+    printf("%5s %8s %10s %10s %10s %10s %12s\n", "", "", "", "ns/op", "ns/op", "ns/op", "us");
+    for(size_t p = 0; p < phases; p++){
+        uint64_t t0 = now_ns();
+        for(size_t k = 0; k < ops; k++){
+            size_t i = (size_t)(rng() % pool);
+            // Lean towards about half the pool being set.
+            if(live[i]){
+                if(drsh_env_unset(&env, names[i]->txt, names[i]->len)) abort();
+                live[i] = 0;
+            }
+            else {
+                if(drsh_env_set_env(&env, names[i], values[i])) abort();
+                live[i] = 1;
+            }
+        }
+        uint64_t t1 = now_ns();
+        size_t hits = 0, misses = 0, found = 0;
+        uint64_t hit_ns = 0, miss_ns = 0;
+        for(size_t r = 0; r < 4; r++){
+            for(size_t i = 0; i < pool; i++){
+                uint64_t a = now_ns();
+                const DrshAtom* v = drsh_env_get_env(&env, names[i]);
+                uint64_t b = now_ns();
+                if(live[i]){
+                    hit_ns += b-a;
+                    hits++;
+                    found += v == values[i];
+                }
+                else {
+                    miss_ns += b-a;
+                    misses++;
+                    found += !v;
+                }
+            }
+        }
+        if(found != 4*pool){
+            fprintf(stderr, "lookups disagree with what was set\n");
+            return 1;
+        }
+        uint64_t t2 = now_ns();
+        if(drsh_env_merged_pairs(&env, &pairs, DRSH_ENV_ALL)) abort();
+        uint64_t t3 = now_ns();
+        size_t count = 0;
+        for(size_t i = 0; i < pool; i++) count += live[i];
+        if(pairs.count/(2*sizeof(const DrshAtom*)) != count || env.count != count){
+            fprintf(stderr, "listing has the wrong number of variables\n");
+            return 1;
+        }
+        // Timing each lookup adds the clock's overhead, but the same to
+        // every phase.
+        printf("%5zu %8zu %10zu %10.1f %10.1f %10.1f %12.1f\n", p, count, env.index.cap,
+            (double)(t1-t0)/(double)ops, (double)hit_ns/(double)(hits?hits:1),
+            (double)miss_ns/(double)(misses?misses:1), (double)(t3-t2)/1e3);
+    }
+    size_t peak_cap = env.index.cap;
+    size_t peak_pairs = env.cap;
+    for(size_t i = 0; i < pool; i++){
+        if(live[i] && i % 64){
+            if(drsh_env_unset(&env, names[i]->txt, names[i]->len)) abort();
+            live[i] = 0;
+        }
+    }
+    printf("after unsetting most: %zu live, index cap %zu -> %zu, pair cap %zu -> %zu\n",
+        env.count, peak_cap, env.index.cap, peak_pairs, env.cap);
+    return 0;
+}
@@ -0,0 +1,100 @@
+//
+// Variable lookups as done for $VAR expansion (drsh_env_get_env2), hits
+// and misses, against environments of a few sizes, in both the case
+// sensitive (posix) and case insensitive (windows) modes. Also checks that
+// misses don't intern anything.
+//
+//    make bench
+//    ./bench/bench_env [SIZES ...]
+//
+#define DRSH_INTERNAL static __attribute__((__unused__))
+#define main drsh_main
+#include "../drsh.c"
+#undef main
+
+static
+uint64_t
+now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+}
+
+enum {LOOKUPS = 2000000};
+
+static
+void
+bench(size_t n, _Bool windows_style){
+    DrshAtomTable* at = calloc(1, sizeof *at);
+    DrshEnvironment* env = calloc(1, sizeof *env);
+    if(!at || !env || drsh_at_init(at)) abort();
+    // Both styles of environment, built from the same variables.
+    DrshGrowBuffer block = {0};
+    DrshGrowBuffer ptrs = {0};
+    for(size_t i = 0; i < n; i++){
+        size_t off = block.count;
+        if(drsh_gb_sprintf(&block, "Some_Variable_%zu=/value/of/variable/%zu", i, i)) abort();
+        if(drsh_gb_append_(&block, "", 1)) abort();
+        if(drsh_gb_append_(&ptrs, &off, sizeof off)) abort();
+    }
+    if(drsh_gb_append_(&block, "", 1)) abort();
+    char** envp = malloc((n+1)*sizeof *envp);
+    if(!envp) abort();
+    for(size_t i = 0; i < n; i++)
+        envp[i] = block.data + ((size_t*)ptrs.data)[i];
+    envp[n] = NULL;
+    if(drsh_env_init(env, at, windows_style? (void*)block.data : (void*)envp, windows_style)) abort();
+
+    // Names to look up, spelled differently from how they were set when
+    // case insensitive.
+    char (*hits)[64] = malloc(n * sizeof *hits);
+    char (*misses)[64] = malloc(n * sizeof *misses);
+    if(!hits || !misses) abort();
+    for(size_t i = 0; i < n; i++){
+        snprintf(hits[i], sizeof hits[i], windows_style? "SOME_VARIABLE_%zu" : "Some_Variable_%zu", i);
+        snprintf(misses[i], sizeof misses[i], "Some_Unset_Variable_%zu", i);
+    }
+    size_t before = drsh_at_count(at);
+    size_t found = 0;
+    uint64_t t0 = now_ns();
+    for(size_t k = 0; k < LOOKUPS; k++){
+        size_t i = k*7919 % n;
+        found += drsh_env_get_env2(env, hits[i], strlen(hits[i])) != NULL;
+    }
+    uint64_t t1 = now_ns();
+    for(size_t k = 0; k < LOOKUPS; k++){
+        size_t i = k*7919 % n;
+        found += drsh_env_get_env2(env, misses[i], strlen(misses[i])) != NULL;
+    }
+    uint64_t t2 = now_ns();
+    if(found != LOOKUPS) abort();
+    // Hits atomize inherited values the first time they are read, misses
+    // must not intern anything.
+    size_t interned = drsh_at_count(at) - before;
+    printf("%-16s %7zu %10.1f %10.1f %10zu\n", windows_style? "case insensitive" : "case sensitive", n,
+        (double)(t1-t0)/LOOKUPS, (double)(t2-t1)/LOOKUPS, interned);
+    if(interned > n){
+        fprintf(stderr, "lookups interned %zu atoms\n", interned);
+        exit(1);
+    }
+    free(hits);
+    free(misses);
+    // The environment, which points into envp and block, is leaked along
+    // with the table.
+}
+
+int
+main(int argc, char** argv){
+    printf("%-16s %7s %10s %10s %10s   (ns per lookup)\n", "mode", "vars", "hit", "miss", "interned");
+    for(int w = 0; w < 2; w++){
+        if(argc > 1){
+            for(int i = 1; i < argc; i++)
+                bench((size_t)strtoull(argv[i], NULL, 10), w);
+            continue;
+        }
+        bench(50, w);
+        bench(1000, w);
+        bench(100000, w);
+    }
+    return 0;
+}
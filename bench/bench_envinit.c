@@ -0,0 +1,66 @@
+//
+// Startup cost of importing a large inherited environment (drsh_env_init)
+// and of making the first envp for a child, like in a CI container with
+// hundreds of long variables.
+//
+//    make bench
+//    ./bench/bench_envinit [VARS [VALUE_LEN [ITERATIONS]]]
+//
+#define DRSH_INTERNAL static __attribute__((__unused__))
+#define main drsh_main
+#include "../drsh.c"
+#undef main
+
+static
+uint64_t
+now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+}
+
+int
+main(int argc, char** argv){
+    size_t nvars = argc > 1? (size_t)strtoull(argv[1], NULL, 10) : 500;
+    size_t value_len = argc > 2? (size_t)strtoull(argv[2], NULL, 10) : 2000;
+    size_t iterations = argc > 3? (size_t)strtoull(argv[3], NULL, 10) : 200;
+    if(!nvars || !iterations) return 2;
+    char** envp = malloc((nvars+1)*sizeof *envp);
+    if(!envp) abort();
+    for(size_t i = 0; i < nvars; i++){
+        char name[32];
+        int n = snprintf(name, sizeof name, "CI_VARIABLE_%zu=", i);
+        envp[i] = malloc((size_t)n + value_len + 1);
+        if(!envp[i]) abort();
+        memcpy(envp[i], name, (size_t)n);
+        for(size_t j = 0; j < value_len; j++)
+            envp[i][n+j] = (char)('a' + (i+j) % 26);
+        envp[i][n+value_len] = 0;
+    }
+    envp[nvars] = NULL;
+    uint64_t init_ns = 0, envp_ns = 0;
+    size_t atoms = 0, bytes = 0;
+    for(size_t it = 0; it < iterations; it++){
+        // A fresh table each time, like a new shell.
+        DrshAtomTable* at = calloc(1, sizeof *at);
+        DrshEnvironment* env = calloc(1, sizeof *env);
+        if(!at || !env || drsh_at_init(at)) abort();
+        uint64_t t0 = now_ns();
+        if(drsh_env_init(env, at, envp, 0)) abort();
+        uint64_t t1 = now_ns();
+        if(!drsh_env_get_envp(env, 0)) abort();
+        uint64_t t2 = now_ns();
+        init_ns += t1-t0;
+        envp_ns += t2-t1;
+        atoms = drsh_at_count(at);
+        bytes = 0;
+        for(size_t i = 0; i < DRSH_AT_SHARDS; i++)
+            bytes += at->shards[i].arena.used;
+        // Leaked, there is no way to free a table or an environment.
+    }
+    printf("%zu variables of %zu bytes\n", nvars, value_len);
+    printf("drsh_env_init:       %10.1f us\n", (double)init_ns/(double)iterations/1e3);
+    printf("first envp:          %10.1f us\n", (double)envp_ns/(double)iterations/1e3);
+    printf("atoms after import:  %10zu (%zu bytes)\n", atoms, bytes);
+    return 0;
+}
@@ -0,0 +1,195 @@
+//
+// Compares the hash functions drsh can pick between on shell data: the
+// environment, the names in the PATH directories and, if given, the lines
+// of a file (a history file is a good choice). For each it reports the
+// throughput on the keys as they are and on long keys, how many distinct
+// keys collide on the full 32 bits, and the average linear probe length
+// at 50% load (how the tables use them). Posix only, for readdir.
+//
+//    make bench
+//    ./bench/bench_hash [FILE]
+//
+#define DRSH_INTERNAL static __attribute__((__unused__))
+#define main drsh_main
+#include "../drsh.c"
+#undef main
+
+typedef uint32_t HashFunc(const void* key, size_t len);
+
+static
+uint64_t
+now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+}
+
+// Keeps the hashing from being optimized out.
+static volatile uint32_t bench_sink;
+
+typedef struct Keys Keys;
+struct Keys {
+    DrshGrowBuffer txt;
+    DrshGrowBuffer offs; // size_t, one past the last key too
+    size_t count;
+};
+
+static
+void
+add_key(Keys* k, const char* txt, size_t len){
+    if(!k->offs.count && drsh_gb_append_(&k->offs, &k->txt.count, sizeof(size_t))) abort();
+    if(drsh_gb_append_(&k->txt, txt, len)) abort();
+    if(drsh_gb_append_(&k->offs, &k->txt.count, sizeof(size_t))) abort();
+    k->count++;
+}
+
+static
+void
+gather(Keys* k, char** envp, const char*_Nullable file){
+    for(char** p = envp; *p; p++)
+        add_key(k, *p, strlen(*p));
+    const char* path = getenv("PATH");
+    if(path){
+        char* copy = strdup(path);
+        if(!copy) abort();
+        for(char* dir = strtok(copy, ":"); dir; dir = strtok(NULL, ":")){
+            DIR* d = opendir(dir);
+            if(!d) continue;
+            for(struct dirent* e; (e = readdir(d));)
+                add_key(k, e->d_name, strlen(e->d_name));
+            closedir(d);
+        }
+        free(copy);
+    }
+    if(file){
+        DrshGrowBuffer b = {0};
+        if(drsh_read_file(file, &b)){
+            fprintf(stderr, "unable to read %s\n", file);
+            exit(1);
+        }
+        const char* p = b.data;
+        const char* end = p + b.count;
+        while(p < end){
+            const char* nl = memchr(p, '\n', (size_t)(end-p));
+            if(!nl) nl = end;
+            if(nl != p) add_key(k, p, (size_t)(nl-p));
+            p = nl+1;
+        }
+        free(b.data);
+    }
+}
+
+static
+int
+cmp_u32(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y? -1 : x > y;
+}
+
+static
+void
+bench(const char* name, HashFunc* hash, const Keys* k, const Keys* uniq){
+    const size_t* offs = (const size_t*)k->offs.data;
+    uint32_t sink = 0;
+    // Enough rounds to take a while.
+    size_t rounds = 1 + (size_t)(20000000 / (k->txt.count+1));
+    uint64_t t0 = now_ns();
+    for(size_t r = 0; r < rounds; r++)
+        for(size_t i = 0; i < k->count; i++)
+            sink += hash(k->txt.data+offs[i], offs[i+1]-offs[i]);
+    uint64_t t1 = now_ns();
+    double short_mbs = (double)k->txt.count*(double)rounds / ((double)(t1-t0)/1e9) / 1e6;
+    double short_ns = (double)(t1-t0)/((double)k->count*(double)rounds);
+    // All of it as 4k keys, like PATH and long history lines.
+    enum {LONG = 4096};
+    size_t nlong = k->txt.count / LONG;
+    double long_mbs = 0;
+    if(nlong){
+        size_t lrounds = 1 + (size_t)(200000000 / (nlong*LONG));
+        t0 = now_ns();
+        for(size_t r = 0; r < lrounds; r++)
+            for(size_t i = 0; i < nlong; i++)
+                sink += hash(k->txt.data + i*LONG, LONG);
+        t1 = now_ns();
+        long_mbs = (double)(nlong*LONG)*(double)lrounds / ((double)(t1-t0)/1e9) / 1e6;
+    }
+
+    // Quality, on the distinct keys.
+    const size_t* uoffs = (const size_t*)uniq->offs.data;
+    uint32_t* hashes = malloc(uniq->count*sizeof *hashes);
+    if(!hashes) abort();
+    for(size_t i = 0; i < uniq->count; i++)
+        hashes[i] = hash(uniq->txt.data+uoffs[i], uoffs[i+1]-uoffs[i]);
+    size_t cap = 1;
+    while(cap < 2*uniq->count) cap *= 2;
+    uint8_t* used = calloc(cap, 1);
+    if(!used) abort();
+    size_t probes = 0;
+    for(size_t i = 0; i < uniq->count; i++){
+        size_t s = hashes[i] & (cap-1);
+        probes++;
+        while(used[s]){
+            s = (s+1) & (cap-1);
+            probes++;
+        }
+        used[s] = 1;
+    }
+    qsort(hashes, uniq->count, sizeof *hashes, cmp_u32);
+    size_t collisions = 0;
+    for(size_t i = 1; i < uniq->count; i++)
+        collisions += hashes[i] == hashes[i-1];
+    bench_sink = sink;
+    printf("%-14s %9.0f %9.1f %9.0f %11zu %9.3f\n", name, short_mbs, short_ns, long_mbs,
+        collisions, (double)probes/(double)uniq->count);
+    free(hashes);
+    free(used);
+}
+
+static
+int
+cmp_key(const void* a, const void* b){
+    const DrshStringView* x = a;
+    const DrshStringView* y = b;
+    size_t n = x->length < y->length? x->length : y->length;
+    int c = memcmp(x->txt, y->txt, n);
+    if(c) return c;
+    return x->length < y->length? -1 : x->length > y->length;
+}
+
+int
+main(int argc, char** argv, char** envp){
+    Keys k = {0};
+    gather(&k, envp, argc > 1? argv[1] : NULL);
+    if(!k.count){
+        fprintf(stderr, "no keys\n");
+        return 1;
+    }
+    // The distinct keys, for judging collisions.
+    const size_t* offs = (const size_t*)k.offs.data;
+    DrshStringView* sv = malloc(k.count*sizeof *sv);
+    if(!sv) abort();
+    for(size_t i = 0; i < k.count; i++)
+        sv[i] = (DrshStringView){.length = offs[i+1]-offs[i], .txt = k.txt.data+offs[i]};
+    qsort(sv, k.count, sizeof *sv, cmp_key);
+    Keys uniq = {0};
+    for(size_t i = 0; i < k.count; i++)
+        if(!i || cmp_key(&sv[i], &sv[i-1]))
+            add_key(&uniq, sv[i].txt, sv[i].length);
+    free(sv);
+    printf("%zu keys (%zu distinct), %zu bytes\n", k.count, uniq.count, k.txt.count);
+    printf("%-14s %9s %9s %9s %11s %9s\n", "hash", "MB/s", "ns/key", "4k MB/s", "collisions", "probes");
+    #if defined(__ARM_ACLE) && __ARM_FEATURE_CRC32
+    bench("crc32c", drsh_hash_align1, &k, &uniq);
+    #else
+    bench("murmur", drsh_hash_murmur, &k, &uniq);
+    #ifdef DRSH_HAVE_CRC32C_X86
+    if(drsh_cpu_has_sse42()){
+        bench("crc32c", drsh_hash_crc32c, &k, &uniq);
+        bench("crc32c wide", drsh_hash_crc32c_wide, &k, &uniq);
+    }
+    else
+        printf("no sse4.2, skipping crc32c\n");
+    #endif
+    #endif
+    return 0;
+}
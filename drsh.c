@@ -44,6 +44,7 @@ typedef enum OsFlavor OsFlavor;
 // #pragma warning( disable : 5105)
 #endif
 #include <Windows.h>
+#include <psapi.h>
 typedef long long ssize_t;
 
 #else // assume posix
@@ -69,6 +70,25 @@ typedef long long ssize_t;
 
 #include <glob.h>
 
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+// libc doesn't wrap io_uring, so it is used through syscall(2).
+#define DRSH_IO_URING 1
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
+#if __has_include(<linux/perf_event.h>)
+// perf_event_open(2) also has no libc wrapper.
+#define DRSH_PERF_EVENTS 1
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#endif
+
 #endif
 // compiler warnings
 
@@ -326,6 +346,13 @@ struct __attribute__((packed)) drsh_packed_uint16 {
 #endif
 
 
+// Identifies the hash function in use. Hashes are only comparable between
+// processes using the same one.
+enum {
+    DRSH_HASH_MURMUR = 1,
+    DRSH_HASH_CRC32C = 2,
+    DRSH_HASH_CRC32C_WIDE = 3,
+};
 
 #if defined(__ARM_ACLE) && __ARM_FEATURE_CRC32
 #if defined(__IMPORTC__)
@@ -392,66 +419,13 @@ drsh_hash_align8(const void* key, size_t len){
     return h;
 }
 
-#elif defined(__x86_64__) && defined(__SSE4_2__)
-#ifdef __clang__
-#pragma clang assume_nonnull end
-#endif
-
-#include <nmmintrin.h>
-
-#ifdef __clang__
-#pragma clang assume_nonnull begin
-#endif
-
-DRSH_INLINE
-uint32_t
-drsh_hash_align1(const void* key, size_t len){
-    const unsigned char* k = key;
-    uint32_t h = 0;
-    for(;len >= 8; k+=8, len-=8)
-        h = _mm_crc32_u64(h, (*(const drsh_packed_uint64*)k).v);
-    for(;len >= 4; k+=4, len-=4)
-        h = _mm_crc32_u32(h, (*(const drsh_packed_uint32*)k).v);
-    for(;len >= 2; k+=2, len-=2)
-        h = _mm_crc32_u16(h, (*(const drsh_packed_uint16*)k).v);
-    for(;len >= 1; k+=1, len-=1)
-        h = _mm_crc32_u8(h, *(const uint8_t*)k);
-    return h;
-}
-DRSH_INLINE
-uint32_t
-drsh_hash_align2(const void* key, size_t len){
-    const unsigned char* k = key;
-    uint32_t h = 0;
-    for(;len >= 8; k+=8, len-=8)
-        h = _mm_crc32_u64(h, (*(const drsh_packed_uint64*)k).v);
-    for(;len >= 4; k+=4, len-=4)
-        h = _mm_crc32_u32(h, (*(const drsh_packed_uint32*)k).v);
-    for(;len >= 2; k+=2, len-=2)
-        h = _mm_crc32_u16(h, (*(const drsh_packed_uint16*)k).v);
-    return h;
-}
-DRSH_INLINE
-uint32_t
-drsh_hash_align4(const void* key, size_t len){
-    const unsigned char* k = key;
-    uint32_t h = 0;
-    for(;len >= 8; k+=8, len-=8)
-        h = _mm_crc32_u64(h, (*(const drsh_packed_uint64*)k).v);
-    for(;len >= 4; k+=4, len-=4)
-        h = _mm_crc32_u32(h, (*(const drsh_packed_uint32*)k).v);
-    return h;
-}
-DRSH_INLINE
-uint32_t
-drsh_hash_align8(const void* key, size_t len){
-    const unsigned char* k = key;
-    uint32_t h = 0;
-    for(;len >= 8; k+=8, len-=8)
-        h = _mm_crc32_u64(h, (*(const drsh_packed_uint64*)k).v);
-    return h;
+DRSH_INTERNAL
+int
+drsh_hash_kind(void){
+    return DRSH_HASH_CRC32C;
 }
-#else // fall back to murmur hash
+
+#else
 
 // cut'n'paste from the wikipedia page on murmur hash
 DRSH_FORCE_INLINE
@@ -462,9 +436,9 @@ murmur_32_scramble(uint32_t k) {
     k *= 0x1b873593;
     return k;
 }
-DRSH_FORCE_INLINE
+DRSH_INTERNAL
 uint32_t
-drsh_hash_align1(const void* key_, size_t len){
+drsh_hash_murmur(const void* key_, size_t len){
     const uint8_t* key = key_;
     uint32_t seed = 4253307714;
 	uint32_t h = seed;
@@ -493,6 +467,151 @@ drsh_hash_align1(const void* key_, size_t len){
 	h ^= h >> 16;
 	return h;
 }
+
+#if defined(__x86_64__) || defined(_M_X64)
+// The CRC32C instructions are part of SSE4.2. Compile them regardless of
+// the target flags and decide at runtime whether they can be used, as the
+// usual way of building (cc drsh.c) targets baseline x86-64.
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+
+// clang-cl defines _MSC_VER instead of __GNUC__ but still needs the
+// attribute to use the intrinsics.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(__SSE4_2__)
+#define DRSH_TARGET_SSE42 __attribute__((__target__("sse4.2")))
+#else
+#define DRSH_TARGET_SSE42
+#endif
+
+enum {DRSH_HASH_WIDE_THRESHOLD = 64};
+
+DRSH_INTERNAL
+DRSH_TARGET_SSE42
+uint32_t
+drsh_hash_crc32c_tail(uint32_t h, const unsigned char* k, size_t len){
+    for(;len >= 8; k+=8, len-=8)
+        h = (uint32_t)_mm_crc32_u64(h, (*(const drsh_packed_uint64*)k).v);
+    for(;len >= 4; k+=4, len-=4)
+        h = _mm_crc32_u32(h, (*(const drsh_packed_uint32*)k).v);
+    for(;len >= 2; k+=2, len-=2)
+        h = _mm_crc32_u16(h, (*(const drsh_packed_uint16*)k).v);
+    for(;len >= 1; k+=1, len-=1)
+        h = _mm_crc32_u8(h, *(const uint8_t*)k);
+    return h;
+}
+
+DRSH_INTERNAL
+DRSH_TARGET_SSE42
+uint32_t
+drsh_hash_crc32c(const void* key, size_t len){
+    return drsh_hash_crc32c_tail(0, key, len);
+}
+
+//
+// crc32 has a latency of 3 cycles but a throughput of 1 per cycle, so a
+// single chain leaves most of the unit idle. For long keys (history lines,
+// PATH and friends), run three independent chains over interleaved words
+// and fold them together at the end. This isn't the CRC of the key anymore,
+// but we only care about it as a hash.
+//
+DRSH_INTERNAL
+DRSH_TARGET_SSE42
+uint32_t
+drsh_hash_crc32c_wide(const void* key, size_t len){
+    const unsigned char* k = key;
+    if(len < DRSH_HASH_WIDE_THRESHOLD)
+        return drsh_hash_crc32c_tail(0, k, len);
+    uint64_t h0 = 0, h1 = 0x9e3779b9, h2 = 0x7f4a7c15;
+    for(;len >= 24; k+=24, len-=24){
+        h0 = _mm_crc32_u64(h0, (*(const drsh_packed_uint64*)k).v);
+        h1 = _mm_crc32_u64(h1, (*(const drsh_packed_uint64*)(k+8)).v);
+        h2 = _mm_crc32_u64(h2, (*(const drsh_packed_uint64*)(k+16)).v);
+    }
+    uint32_t h = (uint32_t)_mm_crc32_u64(h0, h1 << 32 | h2);
+    return drsh_hash_crc32c_tail(h, k, len);
+}
+
+DRSH_INTERNAL
+_Bool
+drsh_cpu_has_sse42(void){
+    #if defined(__SSE4_2__)
+        return 1;
+    #elif defined(_MSC_VER)
+        int regs[4];
+        __cpuid(regs, 1);
+        return (regs[2] >> 20) & 1;
+    #else
+        return __builtin_cpu_supports("sse4.2");
+    #endif
+}
+
+#define DRSH_HAVE_CRC32C_X86 1
+#endif
+
+typedef uint32_t DrshHashFunc(const void* key, size_t len);
+
+DRSH_INTERNAL uint32_t drsh_hash_resolve(const void* key, size_t len);
+
+// The hash function in use, picked by drsh_hash_select (from drsh_at_init)
+// so that hashing threads never race to set it. Hashes aren't stable across
+// implementations, so this must not change once anything has been hashed.
+static DrshHashFunc* drsh_hash_impl = drsh_hash_resolve;
+static int drsh_hash_selected;
+
+DRSH_INTERNAL
+void
+drsh_hash_select(void){
+    if(drsh_hash_impl != drsh_hash_resolve) return;
+    int selected = DRSH_HASH_MURMUR;
+    DrshHashFunc* impl = drsh_hash_murmur;
+    #ifdef DRSH_HAVE_CRC32C_X86
+    if(drsh_cpu_has_sse42()){
+        impl = drsh_hash_crc32c_wide;
+        selected = DRSH_HASH_CRC32C_WIDE;
+    }
+    #endif
+    drsh_hash_selected = selected;
+    drsh_hash_impl = impl;
+}
+
+// Only reached if something hashes before drsh_at_init.
+DRSH_INTERNAL
+uint32_t
+drsh_hash_resolve(const void* key, size_t len){
+    drsh_hash_select();
+    return drsh_hash_impl(key, len);
+}
+
+DRSH_INTERNAL
+int
+drsh_hash_kind(void){
+    #if defined(DRSH_HAVE_CRC32C_X86) && defined(__SSE4_2__)
+    return DRSH_HASH_CRC32C_WIDE;
+    #else
+    drsh_hash_select();
+    return drsh_hash_selected;
+    #endif
+}
+
+DRSH_FORCE_INLINE
+uint32_t
+drsh_hash_align1(const void* key, size_t len){
+    #if defined(DRSH_HAVE_CRC32C_X86) && defined(__SSE4_2__)
+    return drsh_hash_crc32c_wide(key, len);
+    #else
+    return drsh_hash_impl(key, len);
+    #endif
+}
 DRSH_FORCE_INLINE
 uint32_t
 drsh_hash_align2(const void* key, size_t len){
@@ -688,6 +807,7 @@ typedef struct DrshArgv DrshArgv;
 struct DrshArgv {
     size_t length; // includes final NULL
     const char* const *ptr; // includes final NULL
+    const size_t* lens; // strlen of each argument, excludes final NULL
 };
 DRSH_FORCE_INLINE
 void
@@ -743,6 +863,23 @@ drsh_path_is_abs(DrshStringView path, _Bool windows_style){
     return is_abs;
 }
 
+//
+// Atomics and locks, for the bits that can be shared between threads.
+//
+#if defined(__GNUC__) || defined(__clang__)
+#define DRSH_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define DRSH_LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define DRSH_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define DRSH_ADD_RELAXED(p, v) ((void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+#elif defined(_MSC_VER)
+// msvc gives volatile accesses acquire and release semantics on x86 and
+// x64 (/volatile:ms).
+#define DRSH_LOAD_ACQUIRE(p) (*(volatile __typeof__(*(p))*)(p))
+#define DRSH_LOAD_RELAXED(p) DRSH_LOAD_ACQUIRE(p)
+#define DRSH_STORE_RELEASE(p, v) ((void)(*(volatile __typeof__(*(p))*)(p) = (v)))
+#define DRSH_ADD_RELAXED(p, v) ((void)_InterlockedExchangeAdd64((volatile long long*)(p), (long long)(v)))
+#endif
+
 typedef struct DrshGrowBuffer DrshGrowBuffer;
 struct DrshGrowBuffer {
     char* data;
@@ -750,36 +887,109 @@ struct DrshGrowBuffer {
     size_t cap;
 };
 
+//
+// Counts of every time a DrshGrowBuffer was reallocated, shown by `stats`.
+//
+typedef struct DrshGbStats DrshGbStats;
+struct DrshGbStats {
+    size_t reallocs;
+    size_t grown_bytes;
+    size_t trims;
+    size_t trimmed_bytes;
+};
+static DrshGbStats drsh_gb_stats;
+
+// Buffers are trimmed back to this when idle, see drsh_gb_trim.
+enum {DRSH_GB_IDLE_CAP = 4096};
+
 DRSH_FORCE_INLINE
 void
 drsh_gb_clear(DrshGrowBuffer* buff){
     buff->count = 0;
 }
 
-DRSH_INLINE
+//
+// Reallocates the buffer to exactly `cap` bytes, which must be at least
+// its count.
+//
+DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_gb_ensure(DrshGrowBuffer* buff, size_t sz){
-    if(buff->count + sz <= buff->cap) return EC_OK;
-    size_t new_cap = buff->cap + sz;
-    void* p = buff->data?realloc(buff->data, new_cap):malloc(new_cap);
+drsh_gb_realloc(DrshGrowBuffer* buff, size_t cap){
+    assert(cap >= buff->count);
+    if(!cap){
+        free(buff->data);
+        buff->data = NULL;
+        buff->cap = 0;
+        return EC_OK;
+    }
+    void* p = buff->data?realloc(buff->data, cap):malloc(cap);
     if(!p) return EC_OOM;
+    if(cap > buff->cap){
+        DRSH_ADD_RELAXED(&drsh_gb_stats.reallocs, 1);
+        DRSH_ADD_RELAXED(&drsh_gb_stats.grown_bytes, cap - buff->cap);
+    }
+    else {
+        DRSH_ADD_RELAXED(&drsh_gb_stats.trims, 1);
+        DRSH_ADD_RELAXED(&drsh_gb_stats.trimmed_bytes, buff->cap - cap);
+    }
     buff->data = p;
-    buff->cap = new_cap;
+    buff->cap = cap;
     return EC_OK;
 }
 
+//
+// Makes the capacity at least `cap` bytes, without rounding up. For when
+// the final size is known up front.
+//
+DRSH_INLINE
+DRSH_WARN_UNUSED
+DrshEC
+drsh_gb_reserve(DrshGrowBuffer* buff, size_t cap){
+    if(cap <= buff->cap) return EC_OK;
+    return drsh_gb_realloc(buff, cap);
+}
+
+//
+// Makes room for `sz` more bytes. The capacity at least doubles each time,
+// so appending a byte at a time is amortized O(1).
+//
+DRSH_INLINE
+DRSH_WARN_UNUSED
+DrshEC
+drsh_gb_ensure(DrshGrowBuffer* buff, size_t sz){
+    if(buff->count + sz <= buff->cap) return EC_OK;
+    size_t new_cap = buff->cap * 2;
+    if(new_cap < buff->count + sz) new_cap = buff->count + sz;
+    if(new_cap < 64) new_cap = 64;
+    return drsh_gb_realloc(buff, new_cap);
+}
+
+// Like drsh_gb_ensure, but grows by at least `grow_amount`.
 DRSH_INLINE
 DRSH_WARN_UNUSED
 DrshEC
 drsh_gb_ensure2(DrshGrowBuffer* buff, size_t sz, size_t grow_amount){
     if(buff->count + sz <= buff->cap) return EC_OK;
-    size_t new_cap = buff->cap + grow_amount;
-    void* p = buff->data?realloc(buff->data, new_cap):malloc(new_cap);
-    if(!p) return EC_OOM;
-    buff->data = p;
-    buff->cap = new_cap;
-    return EC_OK;
+    size_t new_cap = buff->cap * 2;
+    if(new_cap < buff->cap + grow_amount) new_cap = buff->cap + grow_amount;
+    if(new_cap < buff->count + sz) new_cap = buff->count + sz;
+    return drsh_gb_realloc(buff, new_cap);
+}
+
+//
+// Gives memory back from a buffer that grew for one big use, shrinking it
+// to `keep` bytes (or its count, if more). Meant for scratch buffers
+// between commands.
+//
+DRSH_INLINE
+void
+drsh_gb_trim(DrshGrowBuffer* buff, size_t keep){
+    if(buff->cap <= keep) return;
+    size_t cap = buff->count > keep? buff->count : keep;
+    if(cap == buff->cap) return;
+    DrshEC err = drsh_gb_realloc(buff, cap);
+    (void)err; // It's fine to keep the bigger one.
 }
 
 DRSH_FORCE_INLINE
@@ -843,58 +1053,358 @@ drsh_rb_iendswith2(DrshReadBuffer rb, const void* mem, size_t len){
     return 1;
 }
 
-typedef struct DrshAtom DrshAtom;
+//
+// Chunked bump allocator.
+//
+// Chunks are never moved or reallocated, so pointers handed out by the
+// arena stay valid until the whole arena is released. There is no way to
+// free an individual allocation.
+//
+typedef struct DrshArenaChunk DrshArenaChunk;
+struct DrshArenaChunk {
+    DrshArenaChunk*_Nullable next;
+    size_t cap;
+    size_t used;
+    // Keep data maximally aligned.
+    union {
+        void* p;
+        uint64_t u;
+        double d;
+    } data[];
+};
 
-typedef struct DrshInput DrshInput;
-struct DrshInput {
-    DrshGrowBuffer read_buffer;
-    size_t read_cursor;
-    DrshGrowBuffer write_buffer;
-    size_t write_cursor;
-    DrshReadBuffer prompt;
-    size_t prompt_display_len;
-    _Bool needs_redisplay;
-    _Bool needs_clear_screen;
+typedef struct DrshArena DrshArena;
+struct DrshArena {
+    DrshArenaChunk*_Nullable chunks; // newest first
+    size_t chunk_size; // 0 means use the default
+    size_t nchunks;
+    size_t used;
+    size_t cap;
+};
 
-    size_t hist_start; // marks previously loaded history
-    DrshGrowBuffer hist_buffer;
-    size_t hist_cursor;
-    DrshGrowBuffer prompt_buffer;
-    size_t prompt_visual_len;
+enum {DRSH_ARENA_DEFAULT_CHUNK = 64*1024};
 
-    _Bool tab_completion;
-    DrshGrowBuffer tab_completions;
-    size_t tab_completion_cursor;
+DRSH_INLINE
+void*_Nullable
+drsh_arena_alloc(DrshArena* arena, size_t sz, size_t align){
+    assert(align && !(align & (align-1)));
+    DrshArenaChunk* c = arena->chunks;
+    if(c){
+        size_t off = (c->used + align-1) & ~(align-1);
+        if(off <= c->cap && sz <= c->cap - off){
+            c->used = off + sz;
+            arena->used += sz;
+            return (char*)c->data + off;
+        }
+    }
+    size_t chunk_size = arena->chunk_size?arena->chunk_size:DRSH_ARENA_DEFAULT_CHUNK;
+    size_t cap = sz > chunk_size? sz : chunk_size;
+    DrshArenaChunk* n = malloc(sizeof *n + cap);
+    if(!n) return NULL;
+    n->cap = cap;
+    n->used = sz;
+    n->next = c;
+    arena->chunks = n;
+    arena->nchunks++;
+    arena->used += sz;
+    arena->cap += cap;
+    return n->data;
+}
+
+//
+// Makes sure the next sz bytes of allocations (including alignment padding)
+// come out of the current chunk without allocating.
+//
+DRSH_INLINE
+DRSH_WARN_UNUSED
+DrshEC
+drsh_arena_reserve(DrshArena* arena, size_t sz){
+    DrshArenaChunk* c = arena->chunks;
+    if(c && c->cap - c->used >= sz) return EC_OK;
+    size_t chunk_size = arena->chunk_size?arena->chunk_size:DRSH_ARENA_DEFAULT_CHUNK;
+    size_t cap = sz > chunk_size? sz : chunk_size;
+    DrshArenaChunk* n = malloc(sizeof *n + cap);
+    if(!n) return EC_OOM;
+    n->cap = cap;
+    n->used = 0;
+    n->next = c;
+    arena->chunks = n;
+    arena->nchunks++;
+    arena->cap += cap;
+    return EC_OK;
+}
+
+typedef struct DrshArenaMark DrshArenaMark;
+struct DrshArenaMark {
+    DrshArenaChunk*_Nullable chunk;
+    size_t chunk_used;
+    size_t used;
 };
 
-enum {
-    CMD_MOVE_HOME             = -1,   // ctrl-a, home
-    CMD_MOVE_LEFT             = -2,   // ctrl-b, left arrow
-    CMD_INTERRUPT             = -3,   // ctrl-c
-    CMD_DELETE_FORWARD_OR_EOF = -4,   // ctrl-d
-    CMD_MOVE_END              = -5,   // ctrl-e
-    CMD_MOVE_RIGHT            = -6,   // ctrl-f, right arrow
-    CMD_CTRL_G                = -7,   // ctrl-g
-    CMD_DELETE_BACK           = -8,   // ctrl-h, backspace
-    CMD_TAB                   = -9,   // tab, ctrl-i
-    CMD_ACCEPT                = -10,  // ctrl-j, newline
-    CMD_KILL_END_OF_LINE      = -11,  // ctrl-k
-    CMD_CLEAR_SCREEN          = -12,  // ctrl-l
-    CMD_ENTER                 = -13,  // ctrl-m, enter
-    CMD_MOVE_DOWN             = -14,  // ctrl-n, down arrow
-    CMD_CTRL_O                = -15,  // ctrl-o
-    CMD_MOVE_UP               = -16,  // ctrl-p, up arrow
-    CMD_CTRL_Q                = -17,  // ctrl-q
-    CMD_CTRL_R                = -18,  // ctrl-r
-    CMD_CTRL_S                = -19,  // ctrl-s
-    CMD_CTRL_T                = -20,  // ctrl-t
-    CMD_CTRL_U                = -21,  // ctrl-u
-    CMD_CTRL_V                = -22,  // ctrl-v
-    CMD_CTRL_W                = -23,  // ctrl-w
-    CMD_CTRL_X                = -24,  // ctrl-x
-    CMD_CTRL_Y                = -25,  // ctrl-y
-    CMD_CTRL_Z                = -26,  // ctrl-z
-    CMD_ESC                   = -27,  // escape
+DRSH_INLINE
+DrshArenaMark
+drsh_arena_mark(const DrshArena* arena){
+    DrshArenaChunk* c = arena->chunks;
+    return (DrshArenaMark){c, c?c->used:0, arena->used};
+}
+
+//
+// Releases everything allocated since the mark was taken. Marks nest, but
+// releasing invalidates any marks taken after the one being released to.
+//
+DRSH_INLINE
+void
+drsh_arena_release(DrshArena* arena, DrshArenaMark mark){
+    DrshArenaChunk* c = arena->chunks;
+    while(c && c != mark.chunk){
+        DrshArenaChunk* next = c->next;
+        // Releasing everything, keep the oldest chunk around to be reused.
+        if(!next && !mark.chunk) break;
+        arena->nchunks--;
+        arena->cap -= c->cap;
+        free(c);
+        c = next;
+    }
+    arena->chunks = c;
+    if(c) c->used = c == mark.chunk? mark.chunk_used : 0;
+    arena->used = mark.used;
+}
+
+DRSH_INLINE
+void
+drsh_arena_free_all(DrshArena* arena){
+    for(DrshArenaChunk* c = arena->chunks; c;){
+        DrshArenaChunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    arena->chunks = NULL;
+    arena->nchunks = 0;
+    arena->used = 0;
+    arena->cap = 0;
+}
+
+#ifdef _WIN32
+typedef SRWLOCK DrshMutex;
+
+DRSH_FORCE_INLINE
+void
+drsh_mutex_init(DrshMutex* m){
+    InitializeSRWLock(m);
+}
+
+DRSH_FORCE_INLINE
+void
+drsh_mutex_lock(DrshMutex* m){
+    AcquireSRWLockExclusive(m);
+}
+
+DRSH_FORCE_INLINE
+void
+drsh_mutex_unlock(DrshMutex* m){
+    ReleaseSRWLockExclusive(m);
+}
+#else
+typedef pthread_mutex_t DrshMutex;
+
+DRSH_FORCE_INLINE
+void
+drsh_mutex_init(DrshMutex* m){
+    pthread_mutex_init(m, NULL);
+}
+
+DRSH_FORCE_INLINE
+void
+drsh_mutex_lock(DrshMutex* m){
+    pthread_mutex_lock(m);
+}
+
+DRSH_FORCE_INLINE
+void
+drsh_mutex_unlock(DrshMutex* m){
+    pthread_mutex_unlock(m);
+}
+#endif
+
+//
+// Open addressing hash index, used by the environment. The atom table
+// has its own variant that can be read while it is being written to (see
+// DrshAtomShard).
+//
+// The index only maps hashes to 1-based positions in an array owned by the
+// user of the index. The capacity is always a power of two and probing is
+// linear. The full hash of each item is kept inline next to its position,
+// so a probe only needs to look at the item itself when the hashes match
+// and growing never has to touch the items at all.
+//
+// Lookups are open-coded by the users of the index:
+//
+//    size_t mask = hi->cap-1;
+//    for(size_t s = hash & mask; hi->slots[s].idx; s = (s+1) & mask){
+//        if(hi->slots[s].hash != hash) continue;
+//        ... compare item hi->slots[s].idx-1 ...
+//    }
+//
+typedef struct DrshHashSlot DrshHashSlot;
+struct DrshHashSlot {
+    uint32_t hash;
+    uint32_t idx; // 0 means empty
+};
+
+typedef struct DrshHashIndex DrshHashIndex;
+struct DrshHashIndex {
+    DrshHashSlot*_Nullable slots;
+    size_t cap; // 0 or a power of two
+};
+
+// Whether the index needs to grow before holding `count` items.
+DRSH_FORCE_INLINE
+_Bool
+drsh_hi_full(const DrshHashIndex* hi, size_t count){
+    return count*4 >= hi->cap*3;
+}
+
+DRSH_FORCE_INLINE
+void
+drsh_hi_insert(DrshHashIndex* hi, uint32_t hash, uint32_t idx){
+    size_t mask = hi->cap-1;
+    size_t s = hash & mask;
+    while(hi->slots[s].idx)
+        s = (s+1) & mask;
+    hi->slots[s] = (DrshHashSlot){hash, idx};
+}
+
+DRSH_INLINE
+void
+drsh_hi_clear(DrshHashIndex* hi){
+    if(hi->cap) memset(hi->slots, 0, hi->cap * sizeof *hi->slots);
+}
+
+//
+// Reallocates the index with the given capacity (a power of two) and
+// re-inserts everything in it.
+//
+DRSH_INLINE
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hi_resize(DrshHashIndex* hi, size_t cap){
+    assert(cap && !(cap & (cap-1)));
+    DrshHashSlot* slots = calloc(cap, sizeof *slots);
+    if(!slots) return EC_OOM;
+    DrshHashIndex new_hi = {slots, cap};
+    for(size_t i = 0; i < hi->cap; i++){
+        DrshHashSlot s = hi->slots[i];
+        if(s.idx) drsh_hi_insert(&new_hi, s.hash, s.idx);
+    }
+    free(hi->slots);
+    *hi = new_hi;
+    return EC_OK;
+}
+
+// Makes sure there is room for one more item.
+DRSH_INLINE
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hi_reserve1(DrshHashIndex* hi, size_t count){
+    if(!drsh_hi_full(hi, count+1)) return EC_OK;
+    return drsh_hi_resize(hi, hi->cap?2*hi->cap:32);
+}
+
+// The slot holding idx, which must be in the index under hash.
+DRSH_FORCE_INLINE
+size_t
+drsh_hi_find_slot(const DrshHashIndex* hi, uint32_t hash, uint32_t idx){
+    size_t mask = hi->cap-1;
+    size_t s = hash & mask;
+    while(hi->slots[s].idx != idx){
+        assert(hi->slots[s].idx);
+        s = (s+1) & mask;
+    }
+    return s;
+}
+
+//
+// Empties slot s. Rather than leaving a tombstone, the slots after it in
+// its run move back to fill the gap, so probes stay as short as if the
+// item had never been inserted.
+//
+DRSH_INLINE
+void
+drsh_hi_remove_slot(DrshHashIndex* hi, size_t s){
+    size_t mask = hi->cap-1;
+    for(size_t t = (s+1) & mask; hi->slots[t].idx; t = (t+1) & mask){
+        size_t home = hi->slots[t].hash & mask;
+        // Leave it if its home is cyclically in (s, t].
+        if(((t - home) & mask) < ((t - s) & mask))
+            continue;
+        hi->slots[s] = hi->slots[t];
+        s = t;
+    }
+    hi->slots[s] = (DrshHashSlot){0};
+}
+
+// Shrinks the index if it is mostly empty after a removal.
+DRSH_INLINE
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hi_shrink(DrshHashIndex* hi, size_t count){
+    if(hi->cap <= 32 || count*8 >= hi->cap) return EC_OK;
+    return drsh_hi_resize(hi, hi->cap/2);
+}
+
+typedef struct DrshAtom DrshAtom;
+
+typedef struct DrshInput DrshInput;
+struct DrshInput {
+    DrshGrowBuffer read_buffer;
+    size_t read_cursor;
+    DrshGrowBuffer write_buffer;
+    size_t write_cursor;
+    DrshReadBuffer prompt;
+    size_t prompt_display_len;
+    _Bool needs_redisplay;
+    _Bool needs_clear_screen;
+
+    size_t hist_start; // marks previously loaded history
+    uint64_t hist_file_size; // of the history file when it was loaded
+    DrshGrowBuffer hist_buffer;
+    size_t hist_cursor;
+    DrshGrowBuffer prompt_buffer;
+    size_t prompt_visual_len;
+
+    _Bool tab_completion;
+    DrshGrowBuffer tab_completions;
+    size_t tab_completion_cursor;
+};
+
+enum {
+    CMD_MOVE_HOME             = -1,   // ctrl-a, home
+    CMD_MOVE_LEFT             = -2,   // ctrl-b, left arrow
+    CMD_INTERRUPT             = -3,   // ctrl-c
+    CMD_DELETE_FORWARD_OR_EOF = -4,   // ctrl-d
+    CMD_MOVE_END              = -5,   // ctrl-e
+    CMD_MOVE_RIGHT            = -6,   // ctrl-f, right arrow
+    CMD_CTRL_G                = -7,   // ctrl-g
+    CMD_DELETE_BACK           = -8,   // ctrl-h, backspace
+    CMD_TAB                   = -9,   // tab, ctrl-i
+    CMD_ACCEPT                = -10,  // ctrl-j, newline
+    CMD_KILL_END_OF_LINE      = -11,  // ctrl-k
+    CMD_CLEAR_SCREEN          = -12,  // ctrl-l
+    CMD_ENTER                 = -13,  // ctrl-m, enter
+    CMD_MOVE_DOWN             = -14,  // ctrl-n, down arrow
+    CMD_CTRL_O                = -15,  // ctrl-o
+    CMD_MOVE_UP               = -16,  // ctrl-p, up arrow
+    CMD_CTRL_Q                = -17,  // ctrl-q
+    CMD_CTRL_R                = -18,  // ctrl-r
+    CMD_CTRL_S                = -19,  // ctrl-s
+    CMD_CTRL_T                = -20,  // ctrl-t
+    CMD_CTRL_U                = -21,  // ctrl-u
+    CMD_CTRL_V                = -22,  // ctrl-v
+    CMD_CTRL_W                = -23,  // ctrl-w
+    CMD_CTRL_X                = -24,  // ctrl-x
+    CMD_CTRL_Y                = -25,  // ctrl-y
+    CMD_CTRL_Z                = -26,  // ctrl-z
+    CMD_ESC                   = -27,  // escape
     CMD_NOP                   = -28,
     // CMD_BACKSPACE             = -127, // backspace
     CMD_DELETE_FORWARD        = -128, // delete
@@ -928,6 +1438,12 @@ DRSH_INTERNAL DrshEC drsh_inp_input_one(DrshInput* inp, unsigned char c);
     apply(exit) \
     apply(source) \
     apply(time) \
+    apply(stats) \
+    apply(export) \
+    apply(local) \
+    apply(unset) \
+    apply(hash) \
+    apply(bench) \
     apply(PWD) \
     apply(HOME) \
     apply(PATH) \
@@ -940,6 +1456,7 @@ DRSH_INTERNAL DrshEC drsh_inp_input_one(DrshInput* inp, unsigned char c);
     apply(SHLVL) \
     apply(DRSH_HISTORY) \
     apply(DRSH_CONFIG) \
+    apply(DRSH_PATH_INDEX) \
     apply(debug) \
     apply(on) \
     apply(off) \
@@ -956,22 +1473,219 @@ enum {
     ATOM_MAX,
 };
 
+enum {
+    // Atoms are spread over the shards by the top bits of their hash, so
+    // threads interning different strings rarely contend.
+    DRSH_AT_SHARD_BITS = 4,
+    DRSH_AT_SHARDS = 1 << DRSH_AT_SHARD_BITS,
+    // How many slots a shard starts out with, without allocating.
+    DRSH_AT_INITIAL_CAP = 16,
+    DRSH_AT_CHUNK_SIZE = 16*1024,
+};
+
 typedef struct DrshAtom DrshAtom;
+
+//
+// A shard's index: the same layout as DrshHashIndex, but it owns the array
+// of atoms the slots point into, so both can be swapped out at once.
+//
+typedef struct DrshAtomSlots DrshAtomSlots;
+struct DrshAtomSlots {
+    size_t cap; // of slots, a power of two
+    DrshHashSlot* slots;
+    DrshAtom*_Nonnull* atoms; // room for 3/4 of cap
+};
+
+//
+// Lookups don't take the lock. They load `slots` and probe it like any
+// other linear probing table. That is safe as slots only ever go from
+// empty to full, and the atom and hash are written before the slot's idx
+// is published. Growing publishes a bigger copy and, if other threads
+// might still be probing the old one, parks it on `retired` until they
+// can't be (see drsh_at_set_concurrent).
+//
+typedef struct DrshAtomShard DrshAtomShard;
+struct DrshAtomShard {
+    DrshAtomSlots* slots;
+    size_t count;
+    DrshArena arena; // backing storage for the atoms themselves
+    DrshMutex lock; // held to insert, when the table is concurrent
+    DrshGrowBuffer retired; // DrshAtomSlots*
+    DrshAtomSlots initial;
+    DrshHashSlot initial_slots[DRSH_AT_INITIAL_CAP];
+    DrshAtom*_Nonnull initial_atoms[DRSH_AT_INITIAL_CAP*3/4];
+};
+
+//
+// Atom snapshots
+//
+// At exit the history is saved next to the history file as packed atoms
+// with a prebuilt index, which the next shell maps read-only instead of
+// atomizing every line again. The file is laid out as:
+//
+//    DrshSnapshotHeader
+//    DrshHashSlot slots[cap];       positions in offsets, like DrshHashIndex
+//    uint32_t offsets[count];       of each atom, from the start of the file,
+//                                   ascending
+//    uint32_t history[hist_count];  positions in offsets
+//    the atoms, 8 byte aligned, with iatom always NULL
+//
+// Mapped ("frozen") atoms are never written to or collected, their twins
+// are kept in DrshAtomSnapshot.iatoms instead. The shards
+// are searched before the snapshot, so anything interned before it was
+// mapped shadows its frozen copy.
+//
+enum {DRSH_SNAPSHOT_VERSION = 1};
+#define DRSH_SNAPSHOT_MAGIC "DRSHATOM"
+#define DRSH_SNAPSHOT_SUFFIX ".atoms"
+
+typedef struct DrshSnapshotHeader DrshSnapshotHeader;
+struct DrshSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_kind; // the hashes in the index depend on this
+    uint32_t atom_size; // sizeof(DrshAtom), catches layout changes
+    uint32_t checksum; // hash of everything after the header
+    uint64_t size; // of the whole file
+    uint32_t cap;
+    uint32_t count;
+    uint32_t hist_count;
+    uint32_t pad;
+    // The history file as of writing this. If it changed since, the
+    // history has to be read from it instead.
+    uint64_t hist_size;
+    int64_t hist_mtime;
+};
+
+typedef struct DrshAtomSnapshot DrshAtomSnapshot;
+struct DrshAtomSnapshot {
+    const char*_Nullable base; // NULL if nothing is mapped
+    size_t size;
+    const DrshSnapshotHeader* header;
+    const DrshHashSlot* slots;
+    const uint32_t* offsets;
+    const uint32_t* history;
+    // The twins of the frozen atoms, by index. The mapping is read-only,
+    // so they are cached here instead.
+    const DrshAtom*_Nullable*_Nullable iatoms;
+};
+
 typedef struct DrshAtomTable DrshAtomTable;
 struct DrshAtomTable {
-    void* data;
-    size_t cap;
-    size_t count;
+    DrshAtomShard shards[DRSH_AT_SHARDS];
+    DrshAtomSnapshot frozen;
+    _Bool concurrent; // other threads may be interning, see drsh_at_set_concurrent
+    size_t folds; // iatoms computed so far
+    size_t fold_twins; // of those, how many needed a separate atom
     const DrshAtom*_Nonnull special[ATOM_MAX];
+    // The twins of the special atoms. Their static storage is shared by
+    // every table, so it can't hold pointers into this one.
+    const DrshAtom*_Nullable special_iatom[ATOM_MAX];
+    // garbage collection
+    size_t gc_threshold; // collect at idle once count reaches this
+    size_t gc_runs;
+    size_t gc_last_atoms, gc_last_bytes; // reclaimed by the last run
+    size_t gc_total_atoms, gc_total_bytes;
 };
 
 struct DrshAtom {
     uint32_t len;
     uint32_t hash;
-    const DrshAtom* iatom;
+    // The case-folded twin. NULL until someone asks for it, use
+    // drsh_at_iatom instead of reading this directly.
+    const DrshAtom*_Nullable iatom;
     char txt[];
 };
 
+//
+// The special atoms live in static storage instead of the arena, at the
+// index given by their ATOM_ enum, and are never collected. Every table
+// shares them and spreads them over its shards like any other atom. The
+// hash depends on which hash function gets picked at runtime, so the
+// first drsh_at_init fills it in. Twins differ per table, so they are
+// kept in DrshAtomTable.special_iatom and iatom here stays NULL.
+//
+// A DrshAtom can't be defined statically with its text, so this is laid
+// out the same way, with room for the text.
+//
+typedef struct DrshStaticAtom DrshStaticAtom;
+struct DrshStaticAtom {
+    uint32_t len;
+    uint32_t hash;
+    const DrshAtom*_Nullable iatom;
+    char txt[24];
+};
+_Static_assert(offsetof(DrshStaticAtom, len) == offsetof(DrshAtom, len), "DrshStaticAtom must be laid out like DrshAtom");
+_Static_assert(offsetof(DrshStaticAtom, hash) == offsetof(DrshAtom, hash), "DrshStaticAtom must be laid out like DrshAtom");
+_Static_assert(offsetof(DrshStaticAtom, iatom) == offsetof(DrshAtom, iatom), "DrshStaticAtom must be laid out like DrshAtom");
+_Static_assert(offsetof(DrshStaticAtom, txt) == offsetof(DrshAtom, txt), "DrshStaticAtom must be laid out like DrshAtom");
+_Static_assert(_Alignof(DrshStaticAtom) == _Alignof(DrshAtom), "DrshStaticAtom must be laid out like DrshAtom");
+
+static DrshStaticAtom drsh_static_atoms[ATOM_MAX] = {
+    #define X(x) [ATOM_##x] = {.len = -1+sizeof #x, .txt = #x},
+    ATOM_X(X)
+    #undef X
+    [ATOM_DOT] = {.len = -1+sizeof ".", .txt = "."},
+};
+
+DRSH_FORCE_INLINE
+DrshAtom*
+drsh_static_atom(size_t id){
+    return (DrshAtom*)(void*)&drsh_static_atoms[id];
+}
+
+// A name that exactly fills txt would silently lose its nul terminator.
+#define X(x) _Static_assert(sizeof #x <= sizeof drsh_static_atoms[0].txt, "special atom '" #x "' is too long");
+ATOM_X(X)
+#undef X
+
+DRSH_FORCE_INLINE
+_Bool
+drsh_atom_frozen(const DrshAtomTable* at, const DrshAtom* a){
+    const char* p = (const char*)a;
+    const char* base = at->frozen.base;
+    return base && p >= base && p < base + at->frozen.size;
+}
+
+// Returns the ATOM_ id of the atom, or ATOM_MAX if it isn't special.
+DRSH_FORCE_INLINE
+size_t
+drsh_atom_special_id(const DrshAtom* a){
+    uintptr_t p = (uintptr_t)a;
+    uintptr_t begin = (uintptr_t)drsh_static_atoms;
+    if(p < begin || p >= begin + sizeof drsh_static_atoms) return ATOM_MAX;
+    return (p - begin) / sizeof *drsh_static_atoms;
+}
+
+// Where the twin of the atom is cached.
+DRSH_FORCE_INLINE
+const DrshAtom*_Nullable*
+drsh_at_twin_slot(DrshAtomTable* at, const DrshAtom* a){
+    size_t id = drsh_atom_special_id(a);
+    if(id != ATOM_MAX) return &at->special_iatom[id];
+    if(drsh_atom_frozen(at, a)){
+        // Frozen atoms all start at one of the offsets, which ascend.
+        const DrshAtomSnapshot* snap = &at->frozen;
+        uint32_t off = (uint32_t)((const char*)a - snap->base);
+        size_t lo = 0, hi = snap->header->count-1;
+        while(lo < hi){
+            size_t mid = lo + (hi-lo)/2;
+            if(snap->offsets[mid] < off) lo = mid+1;
+            else hi = mid;
+        }
+        return &snap->iatoms[lo];
+    }
+    // We own all atoms in the table, they are only const to everyone else.
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wcast-qual"
+    return &((DrshAtom*)a)->iatom;
+    #pragma GCC diagnostic pop
+}
+
+// While collecting garbage, the top bit of len marks an atom in the old
+// arena that has already been copied; its iatom then points to the copy.
+enum {DRSH_ATOM_FORWARDED = 0x80000000u};
+
 DRSH_FORCE_INLINE
 DrshStringView
 drsh_atom_sv(const DrshAtom* a){
@@ -1000,25 +1714,242 @@ int
 drsh_atom_icmp(const void* a_, const void* b_){
     const DrshAtom* a = *(const DrshAtom*const*)a_;
     const DrshAtom* b = *(const DrshAtom*const*)b_;
-    return drsh_atom_cmp(&a->iatom, &b->iatom);
+    if(a == b) return 0;
+    // Same ordering as comparing the folded twins, without needing them.
+    for(size_t i = 0;; i++){
+        unsigned ca = 0x20|(unsigned)(unsigned char)a->txt[i];
+        unsigned cb = 0x20|(unsigned)(unsigned char)b->txt[i];
+        if(!a->txt[i]) ca = 0;
+        if(!b->txt[i]) cb = 0;
+        if(ca != cb) return ca < cb? -1 : 1;
+        if(!ca) return 0;
+    }
 }
 
 DRSH_INTERNAL
 _Bool
 drsh_atom_ieq(const DrshAtom* a, const DrshAtom* b){
-    return a->iatom == b->iatom;
+    if(a->iatom && b->iatom) return a->iatom == b->iatom;
+    return a->len == b->len && drsh_atom_icmp(&a, &b) == 0;
 }
 
+typedef struct DrshPathCacheEntry DrshPathCacheEntry;
+struct DrshPathCacheEntry {
+    const DrshAtom* name;
+    const DrshAtom*_Nullable path; // NULL if it isn't on PATH
+    size_t hits;
+};
+
+typedef struct DrshDirStamp DrshDirStamp;
+struct DrshDirStamp {
+    uint64_t size;
+    int64_t mtime; // 0 if the directory doesn't exist
+};
+
+//
+// A directory on PATH and the names in it, as of when its stamp was
+// taken.
+//
+typedef struct DrshPathDir DrshPathDir;
+struct DrshPathDir {
+    // The directory is this span of DrshPathCache.path, so it survives
+    // the atom being moved by the gc.
+    uint32_t off, len;
+    DrshDirStamp stamp;
+    _Bool scanned;
+    // Relative to the current directory, so it has to be read again
+    // after cd (see drsh_path_cache_chdir).
+    _Bool relative;
+    DrshGrowBuffer names; // nul-terminated names of the files in it
+};
+
+//
+// Where the first file with this name on PATH is: in dirs[dir], at
+// off in its names.
+//
+typedef struct DrshPathName DrshPathName;
+struct DrshPathName {
+    uint32_t dir;
+    uint32_t off;
+    uint32_t len;
+};
+
+//
+// Shared PATH indexes
+//
+// With DRSH_PATH_INDEX set to a directory owned by the user that only they
+// can write to, the names read from the directories on PATH are also saved
+// there, in a file per PATH, so other shells on the host can take them
+// instead of reading the directories themselves. A directory's names are
+// only taken if its stamp is the same as when they were read. Files are
+// written whole and renamed into place, so readers need no locks and
+// concurrent writers only replace each other's work. The file is laid out
+// as:
+//
+//    DrshPathIndexHeader
+//    DrshPathIndexDir dirs[ndirs]
+//    each directory and then its names, nul-terminated
+//
+enum {DRSH_PATH_INDEX_VERSION = 1};
+#define DRSH_PATH_INDEX_MAGIC "DRSHPATH"
+
+typedef struct DrshPathIndexHeader DrshPathIndexHeader;
+struct DrshPathIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum; // hash of everything after the header
+    uint64_t size; // of the whole file
+    uint32_t ndirs;
+    uint32_t pad;
+};
+
+typedef struct DrshPathIndexDir DrshPathIndexDir;
+struct DrshPathIndexDir {
+    DrshDirStamp stamp;
+    // From the start of the file. The directory is not nul-terminated.
+    uint32_t dir_off, dir_len;
+    uint32_t names_off, names_len;
+};
+
+#ifdef DRSH_IO_URING
+enum {
+    DRSH_STAT_RING_ENTRIES = 32,
+};
+
+//
+// An io_uring for stat'ing the directories on PATH all at once instead of
+// one after another, so a few slow ones (network mounts) are waited on
+// together.
+//
+typedef struct DrshStatRing DrshStatRing;
+struct DrshStatRing {
+    _Bool tried; // whether setting it up was attempted
+    int fd; // -1 if io_uring isn't available
+    void*_Nullable sq_ring;
+    void*_Nullable cq_ring; // same as sq_ring if the kernel maps them together
+    struct io_uring_sqe*_Nullable sqes;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    struct statx results[DRSH_STAT_RING_ENTRIES];
+};
+#endif
+
+enum {
+    // How long the directories on PATH are trusted not to have changed
+    // before their stamps are checked again, so running a lot of commands
+    // in a row doesn't stat them for every one.
+    DRSH_PATH_RECHECK_NS = 100*1000*1000,
+    // Seconds: a directory modified this recently could still change
+    // without its mtime changing, so its names aren't shared yet.
+    DRSH_PATH_INDEX_SETTLE = 2,
+    // A directory that takes this long to stat is on something slow (like
+    // a network mount), so they are stat'd all at once from then on.
+    DRSH_SLOW_STAT_NS = 1000*1000,
+    // How many threads stat and read slow directories at once when
+    // io_uring can't be used.
+    DRSH_PATH_THREADS = 8,
+    // How many directories on PATH are stamped at once.
+#ifdef DRSH_IO_URING
+    DRSH_PATH_STAMP_BATCH = DRSH_STAT_RING_ENTRIES,
+#else
+    DRSH_PATH_STAMP_BATCH = 32,
+#endif
+};
+
+//
+// Where commands were found on PATH, or that they weren't, so running a
+// command doesn't search PATH again. It is all dropped when PATH (or
+// PATHEXT) is set to something else or a directory on PATH changes.
+//
+// On posix, commands are found with an index of every file on PATH,
+// built by reading each directory once. Only directories whose stamp
+// changed are read again.
+//
+typedef struct DrshPathCache DrshPathCache;
+struct DrshPathCache {
+    // What PATH and PATHEXT were when it was filled. Atoms are interned,
+    // so comparing pointers catches every way they can change.
+    const DrshAtom*_Nullable path;
+    const DrshAtom*_Nullable pathext;
+    DrshGrowBuffer entries; // DrshPathCacheEntry
+    DrshHashIndex index; // of entries, by the hash of name
+    DrshGrowBuffer dirs; // DrshPathDir of each directory on path
+    DrshGrowBuffer names; // DrshPathName of each name on PATH
+    DrshHashIndex name_index; // of names, by the hash of the name
+    uint64_t checked_ns; // when dirs were last compared
+    size_t lookups, hits, flushes, scans;
+    size_t shared_loads; // directories taken from a shared index
+    size_t dir_stats, stat_batches, thread_batches;
+    // Stat'ing through the ring or on threads costs more than stat for
+    // directories that are already cached, so it is only done once they
+    // were slow.
+    _Bool slow_dirs;
+#ifdef DRSH_IO_URING
+    DrshStatRing ring;
+#endif
+};
+
+//
+// A variable set for the duration of one command (FOO=bar cmd) on top of
+// the environment.
+//
+typedef struct DrshEnvOverlay DrshEnvOverlay;
+struct DrshEnvOverlay {
+    const DrshAtom* key;
+    const DrshAtom*_Nullable value; // NULL if unset for the layer
+    uint32_t hash; // see drsh_env_key_hash
+};
+
+enum {
+    // Slot of a variable that only the shell sees.
+    DRSH_ENV_LOCAL = UINT32_MAX,
+    // Slot of an exported variable not yet in envp.
+    DRSH_ENV_UNPLACED = UINT32_MAX-1,
+};
+
 typedef struct DrshEnvironment DrshEnvironment;
 struct DrshEnvironment {
     DrshAtomTable* at;
     DrshGrowBuffer cwd;
     DrshGrowBuffer tmp;
     const DrshAtom*_Nullable home;
-    void* data;
-    size_t cap;
+    void* data; // key, value pairs of atoms (see raw for NULL values)
+    size_t cap; // of pairs
     size_t count;
-    _Bool sorted;
+    DrshHashIndex index;
+    // Positions of the pairs in data, sorted by key (folded if case
+    // insensitive). Pairs never move, so adding one only inserts its
+    // position here.
+    uint32_t*_Nullable order;
+    // Per pair, DRSH_ENV_LOCAL if it isn't exported to spawned processes,
+    // otherwise (on posix) where its string is in envp.
+    uint32_t*_Nullable slots;
+    // Per pair, the "KEY=VALUE" string from the environment the shell was
+    // started with, or NULL. Inherited values are only atomized when
+    // something reads them, until then their atom is NULL. On posix,
+    // envp points at these instead of copying them.
+    char*_Nullable*_Nullable raw;
+    // The environment as handed to spawned processes, so spawning doesn't
+    // rebuild it every time. On posix this is the NULL terminated array
+    // of "KEY=VALUE" strings of the exported pairs, patched by set_env.
+    // The strings are malloced, except for the raw ones. On windows it is
+    // the sorted block CreateProcess wants, rebuilt after any change to an
+    // exported pair.
+    DrshGrowBuffer envp;
+    _Bool envp_valid;
+    // Set while drsh_env_init imports the environment, which sorts the
+    // order once at the end instead of inserting into it for each pair.
+    _Bool importing;
+    // DrshEnvOverlays shadowing the variables above, pushed and popped in
+    // layers (see drsh_env_push_layer). Lookups check these first, newest
+    // first, so they are meant to stay short.
+    DrshGrowBuffer overlays;
+    // envp with the overlays merged in, made for each spawn while there
+    // are any.
+    DrshGrowBuffer overlay_envp;
+    DrshPathCache path_cache;
     _Bool case_insensitive;
     _Bool debug;
     int cols, lines;
@@ -1030,20 +1961,60 @@ DRSH_WARN_UNUSED
 DrshEC
 drsh_env_init(DrshEnvironment* env, DrshAtomTable* at, void* envp_, _Bool windows_style);
 
-DRSH_INTERNAL
-void
-drsh_env_sort_env(DrshEnvironment* env);
 
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
 drsh_env_set_env(DrshEnvironment* env, const DrshAtom* key, const DrshAtom* value);
 
+//
+// Sets the variable to value, or if value is NULL, to what follows the
+// '=' in raw (see DrshEnvironment.raw). New variables are exported if
+// export_new.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set(DrshEnvironment* env, const DrshAtom* key, const DrshAtom*_Nullable value, char*_Nullable raw, _Bool export_new);
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
 drsh_env_set_env3(DrshEnvironment* env, const DrshAtom* key, const char* value_txt, size_t value_len);
 
+//
+// Like drsh_env_set_env, but if the variable isn't already set it is not
+// exported. For the variables the shell keeps for itself.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set_local(DrshEnvironment* env, const DrshAtom* key, const DrshAtom* value);
+
+//
+// Removes the variable. If it is shadowed by a layer, it is only unset
+// until the layer is popped.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_unset(DrshEnvironment* env, const char* key, size_t len);
+
+//
+// Sets whether the variable is passed to spawned processes. Variables
+// only set in a layer always are.
+//
+// Errors:
+// -------
+// EC_NOT_FOUND if the variable isn't set.
+// EC_VALUE_ERROR if it can't be made local because it is only set in a
+// layer.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set_exported(DrshEnvironment* env, const DrshAtom* key, _Bool exported);
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
@@ -1053,14 +2024,112 @@ DRSH_INTERNAL
 const DrshAtom*_Nullable
 drsh_env_get_env(DrshEnvironment* env, const DrshAtom* key);
 
+//
+// Starts a layer of variables that shadow the environment until it is
+// popped. Setting a shadowed variable changes the layer's copy.
+//
+// Returns:
+// --------
+// The mark to pass to drsh_env_pop_layer.
+//
+DRSH_FORCE_INLINE
+size_t
+drsh_env_push_layer(DrshEnvironment* env){
+    return env->overlays.count;
+}
+
+//
+// Adds a variable to the current layer.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set_overlay(DrshEnvironment* env, const DrshAtom* key, const DrshAtom* value);
+
+//
+// Drops every variable added since the layer was pushed.
+//
+DRSH_FORCE_INLINE
+void
+drsh_env_pop_layer(DrshEnvironment* env, size_t mark){
+    env->overlays.count = mark;
+}
+
+//
+// Looks up the variable by name without interning it, so looking up names
+// that aren't set doesn't leave atoms behind.
+//
 DRSH_INTERNAL
 const DrshAtom*_Nullable
 drsh_env_get_env2(DrshEnvironment* env, const char* key, size_t len);
 
+//
+// The hash a variable name is indexed under. Case insensitive
+// environments hash the folded name, so any spelling of a name probes the
+// same slots and a miss is as cheap as a hit.
+//
+DRSH_INTERNAL
+uint32_t
+drsh_env_name_hash(const DrshEnvironment* env, const char* txt, size_t len);
+
+enum {DRSH_ENV_FOLD_CHUNK = 256};
+
+// Same, for a name that is already an atom.
+DRSH_FORCE_INLINE
+uint32_t
+drsh_env_key_hash(const DrshEnvironment* env, const DrshAtom* key){
+    if(!env->case_insensitive) return key->hash;
+    if(key->len <= DRSH_ENV_FOLD_CHUNK){
+        // Saves folding it again if the twin is already around.
+        const DrshAtom* twin = DRSH_LOAD_ACQUIRE(&key->iatom);
+        if(twin) return twin->hash;
+    }
+    return drsh_env_name_hash(env, key->txt, key->len);
+}
+
+//
+// Finds the entry for the name, given its drsh_env_name_hash.
+//
+// Returns:
+// --------
+// Its index or (size_t)-1 if it is not set.
+//
+DRSH_INTERNAL
+size_t
+drsh_env_find_idx(const DrshEnvironment* env, uint32_t hash, const char* key, size_t len);
+
+//
+// Same, but for the newest overlay for the name.
+//
+DRSH_INTERNAL
+DrshEnvOverlay*_Nullable
+drsh_env_find_overlay(DrshEnvironment* env, uint32_t hash, const char* key, size_t len);
+
+// Whether the key names the variable, ignoring case if the environment
+// does.
+DRSH_INTERNAL
+_Bool
+drsh_env_key_eq(const DrshEnvironment* env, const DrshAtom* atom, const char* key, size_t len);
+
 DRSH_INTERNAL
 void*_Nullable
 drsh_env_get_envp(DrshEnvironment* env, _Bool windows_style);
 
+//
+// Brings the cached envp up to date after entry i was changed, or added
+// if is_new.
+//
+DRSH_INTERNAL
+void
+drsh_env_patch_envp(DrshEnvironment* env, size_t i, _Bool is_new);
+
+//
+// Drops the cached envp, so it is rebuilt on the next spawn.
+//
+DRSH_INTERNAL
+void
+drsh_env_invalidate_envp(DrshEnvironment* env);
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
@@ -1080,16 +2149,113 @@ DRSH_WARN_UNUSED
 DrshEC
 drsh_env_get_history_path(DrshEnvironment* env, const DrshAtom**);
 
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_atomize(DrshAtomTable*restrict at, const char* restrict txt, size_t length, const DrshAtom**restrict out_atom);
+
+//
+// The hash the atom for the string has. Zero is reserved for empty slots.
+//
 DRSH_FORCE_INLINE
-const DrshAtom*
-drsh_unsafe_string_to_atom(const char* p){
-    return (const DrshAtom*)(p - sizeof(DrshAtom));
+uint32_t
+drsh_atom_hash(const char* txt, size_t length){
+    uint32_t hash = drsh_hash_align1(txt, length);
+    if(!hash) hash = 1024;
+    return hash;
 }
 
+//
+// Like drsh_at_atomize, but doesn't intern the string if it is not already
+// in the table.
+//
+// Returns:
+// --------
+// The atom for the string or NULL if there is none.
+//
+DRSH_INTERNAL
+const DrshAtom*_Nullable
+drsh_at_lookup(const DrshAtomTable* at, const char* txt, size_t length);
+
+//
+// Total number of atoms in the table.
+//
+DRSH_INTERNAL
+size_t
+drsh_at_count(const DrshAtomTable* at);
+
+//
+// Switches whether other threads may intern and look up atoms at the
+// same time as this one. Only call it while no other thread is using the
+// table. Turning it off frees the indexes that were grown past while
+// concurrent. The table can't be collected while concurrent.
+// tests/stress_at.c (make check) exercises this mode.
+//
+DRSH_INTERNAL
+void
+drsh_at_set_concurrent(DrshAtomTable* at, _Bool concurrent);
+
+//
+// Maps the snapshot at path, if it is valid, so its atoms can be found by
+// lookups. Only one snapshot can be mapped at a time.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_map_snapshot(DrshAtomTable* at, const char* path);
+
+//
+// Unmaps the snapshot. Any frozen atoms still referenced dangle after
+// this, so it is only for shutting down.
+//
+DRSH_INTERNAL
+void
+drsh_at_unmap_snapshot(DrshAtomTable* at);
+
+//
+// Gets the case-folded twin of the atom, interning it on first use.
+// Atoms without any bytes to fold are their own twin.
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_at_atomize(DrshAtomTable*restrict at, const char* restrict txt, size_t length, const DrshAtom**restrict out_atom);
+drsh_at_iatom(DrshAtomTable* at, const DrshAtom* atom, const DrshAtom** out_iatom);
+
+//
+// Compacting garbage collection of the atom table.
+//
+// Live atoms are copied into a fresh arena and the old arena is released.
+// Everything outside of the table that holds onto atoms must be passed to
+// drsh_at_gc_forward between drsh_at_gc_begin and drsh_at_gc_end, which
+// rewrites the pointer to the moved atom. Any atom not reachable this way
+// is dangling afterwards, so only collect when nothing else is live (in
+// between commands). drsh_at_gc_begin reserves room for every atom up
+// front, so if it fails nothing has been touched and forwarding can't fail.
+//
+typedef struct DrshAtomGc DrshAtomGc;
+struct DrshAtomGc {
+    DrshAtomTable* at;
+    DrshArena old_arenas[DRSH_AT_SHARDS];
+    size_t old_count;
+    size_t old_bytes;
+};
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_gc_begin(DrshAtomTable* at, DrshAtomGc* gc);
+
+DRSH_INTERNAL
+void
+drsh_at_gc_forward(DrshAtomGc* gc, const DrshAtom*_Nullable*_Nonnull atom);
+
+DRSH_INTERNAL
+void
+drsh_at_gc_end(DrshAtomGc* gc);
+
+DRSH_INTERNAL
+void
+drsh_collect_garbage(DrshAtomTable* at, DrshEnvironment* env, DrshInput* inp);
 
 
 typedef struct DrshToken DrshToken;
@@ -1101,6 +2267,9 @@ struct DrshToken {
 typedef struct DrshTokenized DrshTokenized;
 struct DrshTokenized {
     DrshGrowBuffer token_buffer;
+    // Owns the expanded arguments of the line being run (and any lines
+    // it runs in turn, like with source), released once it is done.
+    DrshArena argv_arena;
 };
 
 typedef struct DrshTermState DrshTermState;
@@ -1118,12 +2287,31 @@ drsh_process_line(const DrshReadBuffer *rb, DrshEnvironment* env, DrshAtomTable*
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_source_file(const DrshAtom* path, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp);
+drsh_execute(const DrshArgv* argv, size_t nassign, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *t, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp);
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_source_file(const char* path, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp);
+
+//
+// How many of the leading tokens are `NAME=value` assignments. This has to
+// be decided on the tokens as written, so that quoted or expanded words
+// that happen to look like one are still arguments.
+//
+DRSH_INTERNAL
+size_t
+drsh_tokens_assignments(DrshReadBuffer toks);
 
+//
+// Expands the tokens into argv, allocated out of arena. scratch is used
+// as temporary storage. The first nassign tokens are assignments, which
+// are expanded but not globbed, so they stay one argument each.
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_tokens_to_argv(DrshReadBuffer toks, DrshEnvironment* env, DrshAtomTable* at, DrshGrowBuffer* outbuff);
+drsh_tokens_to_argv(DrshReadBuffer toks, size_t nassign, DrshEnvironment* env, DrshArena* arena, DrshGrowBuffer* scratch, DrshArgv* argv);
 
 
 DRSH_INTERNAL
@@ -1167,6 +2355,40 @@ DRSH_WARN_UNUSED
 DrshEC
 drsh_read_file(const char*restrict filepath, DrshGrowBuffer* outbuff);
 
+//
+// Maps the whole file read-only.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_map_file(const char* path, const void*_Nullable*_Nonnull out, size_t* size);
+
+DRSH_INTERNAL
+void
+drsh_unmap_file(const void* p, size_t size);
+
+//
+// Gets the size and modification time of the file, to tell whether it
+// changed.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_file_stamp(const char* path, uint64_t* size, int64_t* mtime);
+
+//
+// Writes the file under a temporary name and renames it over path, so
+// readers never see it half written. Each writer creates its own temporary
+// file, so shells replacing the same file at once don't write into (and
+// truncate under the readers of) each other's. The file is created with
+// mode (before the umask), and never through a symlink planted at the
+// temporary name.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_write_file_replacing(const char* path, const void* data, size_t length, unsigned mode);
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
@@ -1296,15 +2518,115 @@ DRSH_WARN_UNUSED
 DrshEC
 drsh_hist_dump(const DrshInput* input, DrshEnvironment* env);
 
+//
+// Maps the atom snapshot saved alongside the history file and loads the
+// history from it. Returns EC_NOT_FOUND if the history file changed since
+// the snapshot was written, in which case the snapshot stays mapped (to
+// save interning most of the lines again), but the history has to be
+// read from the file.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hist_load_snapshot(DrshInput* inp, DrshAtomTable* at, const DrshAtom* hist_path);
+
+//
+// Writes the history as an atom snapshot for the next shell to map.
+// Unmaps the current snapshot, so only call this on the way out.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hist_save_snapshot(DrshInput* inp, DrshAtomTable* at, DrshEnvironment* env);
+
+//
+// What a command cost, for `time`.
+//
+typedef struct DrshProcStats DrshProcStats;
+struct DrshProcStats {
+    uint64_t wall_ns;
+    uint64_t user_us, system_us;
+    uint64_t max_rss; // in bytes
+    // posix_spawn shares the shell's memory until the exec (like vfork),
+    // and the child's high water mark carries over from that, so max_rss
+    // is at least the shell's own. When it is no more than that, it says
+    // nothing about the command.
+    _Bool max_rss_floored;
+    uint64_t minor_faults, major_faults; // all faults are minor on windows
+    uint64_t voluntary_switches, involuntary_switches;
+    uint64_t blocks_in, blocks_out;
+    // Bytes and calls through read and write (like) syscalls, from
+    // /proc/<pid>/io on linux or GetProcessIoCounters on windows.
+    _Bool have_io;
+    uint64_t read_chars, write_chars, read_calls, write_calls;
+    // What actually went to or came from storage (linux only).
+    _Bool have_disk_io;
+    uint64_t read_bytes, write_bytes;
+    int exit_code; // or -signal if it was killed by one
+};
+
+enum DrshSpawnFlags {
+    // Give it /dev/null (NUL) as stdin, stdout and stderr instead of the
+    // terminal.
+    DRSH_SPAWN_NULL_STDIO = 0x1,
+};
+typedef enum DrshSpawnFlags DrshSpawnFlags;
+
+//
+// Runs the command and waits for it. If stats is given, it is filled in
+// with what the command cost, and it is an error if the command couldn't
+// be started.
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_spawn_process_and_wait(DrshTermState* ts, DrshEnvironment* env, DrshGrowBuffer* tmp, const char*const* argv, _Bool report_time);
+drsh_spawn_process_and_wait(DrshTermState* ts, DrshEnvironment* env, DrshGrowBuffer* tmp, const DrshArgv* argv, DrshProcStats*_Nullable stats, unsigned flags);
 
+//
+// Writes the path of the program to run into tmp, nul-terminated.
+// Programs without a directory are searched for on PATH, through the
+// path cache.
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const DrshAtom* program, _Bool windows_style);
+drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, DrshStringView program, _Bool windows_style);
+
+//
+// Drops the cached location of the program, and makes the next lookup
+// check the directories on PATH instead of trusting the index, which
+// would just give the same location again.
+//
+// Returns:
+// --------
+// Whether it was cached.
+//
+DRSH_INTERNAL
+_Bool
+drsh_path_cache_forget(DrshPathCache* pc, const char* name, size_t len);
+
+//
+// Empties the path cache, keeping its statistics.
+//
+DRSH_INTERNAL
+void
+drsh_path_cache_clear(DrshPathCache* pc);
+
+//
+// The current directory changed, so relative directories on PATH are now
+// other directories. Marks them as unread and makes the next lookup check,
+// which flushes what was found through them.
+//
+DRSH_INTERNAL
+void
+drsh_path_cache_chdir(DrshPathCache* pc);
+
+//
+// Nanoseconds from an arbitrary starting point, for measuring intervals.
+//
+DRSH_INTERNAL
+uint64_t
+drsh_monotonic_ns(void);
 
 #ifdef _WIN32
 #define MAIN(argc, argv) main(argc, argv)
@@ -1356,17 +2678,14 @@ MAIN(int argc, char** argv){
         const DrshAtom* config_path;
         err = drsh_at_atomize(&at, env.tmp.data, env.tmp.count, &config_path);
         if(err) return 1;
-        err = drsh_env_set_env(&env, DRSH_CONFIG, config_path);
+        err = drsh_env_set_local(&env, DRSH_CONFIG, config_path);
         if(err) return 1;
-        err = drsh_source_file(config_path, &env, &at, &tokens, &tok_argv, &ts, &tmp);
+        err = drsh_source_file(config_path->txt, &env, &at, &tokens, &tok_argv, &ts, &tmp);
         if(err == EC_EXIT) return 0;
         err = EC_OK;
     }
     for(int i = 1; i < argc; i++){
-        const DrshAtom* path;
-        err = drsh_at_atomize(&at, argv[i], strlen(argv[i]), &path);
-        if(err) return 1;
-        err = drsh_source_file(path, &env, &at, &tokens, &tok_argv, &ts, &tmp);
+        err = drsh_source_file(argv[i], &env, &at, &tokens, &tok_argv, &ts, &tmp);
         if(err == EC_EXIT) return 0;
         err = EC_OK;
     }
@@ -1374,7 +2693,11 @@ MAIN(int argc, char** argv){
     {
         const DrshAtom* drsh_history_path;
         err = drsh_env_get_history_path(&env, &drsh_history_path);
-        if(!err){
+        if(!err && drsh_hist_load_snapshot(&input, &at, drsh_history_path) == EC_OK){
+            input.hist_start = input.hist_cursor;
+            input.hist_file_size = at.frozen.header->hist_size;
+        }
+        else if(!err){
             drsh_gb_clear(&tmp);
             err = drsh_read_file(drsh_history_path->txt, &tmp);
             if(!err){
@@ -1394,6 +2717,7 @@ MAIN(int argc, char** argv){
                     }
                 }
                 input.hist_start = input.hist_cursor;
+                input.hist_file_size = tmp.count;
             }
             else {
                 drsh_ts_printf(&ts, "error reading: %s\r\n", drsh_history_path->txt);
@@ -1404,6 +2728,13 @@ MAIN(int argc, char** argv){
         }
     }
     for(;;){
+        if(drsh_at_count(&at) >= at.gc_threshold)
+            drsh_collect_garbage(&at, &env, &input);
+        // Give back whatever the last command needed beyond the usual.
+        drsh_gb_trim(&tmp, DRSH_GB_IDLE_CAP);
+        drsh_gb_trim(&env.tmp, DRSH_GB_IDLE_CAP);
+        drsh_gb_trim(&ts.tmp, DRSH_GB_IDLE_CAP);
+        drsh_gb_trim(&input.tab_completions, DRSH_GB_IDLE_CAP);
         DrshReadBuffer input_line;
         err = drsh_read_line(&ts, &termbuff, &input, &env, &input_line);
         if(ts.in_is_terminal && ts.out_is_terminal) drsh_ts_write(&ts, "\r\n", 2);
@@ -1423,6 +2754,7 @@ MAIN(int argc, char** argv){
             break;
     }
     err = drsh_hist_dump(&input, &env);
+    if(!err) err = drsh_hist_save_snapshot(&input, &at, &env);
     (void)err;
     Lfinish:;
     err = drsh_ts_orig(&ts);
@@ -1519,6 +2851,21 @@ drsh_rb_to_cmd(const DrshReadBuffer* rb, int* cmd){
     return 0;
 }
 
+//
+// Moves the unread input to the front of the read buffer, so it only has
+// to hold what hasn't been consumed yet.
+//
+DRSH_INTERNAL
+void
+drsh_inp_compact_read_buffer(DrshInput* inp){
+    size_t cursor = inp->read_cursor;
+    if(!cursor) return;
+    DrshGrowBuffer* b = &inp->read_buffer;
+    memmove(b->data, b->data+cursor, b->count-cursor);
+    b->count -= cursor;
+    inp->read_cursor = 0;
+}
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
@@ -1540,7 +2887,8 @@ drsh_read_one(DrshTermState* ts, DrshInput* inp, int* cmd){
             }
         }
         DrshEC err = EC_OK;
-        err = drsh_gb_ensure(&inp->read_buffer, inp->read_cursor+8000);
+        drsh_inp_compact_read_buffer(inp);
+        err = drsh_gb_ensure(&inp->read_buffer, 8000);
         if(err) return err;
         DrshWriteBuffer tb = drsh_gb_writable_buffer(&inp->read_buffer);
         #ifdef _WIN32
@@ -1739,7 +3087,8 @@ drsh_read_line(DrshTermState* ts, DrshGrowBuffer* termbuff, DrshInput* inp, Drsh
             }
         }
     }
-    err = drsh_gb_ensure(&inp->read_buffer, inp->read_cursor+8000);
+    drsh_inp_compact_read_buffer(inp);
+    err = drsh_gb_ensure(&inp->read_buffer, 8000);
     if(err) return err;
     DrshWriteBuffer tb = drsh_gb_writable_buffer(&inp->read_buffer);
     #ifdef _WIN32
@@ -2155,7 +3504,7 @@ DRSH_INTERNAL void drsh_readdir(const DrshAtom*_Nullable pwd, DrshStringView dir
         else if(de->d_type == DT_LNK){
             drsh_gb_clear(tmp);
             drsh_make_dirname(pwd, dirname, tmp);
-            err = drsh_gb_append(tmp, "/", 1);
+            err = drsh_gb_append_(tmp, "/", 1);
             if(err) continue;
             err = drsh_gb_append_(tmp, name, len+1);
             if(err) continue;
@@ -2450,7 +3799,7 @@ drsh_tokenize_line(const DrshReadBuffer *rb, DrshTokenized *t){
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_canonicalize(DrshAtomTable* at, DrshGrowBuffer* tmp, const DrshToken* tok, const DrshAtom**atom, _Bool backslash_is_sep, DrshEnvironment* env){
+drsh_canonicalize(DrshGrowBuffer* tmp, const DrshToken* tok, _Bool backslash_is_sep, DrshEnvironment* env){
     DrshEC err = EC_OK;
     const char* p = tok->txt;
     const char* end = tok->txt + tok->length;
@@ -2552,25 +3901,74 @@ drsh_canonicalize(DrshAtomTable* at, DrshGrowBuffer* tmp, const DrshToken* tok,
             }
         }
     }
-    DrshReadBuffer rb = drsh_gb_readable_buffer(tmp);
-    err = drsh_at_atomize(at, rb.ptr, rb.length, atom);
-    return err;
+    // nul-terminate, but leave it out of the count
+    err = drsh_gb_append_(tmp, "\0", 1);
+    if(err) return err;
+    tmp->count--;
+    return EC_OK;
 }
 
-
+//
+// Copies the argument into the arena and records it in scratch.
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_tokens_to_argv(DrshReadBuffer toks, DrshEnvironment* env, DrshAtomTable* at, DrshGrowBuffer* outbuff){
-    DrshEC err = drsh_gb_ensure(outbuff, sizeof(char *)*(1+toks.length/sizeof(DrshToken)));
-    if(err) return err;
-    static DrshGrowBuffer tmp;
+drsh_argv_push(DrshArena* arena, DrshGrowBuffer* scratch, const char* txt, size_t length){
+    char* p = drsh_arena_alloc(arena, length+1, 1);
+    if(!p) return EC_OOM;
+    memcpy(p, txt, length);
+    p[length] = 0;
+    DrshStringView sv = {.length=length, .txt=p};
+    return drsh_gb_append_(scratch, &sv, sizeof sv);
+}
+
+//
+// If txt is a `NAME=value` word, returns the length of NAME, otherwise 0.
+//
+DRSH_INTERNAL
+size_t
+drsh_assignment_name_len(const char* txt, size_t len){
+    size_t i = 0;
+    for(; i < len; i++){
+        char c = txt[i];
+        if(c == '=') return i;
+        if(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            continue;
+        if(i && c >= '0' && c <= '9')
+            continue;
+        return 0;
+    }
+    return 0;
+}
+
+DRSH_INTERNAL
+size_t
+drsh_tokens_assignments(DrshReadBuffer toks){
+    size_t n = 0;
     for(EACH_RB(toks, const DrshToken, tok)){
-        const DrshAtom* atom;
-        err = drsh_canonicalize(at, &tmp, tok, &atom, IS_WINDOWS, env);
+        if(!drsh_assignment_name_len(tok->txt, tok->length)) break;
+        n++;
+    }
+    return n;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_tokens_to_argv(DrshReadBuffer toks, size_t nassign, DrshEnvironment* env, DrshArena* arena, DrshGrowBuffer* scratch, DrshArgv* argv){
+    DrshEC err = EC_OK;
+    drsh_gb_clear(scratch);
+    static DrshGrowBuffer tmp;
+    size_t n = 0;
+    for(EACH_RB(toks, const DrshToken, tok)){
+        err = drsh_canonicalize(&tmp, tok, IS_WINDOWS, env);
         if(err) return err;
-        const char* p = atom->txt;
-        // also does globbing need to happen here?
+        if(n++ < nassign){
+            err = drsh_argv_push(arena, scratch, tmp.data, tmp.count);
+            if(err) return err;
+            continue;
+        }
 #if !defined(_WIN32)
     int flags = 0
         | GLOB_BRACE // FIXME: glob(3) doesn't do brace expansion correctly
@@ -2578,49 +3976,58 @@ drsh_tokens_to_argv(DrshReadBuffer toks, DrshEnvironment* env, DrshAtomTable* at
         | GLOB_NOCHECK
         ;
         glob_t g = {0};
-        int e = glob(p, flags, NULL, &g);
+        int e = glob(tmp.data, flags, NULL, &g);
         if(!e) for(size_t i = 0; i < g.gl_pathc; i++){
-            const DrshAtom* a;
-            err = drsh_at_atomize(at, g.gl_pathv[i], strlen(g.gl_pathv[i]), &a);
-            if(err) return err;
-            p = a->txt;
-            err = drsh_gb_append_(outbuff, &p, sizeof p);
-            if(err) return err;
+            err = drsh_argv_push(arena, scratch, g.gl_pathv[i], strlen(g.gl_pathv[i]));
+            if(err) break;
         }
         globfree(&g);
+        if(err) return err;
 #else
         // On Windows, programs are supposed to expand wildcards themselves.
-        err = drsh_gb_append_(outbuff, &p, sizeof p);
+        err = drsh_argv_push(arena, scratch, tmp.data, tmp.count);
         if(err) return err;
 #endif
     }
-    char* p = NULL;
-    err = drsh_gb_append_(outbuff, &p, sizeof p);
-    if(err) return err;
+    DrshReadBuffer rb = drsh_gb_readable_buffer(scratch);
+    size_t count = rb.length / sizeof(DrshStringView);
+    const char** ptrs = drsh_arena_alloc(arena, (count+1)*sizeof *ptrs, _Alignof(const char*));
+    if(!ptrs) return EC_OOM;
+    size_t* lens = drsh_arena_alloc(arena, (count?count:1)*sizeof *lens, _Alignof(size_t));
+    if(!lens) return EC_OOM;
+    const DrshStringView* svs = rb.ptr;
+    for(size_t i = 0; i < count; i++){
+        ptrs[i] = svs[i].txt;
+        lens[i] = svs[i].length;
+    }
+    ptrs[count] = NULL;
+    argv->length = count+1;
+    argv->ptr = ptrs;
+    argv->lens = lens;
     return EC_OK;
 }
 
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_build_windows_command_line(DrshGrowBuffer* b, const char*const* argv){
+drsh_build_windows_command_line(DrshGrowBuffer* b, const DrshArgv* argv){
     DrshEC err = EC_OK;
-    for(const char*const* p = argv; *p; p++){
-        const DrshAtom* a = drsh_unsafe_string_to_atom(*p);
-        if(p == argv){
-            err = drsh_gb_sprintf(b, "\"%.*s\"", (int)a->len, a->txt);
+    for(size_t i = 0; argv->ptr[i]; i++){
+        DrshStringView a = {.length=argv->lens[i], .txt=argv->ptr[i]};
+        if(!i){
+            err = drsh_gb_sprintf(b, "\"%.*s\"", (int)a.length, a.txt);
             if(err) return err;
             continue;
         }
         err = drsh_gb_append_(b, " ", 1);
         if(err) return err;
-        if(memchr(a->txt, ' ', a->len) || memchr(a->txt, '\t', a->len)){
-            err = drsh_gb_sprintf(b, "\"%.*s\"", (int)a->len, a->txt);
+        if(memchr(a.txt, ' ', a.length) || memchr(a.txt, '\t', a.length)){
+            err = drsh_gb_sprintf(b, "\"%.*s\"", (int)a.length, a.txt);
             if(err) return err;
             continue;
         }
         else {
-            err = drsh_gb_append_(b, a->txt, a->len);
+            err = drsh_gb_append_(b, a.txt, a.length);
             if(err) return err;
             continue;
         }
@@ -2630,23 +4037,63 @@ drsh_build_windows_command_line(DrshGrowBuffer* b, const char*const* argv){
     return err;
 }
 
+#ifdef __linux__
+// Fills in the io counts of the (exited, but not reaped) process.
+DRSH_INTERNAL
+void
+drsh_read_proc_io(pid_t pid, DrshProcStats* stats){
+    char buff[512];
+    snprintf(buff, sizeof buff, "/proc/%ld/io", (long)pid);
+    int fd = open(buff, O_RDONLY|O_CLOEXEC);
+    if(fd < 0) return;
+    ssize_t n = read(fd, buff, sizeof buff - 1);
+    close(fd);
+    if(n <= 0) return;
+    buff[n] = 0;
+    struct {
+        const char* key;
+        uint64_t* value;
+    } fields[] = {
+        {"rchar", &stats->read_chars},
+        {"wchar", &stats->write_chars},
+        {"syscr", &stats->read_calls},
+        {"syscw", &stats->write_calls},
+        {"read_bytes", &stats->read_bytes},
+        {"write_bytes", &stats->write_bytes},
+    };
+    for(char* line = buff; line && *line;){
+        char* colon = strchr(line, ':');
+        if(!colon) break;
+        for(size_t i = 0; i < sizeof fields / sizeof fields[0]; i++){
+            if((size_t)(colon - line) == strlen(fields[i].key) && memcmp(line, fields[i].key, colon - line) == 0){
+                *fields[i].value = strtoull(colon+1, NULL, 10);
+                if(i < 4) stats->have_io = 1;
+                else stats->have_disk_io = 1;
+            }
+        }
+        line = strchr(colon, '\n');
+        if(line) line++;
+    }
+}
+#endif
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_spawn_process_and_wait(DrshTermState* ts, DrshEnvironment* env, DrshGrowBuffer* tmp, const char*const* argv, _Bool report_time){
-    (void)report_time;
+drsh_spawn_process_and_wait(DrshTermState* ts, DrshEnvironment* env, DrshGrowBuffer* tmp, const DrshArgv* args, DrshProcStats*_Nullable stats, unsigned flags){
+    const char*const* argv = args->ptr;
     if(!argv[0]) return EC_VALUE_ERROR;
     void* envp = drsh_env_get_envp(env, IS_WINDOWS);
     DrshEC err;
     drsh_gb_clear(tmp);
-    err = drsh_env_resolve_prog_path(env, tmp, drsh_unsafe_string_to_atom(argv[0]), IS_WINDOWS);
+    err = drsh_env_resolve_prog_path(env, tmp, (DrshStringView){.length=args->lens[0], .txt=argv[0]}, IS_WINDOWS);
     if(err) {
         drsh_ts_printf(ts, "Unable to resolve program path for '%s'\r\n", argv[0]);
         return err;
     }
 #ifdef _WIN32
     size_t cmd_cursor = tmp->count;
-    err = drsh_build_windows_command_line(tmp, argv);
+    err = drsh_build_windows_command_line(tmp, args);
     if(err) return err;
     char* prog = tmp->data;
     char* cmd = tmp->data + cmd_cursor;
@@ -2658,12 +4105,21 @@ drsh_spawn_process_and_wait(DrshTermState* ts, DrshEnvironment* env, DrshGrowBuf
         .hStdError = GetStdHandle(STD_ERROR_HANDLE),
     };
     PROCESS_INFORMATION proc = {0};
+    HANDLE null_handle = INVALID_HANDLE_VALUE;
+    if(flags & DRSH_SPAWN_NULL_STDIO){
+        SECURITY_ATTRIBUTES sa = {.nLength = sizeof sa, .bInheritHandle = TRUE};
+        null_handle = CreateFileA("NUL", GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+        if(null_handle == INVALID_HANDLE_VALUE) return EC_IO_ERROR;
+        startup.hStdInput = startup.hStdOutput = startup.hStdError = null_handle;
+    }
     err = drsh_ts_orig(ts);
     if(env->debug){
         drsh_ts_printf(ts, "spawning '%s'\r\n", prog);
         drsh_ts_printf(ts, "cmd '%s'\r\n", cmd);
     }
+    uint64_t start = drsh_monotonic_ns();
     BOOL b = CreateProcessA(prog, cmd, NULL, NULL, TRUE, 0, envp, NULL, &startup, &proc);
+    if(null_handle != INVALID_HANDLE_VALUE) CloseHandle(null_handle);
     err = drsh_ts_unknown(ts);
     if(err) return err;
     if(!b){
@@ -2671,39 +4127,98 @@ drsh_spawn_process_and_wait(DrshTermState* ts, DrshEnvironment* env, DrshGrowBuf
         return EC_VALUE_ERROR;
     }
     WaitForSingleObject(proc.hProcess, INFINITE);
+    if(stats){
+        *stats = (DrshProcStats){.wall_ns = drsh_monotonic_ns() - start};
+        FILETIME created, exited, kernel, user;
+        if(GetProcessTimes(proc.hProcess, &created, &exited, &kernel, &user)){
+            // In 100ns ticks.
+            stats->user_us = ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime)/10;
+            stats->system_us = ((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)/10;
+        }
+        PROCESS_MEMORY_COUNTERS mem;
+        if(K32GetProcessMemoryInfo(proc.hProcess, &mem, sizeof mem)){
+            stats->max_rss = mem.PeakWorkingSetSize;
+            stats->minor_faults = mem.PageFaultCount;
+        }
+        IO_COUNTERS io;
+        if(GetProcessIoCounters(proc.hProcess, &io)){
+            stats->have_io = 1;
+            stats->read_chars = io.ReadTransferCount;
+            stats->write_chars = io.WriteTransferCount;
+            stats->read_calls = io.ReadOperationCount;
+            stats->write_calls = io.WriteOperationCount;
+        }
+        DWORD code;
+        if(GetExitCodeProcess(proc.hProcess, &code))
+            stats->exit_code = (int)code;
+    }
     CloseHandle(proc.hProcess);
     CloseHandle(proc.hThread);
     return EC_OK;
 #else
     int e;
     pid_t pid;
-    // posix_spawn_file_actions_t actions_;
-    // e = posix_spawn_file_actions_init(&actions_);
-    // assert(!e);
+    posix_spawn_file_actions_t actions_;
     posix_spawn_file_actions_t* actions = NULL;
+    if(flags & DRSH_SPAWN_NULL_STDIO){
+        e = posix_spawn_file_actions_init(&actions_);
+        if(e) return EC_OOM;
+        actions = &actions_;
+        e = posix_spawn_file_actions_addopen(actions, 0, "/dev/null", O_RDONLY, 0);
+        if(!e) e = posix_spawn_file_actions_addopen(actions, 1, "/dev/null", O_WRONLY, 0);
+        if(!e) e = posix_spawn_file_actions_adddup2(actions, 1, 2);
+        if(e){
+            posix_spawn_file_actions_destroy(actions);
+            return EC_OOM;
+        }
+    }
     posix_spawnattr_t* attrs = NULL;
     // restore term state to expected state
     err = drsh_ts_orig(ts);
-    if(err) return err;
+    if(err) goto Lfinish;
     if(env->debug){
         drsh_ts_printf(ts, "spawning '%s'\r\n", tmp->data);
         for(int i = 0;argv[i]; i++)
             drsh_ts_printf(ts, "argv[%d] '%s'\r\n", i, argv[i]);
     }
+    uint64_t start = drsh_monotonic_ns();
     #pragma GCC diagnostic ignored "-Wcast-qual"
     e = posix_spawn(&pid, tmp->data, actions, attrs, (char*const*)argv, envp);
     #pragma GCC diagnostic error "-Wcast-qual"
+    if(e == ENOENT && drsh_path_cache_forget(&env->path_cache, argv[0], args->lens[0])){
+        // It moved since it was cached, look for it again.
+        drsh_gb_clear(tmp);
+        err = drsh_env_resolve_prog_path(env, tmp, (DrshStringView){.length=args->lens[0], .txt=argv[0]}, IS_WINDOWS);
+        if(!err){
+            #pragma GCC diagnostic ignored "-Wcast-qual"
+            e = posix_spawn(&pid, tmp->data, actions, attrs, (char*const*)argv, envp);
+            #pragma GCC diagnostic error "-Wcast-qual"
+        }
+    }
     // subprocess could've put us in any term state
     err = drsh_ts_unknown(ts);
-    if(err) return err;
+    if(err) goto Lfinish;
     if(e){
         drsh_ts_printf(ts, "\r%s\r\n", strerror(e));
+        if(stats) err = EC_IO_ERROR;
     }
     else {
-        int status;
+        int status = 0;
         int options = 0;
         pid_t p;
         struct rusage usage = {0};
+        uint64_t end = 0;
+        #ifdef __linux__
+        if(stats){
+            // Wait for it to exit without reaping it, so its io counts
+            // can still be read.
+            siginfo_t info;
+            while(waitid(P_PID, pid, &info, WEXITED|WNOWAIT) == -1 && errno == EINTR)
+                ;
+            end = drsh_monotonic_ns();
+            drsh_read_proc_io(pid, stats);
+        }
+        #endif
         for(;;){
             p = wait4(pid, &status, options, &usage);
             if(p == -1){
@@ -2711,102 +4226,422 @@ drsh_spawn_process_and_wait(DrshTermState* ts, DrshEnvironment* env, DrshGrowBuf
             }
             break;
         }
-        if(report_time){
-            drsh_ts_printf(ts, "user   time: %lds%ldµs\r\n", usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec);
-            drsh_ts_printf(ts, "system time: %lds%ldµs\r\n", usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec);
+        if(stats){
+            if(!end) end = drsh_monotonic_ns();
+            stats->wall_ns = end - start;
+            stats->user_us = (uint64_t)usage.ru_utime.tv_sec*1000000 + usage.ru_utime.tv_usec;
+            stats->system_us = (uint64_t)usage.ru_stime.tv_sec*1000000 + usage.ru_stime.tv_usec;
+            #ifdef __APPLE__
+            stats->max_rss = usage.ru_maxrss;
+            #else
+            stats->max_rss = (uint64_t)usage.ru_maxrss*1024;
+            #endif
+            struct rusage self;
+            if(getrusage(RUSAGE_SELF, &self) == 0)
+                stats->max_rss_floored = usage.ru_maxrss <= self.ru_maxrss;
+            stats->minor_faults = usage.ru_minflt;
+            stats->major_faults = usage.ru_majflt;
+            stats->voluntary_switches = usage.ru_nvcsw;
+            stats->involuntary_switches = usage.ru_nivcsw;
+            stats->blocks_in = usage.ru_inblock;
+            stats->blocks_out = usage.ru_oublock;
+            stats->exit_code = WIFSIGNALED(status)? -WTERMSIG(status) : WEXITSTATUS(status);
         }
     }
+    Lfinish:
+    if(actions) posix_spawn_file_actions_destroy(actions);
+    return err;
 #endif
-    return EC_OK;
 }
 
+DRSH_INTERNAL
+const DrshAtom*_Nullable
+drsh_snapshot_find(const DrshAtomSnapshot* snap, uint32_t hash, const char* txt, size_t length){
+    if(!snap->base) return NULL;
+    size_t mask = snap->header->cap-1;
+    for(size_t s = hash & mask; snap->slots[s].idx; s = (s+1) & mask){
+        if(snap->slots[s].hash != hash) continue;
+        const DrshAtom* atom = (const DrshAtom*)(snap->base + snap->offsets[snap->slots[s].idx-1]);
+        if(atom->len == length && memcmp(atom->txt, txt, length) == 0)
+            return atom;
+    }
+    return NULL;
+}
+
+DRSH_FORCE_INLINE
+DrshAtomShard*
+drsh_at_shard(DrshAtomTable* at, uint32_t hash){
+    return &at->shards[hash >> (32 - DRSH_AT_SHARD_BITS)];
+}
+
+DRSH_INTERNAL
+DrshAtom*_Nullable
+drsh_shard_find(const DrshAtomShard* sh, uint32_t hash, const char* txt, size_t length){
+    const DrshAtomSlots* v = DRSH_LOAD_ACQUIRE(&sh->slots);
+    size_t mask = v->cap-1;
+    for(size_t s = hash & mask;; s = (s+1) & mask){
+        uint32_t idx = DRSH_LOAD_ACQUIRE(&v->slots[s].idx);
+        if(!idx) return NULL;
+        if(v->slots[s].hash != hash) continue;
+        DrshAtom* atom = v->atoms[idx-1];
+        if(atom->len == length && memcmp(atom->txt, txt, length) == 0)
+            return atom;
+    }
+}
+
+// Adds the atom as the count'th one.
+DRSH_FORCE_INLINE
+void
+drsh_atom_slots_insert(DrshAtomSlots* v, size_t count, DrshAtom* atom){
+    v->atoms[count] = atom;
+    size_t mask = v->cap-1;
+    size_t s = atom->hash & mask;
+    while(v->slots[s].idx)
+        s = (s+1) & mask;
+    v->slots[s].hash = atom->hash;
+    DRSH_STORE_RELEASE(&v->slots[s].idx, (uint32_t)count+1);
+}
+
+//
+// Publishes a new atom in the shard, growing the slots if needed. The
+// caller holds the lock if concurrent.
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_at_atomize(DrshAtomTable*restrict at, const char* restrict txt, size_t length, const DrshAtom**restrict out_atom){
-    if(length >= UINT32_MAX) return EC_VALUE_ERROR;
-    // if(1){
-    if(at->count * 10/8 >= at->cap){
-        // printf("grow table\r\n");
-        // grow
-        size_t old_cap = at->cap;
-        size_t cap = old_cap?2*old_cap:4;
-        size_t sz = cap*sizeof(DrshAtom*)+2*cap*sizeof(uint32_t);
-        // printf("%zu/%zu\r\n", at->count, at->cap);
-        // printf("%zu -> %zu\r\n", old_cap, cap);
-        void* p = at->data?realloc(at->data, sz): malloc(sz);
-        if(!p) return EC_OOM;
-        DrshAtom** atoms = p;
-        uint32_t* idxes = (uint32_t*)((char*)p + cap*sizeof *atoms);
-        memset(idxes, 0, 2*cap * sizeof *idxes);
-        size_t len = at->count;
-        for(size_t i = 0; i < len; i++){
-            // printf("%zu) %p -> '%s'\r\n", i, atoms[i], atoms[i]->txt);
-            uint32_t hash = atoms[i]->hash;
-            uint32_t idx = drsh_fast_reduce32(hash, cap);
-            // printf("hash -> idx: %u -> %u\r\n", hash, idx);
-            while(idxes[idx]){
-                idx++;
-                if(idx > 2*cap) idx = 0;
+drsh_shard_insert(DrshAtomShard* sh, _Bool concurrent, DrshAtom* atom){
+    DrshAtomSlots* v = sh->slots;
+    if((sh->count+1)*4 >= v->cap*3){
+        size_t cap = 2*v->cap;
+        DrshAtomSlots* n = malloc(sizeof *n + cap*sizeof *n->slots + cap*3/4*sizeof *n->atoms);
+        if(!n) return EC_OOM;
+        n->cap = cap;
+        n->slots = (DrshHashSlot*)(n+1);
+        n->atoms = (DrshAtom**)(n->slots+cap);
+        memset(n->slots, 0, cap*sizeof *n->slots);
+        for(size_t i = 0; i < sh->count; i++)
+            drsh_atom_slots_insert(n, i, v->atoms[i]);
+        if(concurrent && v != &sh->initial){
+            DrshEC err = drsh_gb_append_(&sh->retired, &v, sizeof v);
+            if(err){
+                free(n);
+                return err;
             }
-            idxes[idx] = (uint32_t)i+1;
-        }
-        at->data = p;
-        at->cap = cap;
-    }
-    size_t cap = at->cap;
-    uint32_t hash = drsh_hash_align1(txt, length);
-    if(!hash) hash = 1024;
-    uint32_t idx = drsh_fast_reduce32(hash, cap);
-    // printf("hash -> idx: %u -> %u\r\n", hash, idx);
-    uint32_t i;
-    DrshAtom** atoms = at->data;
-    uint32_t* idxes = (uint32_t*)((char*)at->data + cap*sizeof *atoms);
-    while((i = idxes[idx])){
-        DrshAtom* atom = atoms[i-1];
-        if(atom->hash == hash && atom->len == length && memcmp(atom->txt, txt, length) == 0){
-            *out_atom = atom;
-            return EC_OK;
         }
-        idx++;
-        if(idx > 2*cap) idx = 0;
+        DRSH_STORE_RELEASE(&sh->slots, n);
+        if(!concurrent && v != &sh->initial)
+            free(v);
+        v = n;
     }
-    assert(i == 0);
-    DrshAtom *a = malloc(length+1+sizeof *a);
-    char *b = malloc(length);
-    if(!a || !b) {
-        free(a);
-        free(b);
-        return EC_OOM;
+    drsh_atom_slots_insert(v, sh->count, atom);
+    DRSH_STORE_RELEASE(&sh->count, sh->count+1);
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+void
+drsh_shard_free_retired(DrshAtomShard* sh){
+    DrshAtomSlots** retired = (DrshAtomSlots**)sh->retired.data;
+    size_t len = sh->retired.count / sizeof *retired;
+    for(size_t i = 0; i < len; i++)
+        free(retired[i]);
+    drsh_gb_clear(&sh->retired);
+}
+
+DRSH_INTERNAL
+size_t
+drsh_at_count(const DrshAtomTable* at){
+    size_t count = 0;
+    for(size_t i = 0; i < DRSH_AT_SHARDS; i++)
+        count += DRSH_LOAD_RELAXED(&at->shards[i].count);
+    return count;
+}
+
+DRSH_INTERNAL
+void
+drsh_at_set_concurrent(DrshAtomTable* at, _Bool concurrent){
+    DRSH_STORE_RELEASE(&at->concurrent, concurrent);
+    if(!concurrent){
+        for(size_t i = 0; i < DRSH_AT_SHARDS; i++)
+            drsh_shard_free_retired(&at->shards[i]);
     }
+}
 
-    i = (uint32_t)(at->count++);
-    idxes[idx] = i+1;
+DRSH_INTERNAL
+const DrshAtom*_Nullable
+drsh_at_lookup(const DrshAtomTable* at, const char* txt, size_t length){
+    uint32_t hash = drsh_atom_hash(txt, length);
+    const DrshAtomShard* sh = &at->shards[hash >> (32 - DRSH_AT_SHARD_BITS)];
+    const DrshAtom* a = drsh_shard_find(sh, hash, txt, length);
+    if(!a) a = drsh_snapshot_find(&at->frozen, hash, txt, length);
+    return a;
+}
 
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_atomize(DrshAtomTable*restrict at, const char* restrict txt, size_t length, const DrshAtom**restrict out_atom){
+    if(length >= DRSH_ATOM_FORWARDED) return EC_VALUE_ERROR;
+    uint32_t hash = drsh_atom_hash(txt, length);
+    DrshAtomShard* sh = drsh_at_shard(at, hash);
+    DrshAtom* a = drsh_shard_find(sh, hash, txt, length);
+    if(a){
+        *out_atom = a;
+        return EC_OK;
+    }
+    const DrshAtom* f = drsh_snapshot_find(&at->frozen, hash, txt, length);
+    if(f){
+        *out_atom = f;
+        return EC_OK;
+    }
+    DrshEC err = EC_OK;
+    _Bool concurrent = DRSH_LOAD_ACQUIRE(&at->concurrent);
+    if(concurrent){
+        drsh_mutex_lock(&sh->lock);
+        // Someone might have beaten us to it.
+        a = drsh_shard_find(sh, hash, txt, length);
+        if(a) goto Lfinish;
+    }
+    a = drsh_arena_alloc(&sh->arena, sizeof *a + length + 1, _Alignof(DrshAtom));
+    if(!a){
+        err = EC_OOM;
+        goto Lfinish;
+    }
     a->hash = hash;
     a->len = (uint32_t)length;
     memcpy(a->txt, txt, length);
     a->txt[length] = 0;
     a->iatom = NULL;
-    atoms[i] = a;
-    *out_atom = a;
-    char* btxt = b;
-    _Bool need_recursive_atomize = 0;
-    for(const char *p = txt, *end = txt+length; p != end; p++){
-        if((0x20|(unsigned)(unsigned char)*p) != (unsigned)(unsigned char)*p){
-            need_recursive_atomize = 1;
-        }
-        *btxt++ = (char)(0x20|(unsigned)(unsigned char)*p);
-    }
-    if(need_recursive_atomize){
-        DrshEC err = drsh_at_atomize(at, b, length, &a->iatom);
-        if(err) return err;
+    // On failure the atom is just garbage in the arena.
+    err = drsh_shard_insert(sh, concurrent, a);
+    // printf("atomize: '%.*s' -> %p\r\n", (int)length, txt, a);
+    Lfinish:
+    if(concurrent)
+        drsh_mutex_unlock(&sh->lock);
+    if(!err)
+        *out_atom = a;
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_iatom(DrshAtomTable* at, const DrshAtom* a, const DrshAtom** out_iatom){
+    const DrshAtom*_Nullable* slot = drsh_at_twin_slot(at, a);
+    const DrshAtom* iatom = DRSH_LOAD_ACQUIRE(slot);
+    if(iatom){
+        *out_iatom = iatom;
+        return EC_OK;
     }
-    else {
+    size_t length = a->len;
+    _Bool need_fold = 0;
+    for(size_t i = 0; i < length; i++){
+        unsigned c = (unsigned char)a->txt[i];
+        if((0x20|c) != c){
+            need_fold = 1;
+            break;
+        }
+    }
+    DRSH_ADD_RELAXED(&at->folds, 1);
+    if(!need_fold){
+        DRSH_STORE_RELEASE(slot, a);
+        *out_iatom = a;
+        return EC_OK;
+    }
+    // Racing threads will fold into the same twin, so storing it twice
+    // is harmless.
+    char buff[256];
+    char* b = length <= sizeof buff? buff : malloc(length);
+    if(!b) return EC_OOM;
+    for(size_t i = 0; i < length; i++)
+        b[i] = (char)(0x20|(unsigned)(unsigned char)a->txt[i]);
+    const DrshAtom* twin;
+    DrshEC err = drsh_at_atomize(at, b, length, &twin);
+    if(b != buff) free(b);
+    if(err) return err;
+    // Folded text never needs folding again.
+    DRSH_STORE_RELEASE(drsh_at_twin_slot(at, twin), twin);
+    DRSH_ADD_RELAXED(&at->fold_twins, 1);
+    DRSH_STORE_RELEASE(slot, twin);
+    *out_iatom = twin;
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_gc_begin(DrshAtomTable* at, DrshAtomGc* gc){
+    assert(!at->concurrent);
+    // Live atoms are a subset of the old ones, so the old sizes plus worst
+    // case padding is enough for all of them.
+    DrshArena to[DRSH_AT_SHARDS];
+    for(size_t i = 0; i < DRSH_AT_SHARDS; i++){
+        DrshAtomShard* sh = &at->shards[i];
+        to[i] = (DrshArena){.chunk_size = sh->arena.chunk_size};
+        size_t need = sh->arena.used + sh->count*(_Alignof(DrshAtom)-1);
+        if(!need) continue;
+        if(drsh_arena_reserve(&to[i], need)){
+            for(size_t j = 0; j <= i; j++)
+                drsh_arena_free_all(&to[j]);
+            return EC_OOM;
+        }
+    }
+    gc->at = at;
+    gc->old_count = 0;
+    gc->old_bytes = 0;
+    for(size_t i = 0; i < DRSH_AT_SHARDS; i++){
+        DrshAtomShard* sh = &at->shards[i];
+        gc->old_count += sh->count;
+        gc->old_bytes += sh->arena.used;
+        gc->old_arenas[i] = sh->arena;
+        sh->arena = to[i];
+        sh->count = 0;
+        memset(sh->slots->slots, 0, sh->slots->cap * sizeof *sh->slots->slots);
+        drsh_shard_free_retired(sh);
+    }
+    for(size_t i = 0; i < ATOM_MAX; i++){
+        DrshAtom* a = drsh_static_atom(i);
+        DrshAtomShard* sh = drsh_at_shard(at, a->hash);
+        drsh_atom_slots_insert(sh->slots, sh->count++, a);
+    }
+    // The special atoms are always live, so their twins are too.
+    for(size_t i = 0; i < ATOM_MAX; i++)
+        drsh_at_gc_forward(gc, &at->special_iatom[i]);
+    // So are the frozen atoms.
+    if(at->frozen.base)
+        for(size_t i = 0; i < at->frozen.header->count; i++)
+            drsh_at_gc_forward(gc, &at->frozen.iatoms[i]);
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+void
+drsh_at_gc_forward(DrshAtomGc* gc, const DrshAtom*_Nullable*_Nonnull patom){
+    const DrshAtom* catom = *patom;
+    if(!catom) return;
+    // We own all atoms in the table, they are only const to everyone else.
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wcast-qual"
+    DrshAtom* old = (DrshAtom*)catom;
+    #pragma GCC diagnostic pop
+    if(drsh_atom_special_id(old) != ATOM_MAX) return;
+    if(drsh_atom_frozen(gc->at, old)) return;
+    if(old->len & DRSH_ATOM_FORWARDED){
+        *patom = old->iatom;
+        return;
+    }
+    DrshAtomShard* sh = drsh_at_shard(gc->at, old->hash);
+    size_t length = old->len;
+    // drsh_at_gc_begin reserved room for this in the current chunk.
+    DrshAtom* a = drsh_arena_alloc(&sh->arena, sizeof *a + length + 1, _Alignof(DrshAtom));
+    assert(a);
+    a->len = old->len;
+    a->hash = old->hash;
+    memcpy(a->txt, old->txt, length+1);
+    const DrshAtom* twin = old->iatom;
+    old->len |= DRSH_ATOM_FORWARDED;
+    old->iatom = a;
+
+    // Live atoms are a subset of the old ones, so there is always room.
+    drsh_atom_slots_insert(sh->slots, sh->count++, a);
+    *patom = a;
+
+    if(!twin)
+        a->iatom = NULL;
+    else if(twin == old)
         a->iatom = a;
+    else {
+        a->iatom = twin;
+        drsh_at_gc_forward(gc, &a->iatom);
     }
-    // printf("atomize: '%.*s' -> %p\r\n", (int)length, txt, a);
+}
+
+DRSH_INTERNAL
+void
+drsh_at_gc_end(DrshAtomGc* gc){
+    DrshAtomTable* at = gc->at;
+    size_t count = 0, used = 0;
+    for(size_t i = 0; i < DRSH_AT_SHARDS; i++){
+        count += at->shards[i].count;
+        used += at->shards[i].arena.used;
+        drsh_arena_free_all(&gc->old_arenas[i]);
+    }
+    size_t atoms = gc->old_count - count;
+    size_t bytes = gc->old_bytes - used;
+    at->gc_runs++;
+    at->gc_last_atoms = atoms;
+    at->gc_last_bytes = bytes;
+    at->gc_total_atoms += atoms;
+    at->gc_total_bytes += bytes;
+    at->gc_threshold = count < 2048? 4096 : 2*count;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_map_snapshot(DrshAtomTable* at, const char* path){
+    if(at->frozen.base) return EC_VALUE_ERROR;
+    const void* p;
+    size_t size;
+    DrshEC err = drsh_map_file(path, &p, &size);
+    if(err) return err;
+    const char* base = p;
+    const DrshSnapshotHeader* h = p;
+    if(size < sizeof *h) goto Linvalid;
+    if(memcmp(h->magic, DRSH_SNAPSHOT_MAGIC, sizeof h->magic) != 0) goto Linvalid;
+    if(h->version != DRSH_SNAPSHOT_VERSION) goto Linvalid;
+    if(h->hash_kind != (uint32_t)drsh_hash_kind()) goto Linvalid;
+    if(h->atom_size != sizeof(DrshAtom)) goto Linvalid;
+    if(h->size != size) goto Linvalid;
+    if(!h->cap || (h->cap & (h->cap-1)) || h->count >= h->cap) goto Linvalid;
+    size_t atoms_start = sizeof *h + (size_t)h->cap*sizeof(DrshHashSlot) + ((size_t)h->count+h->hist_count)*sizeof(uint32_t);
+    atoms_start = (atoms_start + 7) & ~(size_t)7;
+    if(atoms_start > size) goto Linvalid;
+    if(drsh_hash_align1(base + sizeof *h, size - sizeof *h) != h->checksum) goto Linvalid;
+    // The checksum catches corruption, but make sure nothing points out
+    // of bounds either.
+    const DrshHashSlot* slots = (const DrshHashSlot*)(base + sizeof *h);
+    const uint32_t* offsets = (const uint32_t*)(slots + h->cap);
+    const uint32_t* history = offsets + h->count;
+    for(size_t i = 0; i < h->cap; i++)
+        if(slots[i].idx > h->count) goto Linvalid;
+    for(size_t i = 0; i < h->count; i++){
+        size_t off = offsets[i];
+        if(i && off <= offsets[i-1]) goto Linvalid;
+        if(off < atoms_start || off % _Alignof(DrshAtom) || size - off <= sizeof(DrshAtom)) goto Linvalid;
+        const DrshAtom* a = (const DrshAtom*)(base + off);
+        if(a->len >= size - off - sizeof(DrshAtom) || a->txt[a->len] || a->iatom) goto Linvalid;
+    }
+    for(size_t i = 0; i < h->hist_count; i++)
+        if(history[i] >= h->count) goto Linvalid;
+    const DrshAtom** iatoms = calloc(h->count+1, sizeof *iatoms);
+    if(!iatoms){
+        drsh_unmap_file(p, size);
+        return EC_OOM;
+    }
+    at->frozen = (DrshAtomSnapshot){
+        .base = base,
+        .size = size,
+        .header = h,
+        .slots = slots,
+        .offsets = offsets,
+        .history = history,
+        .iatoms = iatoms,
+    };
     return EC_OK;
+
+    Linvalid:
+    drsh_unmap_file(p, size);
+    return EC_VALUE_ERROR;
+}
+
+DRSH_INTERNAL
+void
+drsh_at_unmap_snapshot(DrshAtomTable* at){
+    if(!at->frozen.base) return;
+    drsh_unmap_file(at->frozen.base, at->frozen.size);
+    free(at->frozen.iatoms);
+    at->frozen = (DrshAtomSnapshot){0};
 }
 
 DRSH_INTERNAL
@@ -2821,16 +4656,28 @@ drsh_refresh_cwd(DrshEnvironment* env, _Bool backslash_is_sep){
     DrshGrowBuffer* cwd = &env->cwd;
     DrshEC err;
     drsh_gb_clear(tmp);
-    err = drsh_gb_ensure(tmp, UINT16_MAX*2);
-    if(err) return err;
-    DrshWriteBuffer wb = drsh_gb_writable_buffer(tmp);
+    DrshWriteBuffer wb;
     size_t wd_len = 0;
-    {
+    for(size_t want = 256;;){
+        err = drsh_gb_ensure(tmp, want);
+        if(err) return err;
+        wb = drsh_gb_writable_buffer(tmp);
         #ifdef _WIN32
-        wd_len = GetCurrentDirectoryA(wb.length, wb.ptr);
+        // Returns the size needed if the buffer is too small.
+        DWORD n = GetCurrentDirectoryA((DWORD)wb.length, wb.ptr);
+        if(n < wb.length){
+            wd_len = n;
+            break;
+        }
+        want = n;
         #else
         char* wd = getcwd(wb.ptr, wb.length);
-        if(wd) wd_len = strlen(wd);
+        if(wd){
+            wd_len = strlen(wd);
+            break;
+        }
+        if(errno != ERANGE) break;
+        want = 2*wb.length;
         #endif
     }
     if(!wd_len){
@@ -2973,14 +4820,14 @@ drsh_chdir(DrshEnvironment* env, const DrshArgv* rb){
     drsh_gb_clear(tmp);
     size_t count = rb->length;
     const char*const* argv = rb->ptr;
+    const size_t* lens = rb->lens;
     assert(count > 1);
     // pop trailing NULL
     count--;
     // skip "cd" token
-    argv++; count--;
+    argv++; lens++; count--;
     if(count != 1) return EC_VALUE_ERROR;
-    const DrshAtom* atom = drsh_unsafe_string_to_atom(argv[0]);
-    err = drsh_gb_append_(tmp, atom->txt, atom->len);
+    err = drsh_gb_append_(tmp, argv[0], lens[0]);
     if(err) return err;
     err = drsh_gb_append_(tmp, "\0", 1);
     err = drsh_gb_append_(tmp, "\0", 1);
@@ -2990,11 +4837,30 @@ drsh_chdir(DrshEnvironment* env, const DrshArgv* rb){
     #else
         chdir(tmp->data);
     #endif
+    drsh_path_cache_chdir(&env->path_cache);
     err = drsh_refresh_cwd(env, IS_WINDOWS);
     if(err) return err;
     return EC_OK;
 }
 
+// Sorts the order from scratch.
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_sort_order(DrshEnvironment* env){
+    if(!env->count) return EC_OK;
+    const DrshAtom** keys = malloc(env->count*sizeof *keys);
+    if(!keys) return EC_OOM;
+    const DrshAtom*const* atoms = env->data;
+    for(size_t i = 0; i < env->count; i++)
+        keys[i] = atoms[2*i];
+    qsort(keys, env->count, sizeof *keys, env->case_insensitive? drsh_atom_icmp : drsh_atom_cmp);
+    for(size_t o = 0; o < env->count; o++)
+        env->order[o] = (uint32_t)drsh_env_find_idx(env, drsh_env_key_hash(env, keys[o]), keys[o]->txt, keys[o]->len);
+    free(keys);
+    return EC_OK;
+}
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
@@ -3009,10 +4875,6 @@ drsh_env_init(DrshEnvironment* env, DrshAtomTable* at, void* envp_, _Bool window
     env->os_flavor = OS_OTHER;
     #endif
     DrshEC err;
-    DrshGrowBuffer* tmp = &env->tmp;
-    drsh_gb_clear(tmp);
-    err = drsh_gb_ensure(tmp, UINT16_MAX*2);
-    if(err) return err;
     env->at = at;
     env->case_insensitive = windows_style;
     // env->case_insensitive = 1;//windows_style;
@@ -3027,104 +4889,231 @@ drsh_env_init(DrshEnvironment* env, DrshAtomTable* at, void* envp_, _Bool window
         }
     }
     else {
+        // Only the keys are atomized up front. The values stay in the
+        // strings we were given until something reads them, and are
+        // passed on to children as is.
         char** envp = envp_;
+        env->importing = 1;
         for(char**p = envp; *p; p++){
             const char* eq = strchr(*p, '=');
             if(!eq) continue;
-            const DrshAtom *key, *value;
+            const DrshAtom *key;
             err = drsh_at_atomize(at, *p, eq-*p, &key);
             if(err) return err;
-            err = drsh_at_atomize(at, eq+1, strlen(eq+1), &value);
-            if(err) return err;
-            err = drsh_env_set_env(env, key, value);
+            err = drsh_env_set(env, key, NULL, *p, 1);
             if(err) return err;
-            assert(drsh_env_get_env(env, key) == value);
         }
+        env->importing = 0;
+        err = drsh_env_sort_order(env);
+        if(err) return err;
     }
     env->home = drsh_env_get_env(env, env->at->special[ATOM_HOME]);
     return EC_OK;
 }
 
+// Inserts pair i into the sorted order, after the ones before it.
 DRSH_INTERNAL
 void
-drsh_env_sort_env(DrshEnvironment* env){
-    _Bool icmp = env->case_insensitive;
-    if(env->sorted) return;
-    if(!env->count) return;
-    qsort(env->data, env->count, 2*sizeof(DrshAtom*), icmp?drsh_atom_icmp:drsh_atom_cmp);
-    const DrshAtom** atoms = env->data;
-    size_t cap = env->cap;
-    uint32_t* idxes = (uint32_t*)((char*)env->data + 2*cap*sizeof *atoms);
-    memset(idxes, 0, 2*cap * sizeof *idxes);
-    size_t len = env->count;
-    for(size_t i = 0; i < len; i++){
-        const DrshAtom* v = atoms[2*i];
-        if(icmp) v = v->iatom;
-        uint32_t hash = v->hash;
-        uint32_t idx = drsh_fast_reduce32(hash, cap);
-        while(idxes[idx]){
-            idx++;
-            if(idx > 2*cap) idx = 0;
-        }
-        idxes[idx] = (uint32_t)i+1;
+drsh_env_order_insert(DrshEnvironment* env, size_t i){
+    int (*cmp)(const void*, const void*) = env->case_insensitive? drsh_atom_icmp : drsh_atom_cmp;
+    const DrshAtom*const* atoms = env->data;
+    uint32_t* order = env->order;
+    size_t lo = 0, hi = i;
+    while(lo < hi){
+        size_t mid = lo + (hi-lo)/2;
+        if(cmp(&atoms[2*i], &atoms[2*order[mid]]) < 0)
+            hi = mid;
+        else
+            lo = mid+1;
     }
-    env->sorted = 1;
+    memmove(order+lo+1, order+lo, (i-lo)*sizeof *order);
+    order[lo] = (uint32_t)i;
 }
 
 
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_env_set_env(DrshEnvironment* env, const DrshAtom* key, const DrshAtom* value){
-    _Bool case_insensitive = env->case_insensitive;
-    const DrshAtom* lkey = case_insensitive?key->iatom:key;
-    if(env->count * 10 /8 >= env->cap){
-        size_t old_cap = env->cap;
-        size_t cap = old_cap?2*old_cap:32;
-        size_t sz = cap*sizeof(DrshAtom*)*2 + 2*cap*sizeof(uint32_t);
-        void* p = env->data?realloc(env->data, sz):malloc(sz);
-        if(!p) return EC_OOM;
-        const DrshAtom** atoms = p;
-        uint32_t* idxes = (uint32_t*)((char*)p + 2*cap*sizeof *atoms);
-        memset(idxes, 0, 2*cap * sizeof *idxes);
-        size_t len = env->count;
-        for(size_t i = 0; i < len; i++){
-            const DrshAtom* v = atoms[2*i];
-            if(case_insensitive) v = v->iatom;
-            uint32_t hash = v->hash;
-            uint32_t idx = drsh_fast_reduce32(hash, cap);
-            while(idxes[idx]){
-                idx++;
-                if(idx > 2*cap) idx = 0;
-            }
-            idxes[idx] = (uint32_t)i+1;
-        }
-        env->data = p;
-        env->cap = cap;
+drsh_env_set(DrshEnvironment* env, const DrshAtom* key, const DrshAtom*_Nullable value, char*_Nullable raw, _Bool export_new){
+    uint32_t hash = drsh_env_key_hash(env, key);
+    DrshEnvOverlay* o = drsh_env_find_overlay(env, hash, key->txt, key->len);
+    if(o){
+        o->key = key;
+        o->value = value;
+        return EC_OK;
     }
-    size_t cap = env->cap;
-    uint32_t hash = lkey->hash;
-    uint32_t idx = drsh_fast_reduce32(hash, cap);
-    uint32_t i;
     const DrshAtom** atoms = env->data;
-    uint32_t* idxes = (uint32_t*)((char*)env->data + 2*cap*sizeof *atoms);
-    while((i = idxes[idx])){
-        const DrshAtom* atom = atoms[2*(i-1)];
-        if(case_insensitive) atom = atom->iatom;
-        if(atom == lkey){
-            if(case_insensitive) atoms[2*(i-1)] = key;
-            atoms[2*(i-1)+1] = value;
+    DrshHashIndex* hi = &env->index;
+    size_t i = drsh_env_find_idx(env, hash, key->txt, key->len);
+    if(i != (size_t)-1){
+        if(value && atoms[2*i] == key && atoms[2*i+1] == value)
             return EC_OK;
-        }
-        idx++;
-        if(idx > 2*cap) idx = 0;
+        // Case insensitive keys keep the case they were last set with.
+        atoms[2*i] = key;
+        atoms[2*i+1] = value;
+        if(raw) env->raw[i] = raw;
+        drsh_env_patch_envp(env, i, 0);
+        return EC_OK;
+    }
+    DrshEC err = drsh_hi_reserve1(hi, env->count);
+    if(err) return err;
+    if(env->count == env->cap){
+        size_t cap = env->cap?2*env->cap:32;
+        uint32_t* order = realloc(env->order, cap*sizeof *order);
+        if(!order) return EC_OOM;
+        env->order = order;
+        uint32_t* slots = realloc(env->slots, cap*sizeof *slots);
+        if(!slots) return EC_OOM;
+        env->slots = slots;
+        char** raws = realloc(env->raw, cap*sizeof *raws);
+        if(!raws) return EC_OOM;
+        env->raw = raws;
+        atoms = realloc(env->data, 2*cap*sizeof *atoms);
+        if(!atoms) return EC_OOM;
+        env->data = atoms;
+        env->cap = cap;
     }
-    assert(i == 0);
-    i = (uint32_t)(env->count++);
-    idxes[idx] = i+1;
+    i = env->count++;
+    drsh_hi_insert(hi, hash, (uint32_t)i+1);
     atoms[2*i] = key;
     atoms[2*i+1] = value;
-    env->sorted = 0;
+    env->raw[i] = raw;
+    env->slots[i] = export_new? DRSH_ENV_UNPLACED : DRSH_ENV_LOCAL;
+    if(!env->importing)
+        drsh_env_order_insert(env, i);
+    drsh_env_patch_envp(env, i, 1);
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set_env(DrshEnvironment* env, const DrshAtom* key, const DrshAtom* value){
+    return drsh_env_set(env, key, value, NULL, 1);
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set_local(DrshEnvironment* env, const DrshAtom* key, const DrshAtom* value){
+    return drsh_env_set(env, key, value, NULL, 0);
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set_exported(DrshEnvironment* env, const DrshAtom* key, _Bool exported){
+    uint32_t hash = drsh_env_key_hash(env, key);
+    size_t i = drsh_env_find_idx(env, hash, key->txt, key->len);
+    if(i == (size_t)-1){
+        const DrshEnvOverlay* o = drsh_env_find_overlay(env, hash, key->txt, key->len);
+        if(!o || !o->value) return EC_NOT_FOUND;
+        return exported? EC_OK : EC_VALUE_ERROR;
+    }
+    if(exported == (env->slots[i] != DRSH_ENV_LOCAL)) return EC_OK;
+    // Rare enough to just rebuild envp.
+    drsh_env_invalidate_envp(env);
+    env->slots[i] = exported? DRSH_ENV_UNPLACED : DRSH_ENV_LOCAL;
+    return EC_OK;
+}
+
+// Position of pair i in the sorted order.
+DRSH_INTERNAL
+size_t
+drsh_env_order_find(const DrshEnvironment* env, size_t i){
+    int (*cmp)(const void*, const void*) = env->case_insensitive? drsh_atom_icmp : drsh_atom_cmp;
+    const DrshAtom*const* atoms = env->data;
+    size_t lo = 0, hi = env->count;
+    // Keys are unique under cmp, so this lands on it.
+    while(lo < hi){
+        size_t mid = lo + (hi-lo)/2;
+        int c = cmp(&atoms[2*env->order[mid]], &atoms[2*i]);
+        if(!c) return mid;
+        if(c < 0) lo = mid+1;
+        else hi = mid;
+    }
+    assert(0);
+    return lo;
+}
+
+// Takes pair i's string out of the posix envp, moving the last one into
+// its place.
+DRSH_INTERNAL
+void
+drsh_env_envp_remove(DrshEnvironment* env, size_t i){
+#ifdef _WIN32
+    (void)i;
+    env->envp_valid = 0;
+#else
+    char** envp = (char**)env->envp.data;
+    size_t last = env->envp.count/sizeof *envp - 2;
+    size_t s = env->slots[i];
+    if(envp[s] != env->raw[i])
+        free(envp[s]);
+    if(s != last){
+        envp[s] = envp[last];
+        const char* eq = strchr(envp[s], '=');
+        size_t len = eq - envp[s];
+        size_t owner = drsh_env_find_idx(env, drsh_env_name_hash(env, envp[s], len), envp[s], len);
+        assert(owner != (size_t)-1);
+        env->slots[owner] = (uint32_t)s;
+    }
+    envp[last] = NULL;
+    env->envp.count -= sizeof *envp;
+#endif
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_unset(DrshEnvironment* env, const char* key, size_t len){
+    uint32_t hash = drsh_env_name_hash(env, key, len);
+    if(env->overlays.count){
+        DrshEnvOverlay* o = drsh_env_find_overlay(env, hash, key, len);
+        if(o){
+            o->value = NULL;
+            return EC_OK;
+        }
+    }
+    size_t i = drsh_env_find_idx(env, hash, key, len);
+    if(i == (size_t)-1) return EC_OK;
+    const DrshAtom** atoms = env->data;
+    DrshHashIndex* hi = &env->index;
+    if(env->envp_valid && env->slots[i] != DRSH_ENV_LOCAL)
+        drsh_env_envp_remove(env, i);
+    drsh_hi_remove_slot(hi, drsh_hi_find_slot(hi, hash, (uint32_t)i+1));
+    size_t o = drsh_env_order_find(env, i);
+    memmove(env->order+o, env->order+o+1, (env->count-o-1)*sizeof *env->order);
+    // Move the last pair into the hole so the pairs stay dense.
+    size_t last = env->count-1;
+    if(i != last){
+        atoms[2*i] = atoms[2*last];
+        atoms[2*i+1] = atoms[2*last+1];
+        env->slots[i] = env->slots[last];
+        env->raw[i] = env->raw[last];
+        uint32_t h = drsh_env_key_hash(env, atoms[2*i]);
+        hi->slots[drsh_hi_find_slot(hi, h, (uint32_t)last+1)].idx = (uint32_t)i+1;
+        env->count--;
+        env->order[drsh_env_order_find(env, i)] = (uint32_t)i;
+    }
+    else
+        env->count--;
+    // Give memory back after a lot of variables are unset.
+    DrshEC err = drsh_hi_shrink(hi, env->count);
+    if(err) return err;
+    if(env->cap > 32 && env->count*4 < env->cap){
+        size_t cap = env->cap/2;
+        // If shrinking fails the old, bigger, allocation is still fine.
+        uint32_t* order = realloc(env->order, cap*sizeof *order);
+        if(order) env->order = order;
+        uint32_t* slots = realloc(env->slots, cap*sizeof *slots);
+        if(slots) env->slots = slots;
+        char** raws = realloc(env->raw, cap*sizeof *raws);
+        if(raws) env->raw = raws;
+        atoms = realloc(env->data, 2*cap*sizeof *atoms);
+        if(atoms) env->data = atoms;
+        env->cap = cap;
+    }
     return EC_OK;
 }
 DRSH_INTERNAL
@@ -3152,93 +5141,415 @@ drsh_env_set_env4(DrshEnvironment* env, const char* key_txt, size_t key_len, con
 }
 
 DRSH_INTERNAL
-const DrshAtom*_Nullable
-drsh_env_get_env(DrshEnvironment* env, const DrshAtom* key){
-    _Bool case_insensitive = env->case_insensitive;
-    if(case_insensitive) key = key->iatom;
-    size_t cap = env->cap;
-    uint32_t hash = key->hash;
-    uint32_t idx = drsh_fast_reduce32(hash, cap);
-    uint32_t i;
-    const DrshAtom** atoms = env->data;
-    uint32_t* idxes = (uint32_t*)((char*)env->data + 2*cap*sizeof *atoms);
-    while((i = idxes[idx])){
-        const DrshAtom* atom = atoms[2*(i-1)];
-        if(atom == key){
-            return atoms[2*(i-1)+1];
-        }
-        idx++;
-        if(idx > 2*cap) idx = 0;
-    }
-    if(case_insensitive){
-        // slow and dumb
-        for(size_t j = 0; j < env->count; j++){
-            const DrshAtom* atom = atoms[2*j];
-            if(case_insensitive) atom = atom->iatom;
-            if(atom == key){
-                return atoms[2*j+1];
-            }
-        }
+uint32_t
+drsh_env_name_hash(const DrshEnvironment* env, const char* txt, size_t len){
+    if(!env->case_insensitive)
+        return drsh_atom_hash(txt, len);
+    // The hash of the folded name, which for any name that fits in the
+    // buffer is the hash of its folded twin. Longer ones are folded a
+    // buffer at a time.
+    char buff[DRSH_ENV_FOLD_CHUNK];
+    uint32_t hash = 0;
+    for(size_t off = 0;;){
+        size_t n = len - off < sizeof buff? len - off : sizeof buff;
+        for(size_t i = 0; i < n; i++)
+            buff[i] = (char)(0x20|(unsigned)(unsigned char)txt[off+i]);
+        uint32_t h = drsh_atom_hash(buff, n);
+        hash = off? hash*31 + h : h;
+        off += n;
+        if(off == len) break;
     }
-    return NULL;
+    return hash? hash : 1024;
 }
 
 DRSH_INTERNAL
-const DrshAtom*_Nullable
-drsh_env_get_env2(DrshEnvironment* env, const char* key, size_t len){
-    const DrshAtom* key_atom;
-    DrshEC err = drsh_at_atomize(env->at, key, len, &key_atom);
-    if(err != EC_OK) return NULL;
-    return drsh_env_get_env(env, key_atom);
+size_t
+drsh_env_find_idx(const DrshEnvironment* env, uint32_t hash, const char* key, size_t len){
+    const DrshAtom*const* atoms = env->data;
+    const DrshHashIndex* hi = &env->index;
+    size_t mask = hi->cap-1;
+    if(hi->cap) for(size_t s = hash & mask; hi->slots[s].idx; s = (s+1) & mask){
+        if(hi->slots[s].hash != hash) continue;
+        size_t i = hi->slots[s].idx-1;
+        if(drsh_env_key_eq(env, atoms[2*i], key, len))
+            return i;
+    }
+    return (size_t)-1;
 }
 
 DRSH_INTERNAL
-void*_Nullable
-drsh_env_get_envp(DrshEnvironment* env, _Bool windows_style){
-    drsh_env_sort_env(env);
-    DrshGrowBuffer* tmp = &env->tmp;
-    drsh_gb_clear(tmp);
-    DrshEC err;
-    if(windows_style){
-        for(size_t i = 0; i < env->count; i++){
-            const DrshAtom** atoms = env->data;
-            err = drsh_gb_append_(tmp, atoms[2*i]->txt, atoms[2*i]->len);
-            if(err) return NULL;
-            err = drsh_gb_append_(tmp, "=", 1);
-            if(err) return NULL;
-            err = drsh_gb_append_(tmp, atoms[2*i+1]->txt, atoms[2*i+1]->len);
-            if(err) return NULL;
-            err = drsh_gb_append_(tmp, "\0", 1);
-            if(err) return NULL;
-        }
-        err = drsh_gb_append_(tmp, "\0", 1);
+_Bool
+drsh_env_key_eq(const DrshEnvironment* env, const DrshAtom* atom, const char* key, size_t len){
+    if(atom->len != len) return 0;
+    if(atom->txt == key) return 1;
+    if(!env->case_insensitive)
+        return memcmp(atom->txt, key, len) == 0;
+    for(size_t j = 0; j < len; j++)
+        if((0x20|(unsigned char)atom->txt[j]) != (0x20|(unsigned char)key[j])) return 0;
+    return 1;
+}
+
+DRSH_INTERNAL
+DrshEnvOverlay*_Nullable
+drsh_env_find_overlay(DrshEnvironment* env, uint32_t hash, const char* key, size_t len){
+    DrshEnvOverlay* overlays = (DrshEnvOverlay*)env->overlays.data;
+    for(size_t i = env->overlays.count/sizeof *overlays; i--;){
+        DrshEnvOverlay* o = &overlays[i];
+        if(o->hash == hash && drsh_env_key_eq(env, o->key, key, len))
+            return o;
+    }
+    return NULL;
+}
+
+// The value of pair i, atomizing it if it is still the inherited string.
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_value(DrshEnvironment* env, size_t i, const DrshAtom*_Nonnull*_Nonnull out){
+    const DrshAtom** atoms = env->data;
+    if(!atoms[2*i+1]){
+        // The key was atomized from the same string.
+        const char* txt = env->raw[i] + atoms[2*i]->len + 1;
+        DrshEC err = drsh_at_atomize(env->at, txt, strlen(txt), &atoms[2*i+1]);
+        if(err) return err;
+    }
+    *out = atoms[2*i+1];
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+const DrshAtom*_Nullable
+drsh_env_lookup(DrshEnvironment* env, uint32_t hash, const char* key, size_t len){
+    if(env->overlays.count){
+        const DrshEnvOverlay* o = drsh_env_find_overlay(env, hash, key, len);
+        if(o) return o->value;
+    }
+    size_t i = drsh_env_find_idx(env, hash, key, len);
+    if(i == (size_t)-1) return NULL;
+    const DrshAtom* value;
+    DrshEC err = drsh_env_value(env, i, &value);
+    if(err) return NULL;
+    return value;
+}
+
+DRSH_INTERNAL
+const DrshAtom*_Nullable
+drsh_env_get_env(DrshEnvironment* env, const DrshAtom* key){
+    return drsh_env_lookup(env, drsh_env_key_hash(env, key), key->txt, key->len);
+}
+
+DRSH_INTERNAL
+const DrshAtom*_Nullable
+drsh_env_get_env2(DrshEnvironment* env, const char* key, size_t len){
+    return drsh_env_lookup(env, drsh_env_name_hash(env, key, len), key, len);
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_set_overlay(DrshEnvironment* env, const DrshAtom* key, const DrshAtom* value){
+    DrshEnvOverlay o = {key, value, drsh_env_key_hash(env, key)};
+    return drsh_gb_append_(&env->overlays, &o, sizeof o);
+}
+
+//
+// Gets the overlays that are in effect (not shadowed by a newer one for
+// the same variable), sorted by key, into out.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_visible_overlays(DrshEnvironment* env, DrshGrowBuffer* out){
+    int (*cmp)(const void*, const void*) = env->case_insensitive? drsh_atom_icmp : drsh_atom_cmp;
+    drsh_gb_clear(out);
+    const DrshEnvOverlay* overlays = (const DrshEnvOverlay*)env->overlays.data;
+    size_t count = env->overlays.count/sizeof *overlays;
+    for(size_t i = count; i--;){
+        const DrshEnvOverlay* o = &overlays[i];
+        if(drsh_env_find_overlay(env, o->hash, o->key->txt, o->key->len) != o)
+            continue;
+        DrshEC err = drsh_gb_append_(out, &o, sizeof o);
+        if(err) return err;
+        // There are only ever a few, insertion sort is fine.
+        const DrshEnvOverlay** v = (const DrshEnvOverlay**)out->data;
+        for(size_t j = out->count/sizeof *v - 1; j && cmp(&v[j]->key, &v[j-1]->key) < 0; j--){
+            const DrshEnvOverlay* t = v[j];
+            v[j] = v[j-1];
+            v[j-1] = t;
+        }
+    }
+    return EC_OK;
+}
+
+// Makes the "KEY=VALUE" string for entry i of the environment, or gives
+// back the inherited one if the value was never replaced.
+DRSH_INTERNAL
+char*_Nullable
+drsh_env_envp_entry(const DrshEnvironment* env, size_t i){
+    const DrshAtom*const* atoms = env->data;
+    const DrshAtom* key = atoms[2*i];
+    const DrshAtom* value = atoms[2*i+1];
+    if(!value) return env->raw[i];
+    char* entry = malloc(key->len + 1 + value->len + 1);
+    if(!entry) return NULL;
+    memcpy(entry, key->txt, key->len);
+    entry[key->len] = '=';
+    memcpy(entry+key->len+1, value->txt, value->len+1);
+    return entry;
+}
+
+DRSH_INTERNAL
+void
+drsh_env_patch_envp(DrshEnvironment* env, size_t i, _Bool is_new){
+    if(!env->envp_valid) return;
+    // Children never see local variables.
+    if(env->slots[i] == DRSH_ENV_LOCAL) return;
+#ifdef _WIN32
+    (void)is_new;
+    env->envp_valid = 0;
+#else
+    // Only new pairs can be missing from a valid envp, anything else
+    // getting exported rebuilds it.
+    if(is_new != (env->slots[i] == DRSH_ENV_UNPLACED)) goto Linvalid;
+    char* entry = drsh_env_envp_entry(env, i);
+    if(!entry) goto Linvalid;
+    char** envp = (char**)env->envp.data;
+    if(is_new){
+        // A new entry, which goes where the NULL was.
+        char* null = NULL;
+        DrshEC err = drsh_gb_append_(&env->envp, &null, sizeof null);
+        if(err){
+            free(entry);
+            goto Linvalid;
+        }
+        envp = (char**)env->envp.data;
+        env->slots[i] = (uint32_t)(env->envp.count/sizeof *envp - 2);
+    }
+    else if(envp[env->slots[i]] != env->raw[i])
+        free(envp[env->slots[i]]);
+    envp[env->slots[i]] = entry;
+    return;
+
+    Linvalid:
+    drsh_env_invalidate_envp(env);
+#endif
+}
+
+DRSH_INTERNAL
+void
+drsh_env_invalidate_envp(DrshEnvironment* env){
+    if(!env->envp_valid) return;
+    env->envp_valid = 0;
+#ifndef _WIN32
+    char** envp = (char**)env->envp.data;
+    for(size_t i = 0; i < env->count; i++){
+        uint32_t s = env->slots[i];
+        if(s == DRSH_ENV_LOCAL || s == DRSH_ENV_UNPLACED) continue;
+        if(envp[s] != env->raw[i])
+            free(envp[s]);
+        env->slots[i] = DRSH_ENV_UNPLACED;
+    }
+    drsh_gb_clear(&env->envp);
+#endif
+}
+
+typedef enum DrshEnvWhich {
+    DRSH_ENV_ALL,
+    DRSH_ENV_EXPORTED,
+    DRSH_ENV_UNEXPORTED,
+} DrshEnvWhich;
+
+//
+// Gets the variables, with the overlays applied (which count as
+// exported), as key value pairs of atoms sorted by key.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_merged_pairs(DrshEnvironment* env, DrshGrowBuffer* out, DrshEnvWhich which){
+    int (*cmp)(const void*, const void*) = env->case_insensitive? drsh_atom_icmp : drsh_atom_cmp;
+    DrshGrowBuffer visible = {0};
+    DrshEC err = drsh_env_visible_overlays(env, &visible);
+    if(err) goto Lfinish;
+    const DrshEnvOverlay** v = (const DrshEnvOverlay**)visible.data;
+    size_t nv = visible.count/sizeof *v;
+    drsh_gb_clear(out);
+    err = drsh_gb_reserve(out, 2*(env->count+nv)*sizeof(const DrshAtom*));
+    if(err) goto Lfinish;
+    const DrshAtom** pairs = (const DrshAtom**)out->data;
+    const DrshAtom*const* atoms = env->data;
+    _Bool overlays = which != DRSH_ENV_UNEXPORTED;
+    size_t n = 0, j = 0;
+    for(size_t o = 0; o < env->count; o++){
+        size_t i = env->order[o];
+        const DrshAtom* key = atoms[2*i];
+        const DrshAtom* value = atoms[2*i+1];
+        // Overlays of variables that aren't set go in between.
+        for(; j < nv && cmp(&v[j]->key, &key) < 0; j++){
+            if(!overlays || !v[j]->value) continue;
+            pairs[2*n] = v[j]->key;
+            pairs[2*n+1] = v[j]->value;
+            n++;
+        }
+        if(j < nv && cmp(&v[j]->key, &key) == 0){
+            key = v[j]->key;
+            value = v[j]->value;
+            j++;
+            if(!overlays || !value) continue;
+        }
+        else if(which != DRSH_ENV_ALL && (which == DRSH_ENV_EXPORTED) != (env->slots[i] != DRSH_ENV_LOCAL))
+            continue;
+        else if(!value){
+            err = drsh_env_value(env, i, &value);
+            if(err) goto Lfinish;
+        }
+        pairs[2*n] = key;
+        pairs[2*n+1] = value;
+        n++;
+    }
+    for(; overlays && j < nv; j++){
+        if(!v[j]->value) continue;
+        pairs[2*n] = v[j]->key;
+        pairs[2*n+1] = v[j]->value;
+        n++;
+    }
+    out->count = 2*n*sizeof *pairs;
+    Lfinish:
+    free(visible.data);
+    return err;
+}
+
+//
+// The windows environment block for the sorted pairs.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_write_block(DrshGrowBuffer* b, const DrshAtom*const* pairs, size_t count){
+    drsh_gb_clear(b);
+    size_t total = 1;
+    for(size_t i = 0; i < count; i++)
+        total += pairs[2*i]->len + 1 + pairs[2*i+1]->len + 1;
+    DrshEC err = drsh_gb_reserve(b, total);
+    if(err) return err;
+    for(size_t i = 0; i < count; i++){
+        err = drsh_gb_append(b, pairs[2*i]->txt, pairs[2*i]->len);
+        if(err) return err;
+        err = drsh_gb_append(b, "=", 1);
+        if(err) return err;
+        err = drsh_gb_append(b, pairs[2*i+1]->txt, pairs[2*i+1]->len+1);
+        if(err) return err;
+    }
+    return drsh_gb_append(b, "\0", 1);
+}
+
+DRSH_INTERNAL
+void*_Nullable
+drsh_env_base_envp(DrshEnvironment* env, _Bool windows_style){
+    if(env->envp_valid) return env->envp.data;
+    DrshGrowBuffer* b = &env->envp;
+    DrshEC err;
+    if(windows_style){
+        // Only made when there are no overlays, so this is the base.
+        err = drsh_env_merged_pairs(env, &env->tmp, DRSH_ENV_EXPORTED);
+        if(err) return NULL;
+        err = drsh_env_write_block(b, (const DrshAtom*const*)env->tmp.data, env->tmp.count/(2*sizeof(const DrshAtom*)));
         if(err) return NULL;
     }
     else { // posix style
-        for(size_t i = 0; i < env->count+1; i++){
-            void* p = NULL;
-            err = drsh_gb_append_(tmp, &p, sizeof p);
-            if(err) return NULL;
-        }
+        // The old strings were freed when it was invalidated.
+        drsh_gb_clear(b);
+        err = drsh_gb_reserve(b, (env->count+1)*sizeof(char*));
+        if(err) return NULL;
+        char** envp = (char**)b->data;
+        size_t n = 0;
         for(size_t i = 0; i < env->count; i++){
-            size_t off = tmp->count;
-            const DrshAtom** atoms = env->data;
-            err = drsh_gb_append_(tmp, atoms[2*i]->txt, atoms[2*i]->len);
-            if(err) return NULL;
-            err = drsh_gb_append_(tmp, "=", 1);
-            if(err) return NULL;
-            err = drsh_gb_append_(tmp, atoms[2*i+1]->txt, atoms[2*i+1]->len);
-            if(err) return NULL;
-            err = drsh_gb_append_(tmp, "\0", 1);
-            if(err) return NULL;
-            ((size_t*)tmp->data)[i] = off;
+            if(env->slots[i] == DRSH_ENV_LOCAL) continue;
+            envp[n] = drsh_env_envp_entry(env, i);
+            if(!envp[n]){
+                for(size_t j = 0; j < i; j++){
+                    if(env->slots[j] == DRSH_ENV_LOCAL) continue;
+                    if(envp[env->slots[j]] != env->raw[j])
+                        free(envp[env->slots[j]]);
+                    env->slots[j] = DRSH_ENV_UNPLACED;
+                }
+                return NULL;
+            }
+            env->slots[i] = (uint32_t)n++;
         }
-        for(size_t i = 0; i < env->count; i++){
-            size_t off = ((size_t*)tmp->data)[i];
-            ((void**)tmp->data)[i] = (char*)tmp->data + off;
+        envp[n] = NULL;
+        b->count = (n+1)*sizeof *envp;
+    }
+    env->envp_valid = 1;
+    return b->data;
+}
+
+DRSH_INTERNAL
+void*_Nullable
+drsh_env_get_envp(DrshEnvironment* env, _Bool windows_style){
+    if(!env->overlays.count) return drsh_env_base_envp(env, windows_style);
+    DrshGrowBuffer* b = &env->overlay_envp;
+    DrshEC err;
+    if(windows_style){
+        err = drsh_env_merged_pairs(env, &env->tmp, DRSH_ENV_EXPORTED);
+        if(err) return NULL;
+        err = drsh_env_write_block(b, (const DrshAtom*const*)env->tmp.data, env->tmp.count/(2*sizeof(const DrshAtom*)));
+        if(err) return NULL;
+        return b->data;
+    }
+    // Point a copy of the base array at the overlays' strings instead,
+    // so the base strings are shared.
+    char** base = drsh_env_base_envp(env, 0);
+    if(!base) return NULL;
+    err = drsh_env_visible_overlays(env, &env->tmp);
+    if(err) return NULL;
+    const DrshEnvOverlay** v = (const DrshEnvOverlay**)env->tmp.data;
+    size_t nv = env->tmp.count/sizeof *v;
+    size_t nbase = env->envp.count/sizeof *base - 1;
+    size_t nptrs = nbase + nv + 1;
+    size_t total = nptrs*sizeof(char*);
+    for(size_t j = 0; j < nv; j++)
+        if(v[j]->value)
+            total += v[j]->key->len + 1 + v[j]->value->len + 1;
+    drsh_gb_clear(b);
+    err = drsh_gb_reserve(b, total);
+    if(err) return NULL;
+    char** envp = (char**)b->data;
+    memcpy(envp, base, nbase*sizeof *envp);
+    char* p = b->data + nptrs*sizeof(char*);
+    size_t n = nbase;
+    _Bool holes = 0;
+    for(size_t j = 0; j < nv; j++){
+        const DrshAtom* key = v[j]->key;
+        const DrshAtom* value = v[j]->value;
+        // Overlays are always exported, even over local variables.
+        size_t i = drsh_env_find_idx(env, v[j]->hash, key->txt, key->len);
+        _Bool in_base = i != (size_t)-1 && env->slots[i] != DRSH_ENV_LOCAL;
+        if(!value){
+            if(in_base){
+                envp[env->slots[i]] = NULL;
+                holes = 1;
+            }
+            continue;
         }
+        size_t slot = in_base? env->slots[i] : n++;
+        envp[slot] = p;
+        memcpy(p, key->txt, key->len);
+        p += key->len;
+        *p++ = '=';
+        memcpy(p, value->txt, value->len+1);
+        p += value->len+1;
     }
-    return tmp->data;
+    if(holes){
+        // Close up the variables unset by the layers.
+        size_t m = 0;
+        for(size_t j = 0; j < n; j++)
+            if(envp[j]) envp[m++] = envp[j];
+        n = m;
+    }
+    envp[n] = NULL;
+    b->count = total;
+    return b->data;
 }
 
 DRSH_INTERNAL
@@ -3279,20 +5590,28 @@ drsh_memchr(const char* mem, size_t len, char sep){
     return mem + len;
 }
 
+// Whether the program is given as a path, rather than to look for.
+DRSH_INTERNAL
+_Bool
+drsh_prog_has_dir(DrshStringView program, _Bool windows_style){
+    if(drsh_path_is_abs(program, windows_style)) return 1;
+    if(memchr(program.txt, '/', program.length)) return 1;
+    if(windows_style && memchr(program.txt, '\\', program.length)) return 1;
+    return 0;
+}
+
+//
+// The search behind drsh_env_resolve_prog_path. Sets *cacheable if the
+// result only depends on PATH (and PATHEXT).
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const DrshAtom* program, _Bool windows_style){
+drsh_env_search_path(DrshEnvironment* env, DrshGrowBuffer* tmp, DrshStringView program, _Bool windows_style, _Bool* cacheable){
     DrshEC err;
-    _Bool is_abs = 0;
-    is_abs = drsh_path_is_abs(drsh_atom_sv(program), windows_style);
-    _Bool has_dir = is_abs;
-    if(!has_dir && memchr(program->txt, '/', program->len))
-        has_dir = 1;
-    if(!has_dir && windows_style && memchr(program->txt, '\\', program->len))
-        has_dir = 1;
-    if(has_dir){
-        err = drsh_gb_append_(tmp, program->txt, program->len);
+    *cacheable = 0;
+    if(drsh_prog_has_dir(program, windows_style)){
+        err = drsh_gb_append_(tmp, program.txt, program.length);
         if(err) return err;
         if(windows_style){
             DrshReadBuffer rb = drsh_gb_readable_buffer(tmp);
@@ -3369,7 +5688,7 @@ drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const Drsh
             err = drsh_gb_append_(tmp, "/", 1);
             if(err) return err;
         }
-        err = drsh_gb_append_(tmp, program->txt, program->len);
+        err = drsh_gb_append_(tmp, program.txt, program.length);
         if(err) return err;
         if(windows_style){
             DrshReadBuffer rb = drsh_gb_readable_buffer(tmp);
@@ -3392,8 +5711,10 @@ drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const Drsh
             if(has_ext){
                 err = drsh_gb_append_(tmp, "\0", 1);
                 if(err) return err;
-                if(drsh_exists(tmp->data))
+                if(drsh_exists(tmp->data)){
+                    *cacheable = 1;
                     return EC_OK;
+                }
             }
             else {
                 for(const char *front = ext, *sep = drsh_memchr(ext, len, ';');;front=sep+1, sep = drsh_memchr(front, len-(front-ext), ';')){
@@ -3402,8 +5723,10 @@ drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const Drsh
                     if(err) return err;
                     err = drsh_gb_append_(tmp, "\0", 1);
                     if(err) return err;
-                    if(drsh_exists(tmp->data))
+                    if(drsh_exists(tmp->data)){
+                        *cacheable = 1;
                         return EC_OK;
+                    }
                     tmp->count -= 1 + ext_len;
                     if(sep == ext+len) break;
                 }
@@ -3413,11 +5736,15 @@ drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const Drsh
             err = drsh_gb_append_(tmp, "\0", 1);
             if(err) return err;
             char* progpath = tmp->data;
-            if(drsh_exists(progpath))
+            if(drsh_exists(progpath)){
+                *cacheable = 1;
                 return EC_OK;
+            }
         }
         if(!s) break;
     }
+    // Windows also looks in the current directory, which isn't cached.
+    *cacheable = !windows_style;
     if(windows_style){
         const DrshAtom* dot = drsh_env_get_env(env, env->at->special[ATOM_PWD]);
         assert(dot);
@@ -3437,7 +5764,7 @@ drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const Drsh
             err = drsh_gb_append_(tmp, "/", 1);
             if(err) return err;
         }
-        err = drsh_gb_append_(tmp, program->txt, program->len);
+        err = drsh_gb_append_(tmp, program.txt, program.length);
         if(err) return err;
         DrshReadBuffer rb = drsh_gb_readable_buffer(tmp);
         const DrshAtom* pathexts = drsh_env_get_env(env, env->at->special[ATOM_PATHEXT]);
@@ -3481,420 +5808,2386 @@ drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, const Drsh
 }
 
 DRSH_INTERNAL
-DRSH_WARN_UNUSED
-DrshEC
-drsh_at_init(DrshAtomTable* at){
-    DrshEC err;
-    static const char*const tokens[] = {
-        #define X(x) [ATOM_##x] = #x,
-        ATOM_X(X)
-        #undef X
-        [ATOM_DOT] = ".",
-    };
-    static const size_t lens[] = {
-        #define X(x) [ATOM_##x] = -1+sizeof #x,
-        ATOM_X(X)
-        #undef X
-        [ATOM_DOT] = -1+sizeof ".",
-    };
-    for(int i = 0; i < ATOM_MAX; i++){
-        err = drsh_at_atomize(at, tokens[i], lens[i], at->special+i);
-        if(err) return err;
+uint64_t
+drsh_monotonic_ns(void){
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    if(!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+#endif
+}
+
+DRSH_INTERNAL
+void
+drsh_path_cache_clear(DrshPathCache* pc){
+    drsh_gb_clear(&pc->entries);
+    drsh_hi_clear(&pc->index);
+}
+
+DRSH_INTERNAL
+DrshPathCacheEntry*_Nullable
+drsh_path_cache_find(DrshPathCache* pc, uint32_t hash, const char* name, size_t len){
+    DrshPathCacheEntry* entries = (DrshPathCacheEntry*)pc->entries.data;
+    const DrshHashIndex* hi = &pc->index;
+    size_t mask = hi->cap-1;
+    if(hi->cap) for(size_t s = hash & mask; hi->slots[s].idx; s = (s+1) & mask){
+        if(hi->slots[s].hash != hash) continue;
+        DrshPathCacheEntry* e = &entries[hi->slots[s].idx-1];
+        if(e->name->len == len && memcmp(e->name->txt, name, len) == 0)
+            return e;
     }
-    return EC_OK;
+    return NULL;
+}
+
+DRSH_INTERNAL
+_Bool
+drsh_path_cache_forget(DrshPathCache* pc, const char* name, size_t len){
+    uint32_t hash = drsh_atom_hash(name, len);
+    DrshPathCacheEntry* e = drsh_path_cache_find(pc, hash, name, len);
+    if(!e) return 0;
+    DrshPathCacheEntry* entries = (DrshPathCacheEntry*)pc->entries.data;
+    DrshHashIndex* hi = &pc->index;
+    size_t i = e - entries;
+    size_t last = pc->entries.count/sizeof *entries - 1;
+    drsh_hi_remove_slot(hi, drsh_hi_find_slot(hi, hash, (uint32_t)i+1));
+    if(i != last){
+        entries[i] = entries[last];
+        const DrshAtom* moved = entries[i].name;
+        hi->slots[drsh_hi_find_slot(hi, drsh_atom_hash(moved->txt, moved->len), (uint32_t)last+1)].idx = (uint32_t)i+1;
+    }
+    pc->entries.count -= sizeof *entries;
+    pc->checked_ns = 0;
+    return 1;
 }
 
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_hist_add(DrshInput* inp, const DrshAtom* atom){
-    if(!atom->len) return EC_OK;
-    DrshReadBuffer rb = drsh_gb_readable_buffer(&inp->hist_buffer);
-    DRSH_SLICE(const DrshAtom* const) atoms = {rb.length/sizeof(const DrshAtom*), rb.ptr};
-    inp->hist_cursor = atoms.length;
-    if(atoms.length && atoms.ptr[atoms.length-1] == atom)
-        return EC_OK;
-    DrshEC err = drsh_gb_append_(&inp->hist_buffer, &atom, sizeof atom);
+drsh_path_cache_add(DrshPathCache* pc, DrshAtomTable* at, DrshStringView name, const char*_Nullable path, size_t path_len){
+    DrshPathCacheEntry e = {0};
+    DrshEC err = drsh_at_atomize(at, name.txt, name.length, &e.name);
     if(err) return err;
-    inp->hist_cursor = atoms.length+1;
+    if(path){
+        err = drsh_at_atomize(at, path, path_len, &e.path);
+        if(err) return err;
+    }
+    size_t count = pc->entries.count/sizeof e;
+    err = drsh_hi_reserve1(&pc->index, count);
+    if(err) return err;
+    err = drsh_gb_append_(&pc->entries, &e, sizeof e);
+    if(err) return err;
+    drsh_hi_insert(&pc->index, drsh_atom_hash(name.txt, name.length), (uint32_t)count+1);
     return EC_OK;
 }
 
+// Reads the names of the files (not subdirectories) in dir into names.
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_hist_dump(const DrshInput* input, DrshEnvironment* env){
+drsh_read_dir_names(const char* dir, DrshGrowBuffer* names){
+    drsh_gb_clear(names);
+#ifdef _WIN32
+    (void)dir;
+    return EC_UNIMPLEMENTED_ERROR;
+#else
+    DIR* d = opendir(dir);
+    // Missing directories just have nothing in them.
+    if(!d) return EC_OK;
     DrshEC err = EC_OK;
-    const DrshAtom* hist_path;
-    err = drsh_env_get_history_path(env, &hist_path);
-    if(err) return err;
-    if(!hist_path || !hist_path->len) return EC_NOT_FOUND;
-    DrshReadBuffer rb = drsh_gb_readable_buffer(&input->hist_buffer);
-    DRSH_SLICE(const DrshAtom* const) atoms = {rb.length/sizeof(const DrshAtom*), rb.ptr};
-    FileHandle fh;
-    err = drsh_open_file_for_appending_with_mkdirs(hist_path->txt, hist_path->len, &fh);
-    if(err) return err;
-    for(size_t i = input->hist_start; i < atoms.length; i++){
-        const DrshAtom* atom = atoms.ptr[i];
-        err = drsh_append_to_file(fh, atom->txt, atom->len);
-        (void)err;
+    for(struct dirent* de; (de = readdir(d));){
+        const char* name = de->d_name;
+        if(name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+        if(de->d_type == DT_DIR) continue;
+        err = drsh_gb_append_(names, name, strlen(name)+1);
+        if(err) break;
     }
-    err = drsh_close_file(fh);
+    closedir(d);
     return err;
+#endif
 }
 
+// Splits path into the directories on it. Directories that were on the
+// old PATH too keep what was read from them, since their stamps are
+// checked anyway; the others aren't read yet.
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_refresh_size(DrshTermState* ts, DrshEnvironment* env){
-    if(!ts->out_is_terminal) return EC_OK;
-    {
-    #ifdef _WIN32
-        CONSOLE_SCREEN_BUFFER_INFO csbi;
-        BOOL success = GetConsoleScreenBufferInfo(ts->out_fd, &csbi);
-        if(!success) return EC_IO_ERROR;
-        env->cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-        env->lines = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-    #else
-        struct winsize w;
-        int e = ioctl(ts->out_fd, TIOCGWINSZ, &w);
-        if(e == -1) return EC_IO_ERROR;
-        env->lines = w.ws_row;
-        env->cols = w.ws_col;
-    #endif
+drsh_path_cache_set_dirs(DrshPathCache* pc, const DrshAtom* path, _Bool windows_style){
+    char path_separator = windows_style?';':':';
+    DrshGrowBuffer old = pc->dirs;
+    pc->dirs = (DrshGrowBuffer){0};
+    DrshPathDir* olds = (DrshPathDir*)old.data;
+    size_t nold = old.count/sizeof *olds;
+    // No old PATH means everything has to be read again (hash -r).
+    const char*_Nullable old_path = pc->path? pc->path->txt : NULL;
+    DrshEC err = EC_OK;
+    for(const char* p = path->txt;;){
+        const char* s = strchr(p, path_separator);
+        size_t len = s? (size_t)(s-p) : strlen(p);
+        if(len){
+            DrshPathDir d = {
+                .off = (uint32_t)(p - path->txt),
+                .len = (uint32_t)len,
+                .relative = !drsh_path_is_abs((DrshStringView){.length=len, .txt=p}, windows_style),
+            };
+            for(size_t i = 0; old_path && i < nold; i++){
+                DrshPathDir* o = &olds[i];
+                if(!o->scanned || o->len != len || memcmp(old_path + o->off, p, len) != 0)
+                    continue;
+                d.stamp = o->stamp;
+                d.scanned = 1;
+                d.names = o->names;
+                // Taken, so a repeated directory doesn't share it.
+                o->scanned = 0;
+                o->names = (DrshGrowBuffer){0};
+                break;
+            }
+            err = drsh_gb_append_(&pc->dirs, &d, sizeof d);
+            if(err){
+                free(d.names.data);
+                break;
+            }
+        }
+        if(!s) break;
+        p = s+1;
     }
-    DrshEC err;
-    char buff[16];
-    int n;
-    n = snprintf(buff, sizeof buff, "%d", env->lines);
-    err = drsh_env_set_env3(env, env->at->special[ATOM_LINES], buff, n);
-    if(err) return err;
-    n = snprintf(buff, sizeof buff, "%d", env->cols);
-    err = drsh_env_set_env3(env, env->at->special[ATOM_COLUMNS], buff, n);
-    if(err) return err;
-    return EC_OK;
+    for(size_t i = 0; i < nold; i++)
+        free(olds[i].names.data);
+    free(old.data);
+    return err;
 }
 
 DRSH_INTERNAL
-#ifdef __GNUC__
-__attribute__((format(printf, 2, 3)))
-#endif
-DrshEC
-drsh_ts_printf(DrshTermState*restrict ts, const char*restrict fmt, ...){
-    va_list va;
-    va_start(va, fmt);
-    DrshEC err = drsh_ts_vprintf(ts, fmt, va);
-    va_end(va);
-    return err;
+void
+drsh_path_cache_chdir(DrshPathCache* pc){
+    DrshPathDir* dirs = (DrshPathDir*)pc->dirs.data;
+    for(size_t i = 0; i < pc->dirs.count/sizeof *dirs; i++){
+        if(!dirs[i].relative) continue;
+        dirs[i].scanned = 0;
+        pc->checked_ns = 0;
+    }
 }
 
+// Which directory (the index into dirs) the command is in, or -1.
 DRSH_INTERNAL
-DRSH_WARN_UNUSED
-DrshEC
-drsh_ts_vprintf(DrshTermState*restrict ts, const char*restrict fmt, va_list va){
-    DrshGrowBuffer* b = &ts->tmp;
-    drsh_gb_clear(b);
-    DrshEC err = drsh_gb_vsprintf(b, fmt, va);
-    if(err) return err;
-    DrshReadBuffer rb = drsh_gb_readable_buffer(b);
-    return drsh_ts_write(ts, rb.ptr, rb.length);
+size_t
+drsh_path_cache_which_dir(const DrshPathCache* pc, const char* name, size_t len){
+    const DrshPathName* names = (const DrshPathName*)pc->names.data;
+    const DrshPathDir* dirs = (const DrshPathDir*)pc->dirs.data;
+    const DrshHashIndex* hi = &pc->name_index;
+    uint32_t hash = drsh_atom_hash(name, len);
+    size_t mask = hi->cap-1;
+    if(hi->cap) for(size_t s = hash & mask; hi->slots[s].idx; s = (s+1) & mask){
+        if(hi->slots[s].hash != hash) continue;
+        const DrshPathName* n = &names[hi->slots[s].idx-1];
+        if(n->len == len && memcmp(dirs[n->dir].names.data + n->off, name, len) == 0)
+            return n->dir;
+    }
+    return (size_t)-1;
 }
 
+// Rebuilds the index of names from the names in each directory.
 DRSH_INTERNAL
-#ifdef __GNUC__
-__attribute__((format(printf, 2, 3)))
+DRSH_WARN_UNUSED
+DrshEC
+drsh_path_cache_index_names(DrshPathCache* pc){
+    drsh_gb_clear(&pc->names);
+    drsh_hi_clear(&pc->name_index);
+    const DrshPathDir* dirs = (const DrshPathDir*)pc->dirs.data;
+    size_t ndirs = pc->dirs.count/sizeof *dirs;
+    for(size_t i = 0; i < ndirs; i++){
+        const char* txt = dirs[i].names.data;
+        for(size_t off = 0; off < dirs[i].names.count;){
+            size_t len = strlen(txt+off);
+            // Earlier directories on PATH win.
+            if(drsh_path_cache_which_dir(pc, txt+off, len) == (size_t)-1){
+                size_t count = pc->names.count/sizeof(DrshPathName);
+                DrshEC err = drsh_hi_reserve1(&pc->name_index, count);
+                if(err) return err;
+                DrshPathName n = {(uint32_t)i, (uint32_t)off, (uint32_t)len};
+                err = drsh_gb_append_(&pc->names, &n, sizeof n);
+                if(err) return err;
+                drsh_hi_insert(&pc->name_index, drsh_atom_hash(txt+off, len), (uint32_t)count+1);
+            }
+            off += len+1;
+        }
+    }
+    return EC_OK;
+}
+
+#ifdef DRSH_IO_URING
+DRSH_INTERNAL
+void
+drsh_stat_ring_close(DrshStatRing* r){
+    if(r->sqes) munmap(r->sqes, r->sqes_size);
+    if(r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    if(r->sq_ring) munmap(r->sq_ring, r->sq_ring_size);
+    r->sqes = NULL;
+    r->cq_ring = NULL;
+    r->sq_ring = NULL;
+    if(r->fd >= 0) close(r->fd);
+    r->fd = -1;
+}
+
+// Sets up the ring the first time. Returns whether it can be used.
+DRSH_INTERNAL
+_Bool
+drsh_stat_ring_init(DrshStatRing* r){
+    if(r->tried) return r->fd >= 0;
+    r->tried = 1;
+    struct io_uring_params p = {0};
+    r->fd = (int)syscall(__NR_io_uring_setup, DRSH_STAT_RING_ENTRIES, &p);
+    if(r->fd < 0) return 0;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    _Bool single = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+    if(single && r->cq_ring_size > r->sq_ring_size)
+        r->sq_ring_size = r->cq_ring_size;
+    void* sq = mmap(NULL, r->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) goto Lfail;
+    r->sq_ring = sq;
+    void* cq = sq;
+    if(!single){
+        cq = mmap(NULL, r->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) goto Lfail;
+    }
+    r->cq_ring = cq;
+    r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) goto Lfail;
+    r->sqes = sqes;
+    r->sq_tail = (unsigned*)((char*)sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)sq + p.sq_off.array);
+    r->cq_head = (unsigned*)((char*)cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)cq + p.cq_off.cqes);
+    return 1;
+
+    Lfail:
+    drsh_stat_ring_close(r);
+    return 0;
+}
+
+//
+// Stats the n (at most DRSH_STAT_RING_ENTRIES) paths with one submission.
+// res[i] is 0 or -errno and the stat is in r->results[i]. Returns whether
+// it worked; if not, the ring is closed and none of it should be used.
+//
+DRSH_INTERNAL
+_Bool
+drsh_stat_ring_batch(DrshStatRing* r, const char*const* paths, int* res, size_t n){
+    unsigned tail = *r->sq_tail;
+    for(size_t i = 0; i < n; i++, tail++){
+        unsigned idx = tail & *r->sq_mask;
+        struct io_uring_sqe* sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)paths[i];
+        sqe->len = STATX_SIZE|STATX_MTIME;
+        sqe->off = (uint64_t)(uintptr_t)&r->results[i];
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    size_t submitted = 0, done = 0;
+    while(done < n){
+        long ret = syscall(__NR_io_uring_enter, r->fd, (unsigned)(n-submitted), (unsigned)(n-done), IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            drsh_stat_ring_close(r);
+            return 0;
+        }
+        submitted += (size_t)ret;
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != ctail; head++, done++){
+            const struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+#endif
+
+#ifndef _WIN32
+//
+// Slow directories are stat'd and read on a few threads when io_uring
+// can't be used: it isn't built in, the kernel is too old, or it is
+// turned off (io_uring_disabled, or seccomp in a container). Each thread
+// takes the next of the n jobs until there are none left.
+//
+typedef struct DrshPathJobs DrshPathJobs;
+struct DrshPathJobs {
+    void (*run)(void* ctx, size_t i);
+    void* ctx;
+    size_t n;
+    size_t next;
+};
+
+DRSH_INTERNAL
+void*_Nullable
+drsh_path_jobs_work(void* p){
+    DrshPathJobs* jobs = p;
+    for(size_t i; (i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->n;)
+        jobs->run(jobs->ctx, i);
+    return NULL;
+}
+
+//
+// Runs all the jobs, on up to DRSH_PATH_THREADS threads counting this
+// one. This thread works too, so they all get done even if no threads can
+// be started. Returns how many were started.
+//
+DRSH_INTERNAL
+size_t
+drsh_path_jobs_run(DrshPathJobs* jobs){
+    pthread_t threads[DRSH_PATH_THREADS-1];
+    size_t want = jobs->n < DRSH_PATH_THREADS? jobs->n-1 : DRSH_PATH_THREADS-1;
+    size_t started = 0;
+    // Started with every signal blocked, so signals still go to the
+    // shell's thread.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for(; started < want; started++)
+        if(pthread_create(&threads[started], NULL, drsh_path_jobs_work, jobs) != 0)
+            break;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    drsh_path_jobs_work(jobs);
+    for(size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return started;
+}
+
+typedef struct DrshPathStampJobs DrshPathStampJobs;
+struct DrshPathStampJobs {
+    const char*const* paths;
+    DrshDirStamp* stamps;
+};
+
+DRSH_INTERNAL
+void
+drsh_path_stamp_job(void* ctx, size_t i){
+    DrshPathStampJobs* j = ctx;
+    if(drsh_file_stamp(j->paths[i], &j->stamps[i].size, &j->stamps[i].mtime))
+        j->stamps[i] = (DrshDirStamp){0};
+}
+
+typedef struct DrshPathReadJobs DrshPathReadJobs;
+struct DrshPathReadJobs {
+    const char*const* paths;
+    DrshPathDir* dirs;
+    const size_t* which; // index into paths and dirs of each job
+    DrshEC* errs;
+};
+
+DRSH_INTERNAL
+void
+drsh_path_read_job(void* ctx, size_t i){
+    DrshPathReadJobs* j = ctx;
+    size_t k = j->which[i];
+    j->errs[i] = drsh_read_dir_names(j->paths[k], &j->dirs[k].names);
+}
+#endif
+
+//
+// Stamps each of the n paths (at most DRSH_PATH_STAMP_BATCH) like
+// drsh_file_stamp, or with zeros if it can't be stat'd. Once the
+// directories have been slow, they are all stat'd at once through
+// io_uring where it is available, or else on threads.
+//
+DRSH_INTERNAL
+void
+drsh_path_cache_stamp_dirs(DrshPathCache* pc, const char*const* paths, DrshDirStamp* stamps, size_t n){
+    pc->dir_stats += n;
+    uint64_t t0 = drsh_monotonic_ns();
+#ifdef DRSH_IO_URING
+    DrshStatRing* r = &pc->ring;
+    int res[DRSH_STAT_RING_ENTRIES];
+    if(pc->slow_dirs && n > 1 && drsh_stat_ring_init(r) && drsh_stat_ring_batch(r, paths, res, n)){
+        pc->stat_batches++;
+        pc->slow_dirs = drsh_monotonic_ns() - t0 >= DRSH_SLOW_STAT_NS;
+        for(size_t i = 0; i < n; i++){
+            const struct statx* sx = &r->results[i];
+            if(res[i] == 0)
+                stamps[i] = (DrshDirStamp){sx->stx_size, (int64_t)sx->stx_mtime.tv_sec*1000000000 + sx->stx_mtime.tv_nsec};
+            else if(res[i] == -EINVAL || res[i] == -EOPNOTSUPP){
+                // Kernel is too old to statx through the ring.
+                drsh_stat_ring_close(r);
+                goto Lone_by_one;
+            }
+            else
+                stamps[i] = (DrshDirStamp){0};
+        }
+        return;
+    }
+    Lone_by_one:;
+#endif
+#ifndef _WIN32
+    if(pc->slow_dirs && n > 1){
+        DrshPathStampJobs j = {.paths = paths, .stamps = stamps};
+        DrshPathJobs jobs = {.run = drsh_path_stamp_job, .ctx = &j, .n = n};
+        if(drsh_path_jobs_run(&jobs)) pc->thread_batches++;
+        pc->slow_dirs = drsh_monotonic_ns() - t0 >= DRSH_SLOW_STAT_NS;
+        return;
+    }
 #endif
+    for(size_t i = 0; i < n; i++){
+        DrshEC err = drsh_file_stamp(paths[i], &stamps[i].size, &stamps[i].mtime);
+        if(err) stamps[i] = (DrshDirStamp){0};
+        uint64_t t1 = drsh_monotonic_ns();
+        if(t1 - t0 >= DRSH_SLOW_STAT_NS) pc->slow_dirs = 1;
+        t0 = t1;
+    }
+}
+
+// Where the shared index for path is kept in the shared directory.
+DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_gb_sprintf(DrshGrowBuffer* gb, const char* fmt, ...){
-    va_list va;
-    va_start(va, fmt);
-    DrshEC err = drsh_gb_vsprintf(gb, fmt, va);
-    va_end(va);
-    return err;
+drsh_path_index_file(const DrshAtom* shared, const DrshAtom* path, DrshGrowBuffer* out){
+    drsh_gb_clear(out);
+    DrshEC err = drsh_gb_append_(out, shared->txt, shared->len);
+    if(err) return err;
+    if(shared->txt[shared->len-1] != '/'){
+        err = drsh_gb_append_(out, "/", 1);
+        if(err) return err;
+    }
+    char name[32];
+    int n = snprintf(name, sizeof name, "drsh_path_%08x", (unsigned)drsh_atom_hash(path->txt, path->len));
+    return drsh_gb_append_(out, name, (size_t)n+1);
+}
+
+// Only directories that are the same for every shell are shared.
+DRSH_INTERNAL
+_Bool
+drsh_path_index_shareable(const char* dir, size_t len){
+    return len && dir[0] == '/';
+}
+
+//
+// Whether the directory holding a shared index is only writable by this
+// user. Otherwise someone else could swap in their own index between the
+// checks and the mapping, or delete ours and watch for the new one.
+//
+DRSH_INTERNAL
+_Bool
+drsh_path_index_dir_trusted(const char* file){
+#ifdef _WIN32
+    (void)file;
+    return 0;
+#else
+    const char* slash = strrchr(file, '/');
+    if(!slash) return 0;
+    char dir[4096];
+    size_t len = slash == file? 1 : (size_t)(slash - file);
+    if(len >= sizeof dir) return 0;
+    memcpy(dir, file, len);
+    dir[len] = 0;
+    struct stat s;
+    if(stat(dir, &s) == -1 || !S_ISDIR(s.st_mode)) return 0;
+    return s.st_uid == geteuid() && !(s.st_mode & (S_IWGRP|S_IWOTH));
+#endif
 }
 
+//
+// Maps a shared index, if it is valid and was written by this user in a
+// directory only they can write to (so someone else can't make us run
+// their commands).
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_gb_vsprintf(DrshGrowBuffer* b, const char* fmt, va_list va){
-    DrshEC err;
-    err = drsh_gb_ensure(b, UINT16_MAX*2);
+drsh_path_index_map(const char* file, const void*_Nullable*_Nonnull out, size_t* out_size){
+#ifdef _WIN32
+    (void)file;
+    (void)out;
+    (void)out_size;
+    return EC_UNIMPLEMENTED_ERROR;
+#else
+    if(!drsh_path_index_dir_trusted(file)) return EC_VALUE_ERROR;
+    int fd = open(file, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+    if(fd < 0) return EC_NOT_FOUND;
+    struct stat s;
+    if(fstat(fd, &s) == -1 || !S_ISREG(s.st_mode) || s.st_uid != geteuid() || (size_t)s.st_size < sizeof(DrshPathIndexHeader)){
+        close(fd);
+        return EC_VALUE_ERROR;
+    }
+    size_t size = s.st_size;
+    void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return EC_IO_ERROR;
+    const char* base = p;
+    const DrshPathIndexHeader* h = p;
+    if(memcmp(h->magic, DRSH_PATH_INDEX_MAGIC, sizeof h->magic) != 0) goto Linvalid;
+    if(h->version != DRSH_PATH_INDEX_VERSION) goto Linvalid;
+    if(h->size != size) goto Linvalid;
+    if(h->ndirs > (size - sizeof *h)/sizeof(DrshPathIndexDir)) goto Linvalid;
+    if(drsh_hash_align1(base + sizeof *h, size - sizeof *h) != h->checksum) goto Linvalid;
+    const DrshPathIndexDir* dirs = (const DrshPathIndexDir*)(h+1);
+    for(size_t i = 0; i < h->ndirs; i++){
+        const DrshPathIndexDir* d = &dirs[i];
+        if(d->dir_off > size || d->dir_len > size - d->dir_off) goto Linvalid;
+        if(d->names_off > size || d->names_len > size - d->names_off) goto Linvalid;
+        if(d->names_len && base[d->names_off + d->names_len - 1]) goto Linvalid;
+    }
+    *out = p;
+    *out_size = size;
+    return EC_OK;
+
+    Linvalid:
+    munmap(p, size);
+    return EC_VALUE_ERROR;
+#endif
+}
+
+//
+// Copies the names of dir from a mapped shared index, if they were read
+// when dir had this stamp.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_path_index_take(const char* base, const char* dir, size_t len, DrshDirStamp stamp, DrshGrowBuffer* names){
+    const DrshPathIndexHeader* h = (const DrshPathIndexHeader*)base;
+    const DrshPathIndexDir* dirs = (const DrshPathIndexDir*)(h+1);
+    for(size_t i = 0; i < h->ndirs; i++){
+        const DrshPathIndexDir* d = &dirs[i];
+        if(d->dir_len != len || memcmp(base + d->dir_off, dir, len) != 0) continue;
+        if(d->stamp.size != stamp.size || d->stamp.mtime != stamp.mtime) return EC_NOT_FOUND;
+        drsh_gb_clear(names);
+        if(!d->names_len) return EC_OK;
+        return drsh_gb_append_(names, base + d->names_off, d->names_len);
+    }
+    return EC_NOT_FOUND;
+}
+
+// Saves the names in each directory on PATH to the shared index.
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_path_index_save(const DrshPathCache* pc, const char* file){
+#ifdef _WIN32
+    (void)pc;
+    (void)file;
+    return EC_UNIMPLEMENTED_ERROR;
+#else
+    if(!drsh_path_index_dir_trusted(file)) return EC_VALUE_ERROR;
+    const DrshPathDir* dirs = (const DrshPathDir*)pc->dirs.data;
+    size_t ndirs = pc->dirs.count/sizeof *dirs;
+    const char* path = pc->path->txt;
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    int64_t settled = ((int64_t)t.tv_sec - DRSH_PATH_INDEX_SETTLE)*1000000000 + t.tv_nsec;
+    size_t count = 0;
+    size_t size = sizeof(DrshPathIndexHeader);
+    for(size_t i = 0; i < ndirs; i++){
+        const DrshPathDir* d = &dirs[i];
+        if(!d->scanned || d->stamp.mtime > settled || !drsh_path_index_shareable(path + d->off, d->len))
+            continue;
+        count++;
+        size += sizeof(DrshPathIndexDir) + d->len + d->names.count;
+    }
+    if(size > UINT32_MAX) return EC_VALUE_ERROR;
+    DrshGrowBuffer b = {0};
+    DrshEC err = drsh_gb_reserve(&b, size);
     if(err) return err;
-    for(;;){
-        DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
-        va_list va2;
-        va_copy(va2, va);
-        int n = vsnprintf(wb.ptr, wb.length, fmt, va2);
-        if(n < 0) return EC_ASSERTION_ERROR;
-        if((size_t)n >= wb.length){
-            err = drsh_gb_ensure(b, n+32);
-            if(err) return err;
-            va_end(va2);
+    memset(b.data, 0, size);
+    DrshPathIndexHeader* h = (DrshPathIndexHeader*)b.data;
+    DrshPathIndexDir* out = (DrshPathIndexDir*)(h+1);
+    size_t off = sizeof *h + count*sizeof *out;
+    for(size_t i = 0; i < ndirs; i++){
+        const DrshPathDir* d = &dirs[i];
+        if(!d->scanned || d->stamp.mtime > settled || !drsh_path_index_shareable(path + d->off, d->len))
             continue;
-        }
-        b->count += n;
-        va_end(va2);
-        break;
+        *out = (DrshPathIndexDir){
+            .stamp = d->stamp,
+            .dir_off = (uint32_t)off,
+            .dir_len = d->len,
+            .names_off = (uint32_t)(off + d->len),
+            .names_len = (uint32_t)d->names.count,
+        };
+        memcpy(b.data + off, path + d->off, d->len);
+        off += d->len;
+        if(d->names.count) memcpy(b.data + off, d->names.data, d->names.count);
+        off += d->names.count;
+        out++;
     }
+    memcpy(h->magic, DRSH_PATH_INDEX_MAGIC, sizeof h->magic);
+    h->version = DRSH_PATH_INDEX_VERSION;
+    h->size = size;
+    h->ndirs = (uint32_t)count;
+    h->checksum = drsh_hash_align1(b.data + sizeof *h, size - sizeof *h);
+    err = drsh_write_file_replacing(file, b.data, size, 0600);
+    free(b.data);
     return err;
+#endif
 }
 
+//
+// Empties the cache if it was filled under another PATH or PATHEXT, or
+// (checking at most every DRSH_PATH_RECHECK_NS unless forced) if a
+// directory on PATH was modified since. Directories that were modified
+// are read again, or taken from the shared index in the shared directory
+// if another shell already read them.
+//
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_env_get_history_path(DrshEnvironment* env, const DrshAtom** hist){
-    {
-        const DrshAtom* h = drsh_env_get_env(env, env->at->special[ATOM_DRSH_HISTORY]);
-        if(h){
-            *hist = h;
-            return EC_OK;
+drsh_path_cache_validate(DrshPathCache* pc, const DrshAtom* path, const DrshAtom*_Nullable pathext, const DrshAtom*_Nullable shared, _Bool windows_style, DrshGrowBuffer* scratch, _Bool force){
+    uint64_t now = drsh_monotonic_ns();
+    _Bool same_path = pc->path == path && pc->pathext == pathext;
+    if(same_path && !force && now - pc->checked_ns < DRSH_PATH_RECHECK_NS)
+        return EC_OK;
+    DrshEC err;
+    _Bool changed = 0;
+    size_t reads = 0;
+    // The shared index, mapped when a directory first needs reading.
+    DrshGrowBuffer shared_file = {0};
+    const void*_Nullable shared_base = NULL;
+    size_t shared_size = 0;
+    if(shared && (windows_style || !shared->len)) shared = NULL;
+    if(!same_path){
+        err = drsh_path_cache_set_dirs(pc, path, windows_style);
+        if(err) goto Lfail;
+        pc->path = path;
+        pc->pathext = pathext;
+        changed = 1;
+    }
+    DrshPathDir* dirs = (DrshPathDir*)pc->dirs.data;
+    size_t ndirs = pc->dirs.count/sizeof *dirs;
+    for(size_t start = 0; start < ndirs; start += DRSH_PATH_STAMP_BATCH){
+        size_t n = ndirs - start;
+        if(n > DRSH_PATH_STAMP_BATCH) n = DRSH_PATH_STAMP_BATCH;
+        size_t offs[DRSH_PATH_STAMP_BATCH];
+        drsh_gb_clear(scratch);
+        for(size_t i = 0; i < n; i++){
+            const DrshPathDir* d = &dirs[start+i];
+            offs[i] = scratch->count;
+            err = drsh_gb_append_(scratch, path->txt + d->off, d->len);
+            if(!err) err = drsh_gb_append_(scratch, "\0", 1);
+            if(err) goto Lfail;
+        }
+        const char* paths[DRSH_PATH_STAMP_BATCH];
+        for(size_t i = 0; i < n; i++)
+            paths[i] = scratch->data + offs[i];
+        DrshDirStamp stamps[DRSH_PATH_STAMP_BATCH];
+        drsh_path_cache_stamp_dirs(pc, paths, stamps, n);
+        // Directories to read, once the whole batch is stamped.
+        size_t pending[DRSH_PATH_STAMP_BATCH];
+        size_t npending = 0;
+        for(size_t i = 0; i < n; i++){
+            DrshPathDir* d = &dirs[start+i];
+            DrshDirStamp stamp = stamps[i];
+            if(d->scanned && stamp.size == d->stamp.size && stamp.mtime == d->stamp.mtime)
+                continue;
+            // Stamped before reading, so a change while reading is seen by
+            // the next check.
+            d->stamp = stamp;
+            d->scanned = 1;
+            changed = 1;
+            if(windows_style) continue;
+            if(shared && !shared_file.count && drsh_path_index_shareable(paths[i], d->len)){
+                err = drsh_path_index_file(shared, path, &shared_file);
+                if(err) goto Lfail;
+                if(drsh_path_index_map(shared_file.data, &shared_base, &shared_size))
+                    shared_base = NULL;
+            }
+            if(shared_base && drsh_path_index_take(shared_base, paths[i], d->len, stamp, &d->names) == EC_OK){
+                pc->shared_loads++;
+                continue;
+            }
+            pending[npending++] = i;
+        }
+        DrshEC errs[DRSH_PATH_STAMP_BATCH];
+        #ifndef _WIN32
+        if(pc->slow_dirs && npending > 1){
+            DrshPathReadJobs j = {.paths = paths, .dirs = &dirs[start], .which = pending, .errs = errs};
+            DrshPathJobs jobs = {.run = drsh_path_read_job, .ctx = &j, .n = npending};
+            (void)drsh_path_jobs_run(&jobs);
+        }
+        else
+        #endif
+        for(size_t k = 0; k < npending; k++)
+            errs[k] = drsh_read_dir_names(paths[pending[k]], &dirs[start+pending[k]].names);
+        for(size_t k = 0; k < npending; k++){
+            err = errs[k];
+            if(err) goto Lfail;
+            pc->scans++;
+            reads++;
         }
     }
-    DrshEC err = EC_UNIMPLEMENTED_ERROR;
-    DrshGrowBuffer* b = &env->tmp;
-    drsh_gb_clear(b);
-    OsFlavor os_flavor = env->os_flavor;
-    if(os_flavor == OS_APPLE) {
-        const DrshAtom*_Nullable home = env->home;
-        if(!home || !home->len) return EC_NOT_FOUND;
-        err = drsh_gb_append_(b, home->txt, home->len);
-        if(err) return err;
-        err = drsh_gb_append_(b, "/Library/Application Support", -1+sizeof "/Library/Application Support");
-        if(err) return err;
+    if(changed){
+        if(pc->entries.count) pc->flushes++;
+        drsh_path_cache_clear(pc);
+        if(!windows_style){
+            err = drsh_path_cache_index_names(pc);
+            if(err) goto Lfail;
+        }
     }
-    else if(os_flavor == OS_WINDOWS){
-        const DrshAtom*_Nullable localdata = drsh_env_get_env2(env, "LOCALAPPDATA", -1+sizeof "LOCALAPPDATA");
-        if(!localdata || !localdata->len) return EC_NOT_FOUND;
-        err = drsh_gb_append_(b, localdata->txt, localdata->len);
-        if(err) return err;
+    if(shared && reads){
+        if(!shared_file.count){
+            err = drsh_path_index_file(shared, path, &shared_file);
+            if(err) goto Lfail;
+        }
+        // The other shells will just read the directories themselves.
+        DrshEC e2 = drsh_path_index_save(pc, shared_file.data);
+        (void)e2;
     }
-    else { // linux or other
-        // use xdg
-        const DrshAtom*_Nullable xdg = drsh_env_get_env2(env, "XDG_STATE_HOME", -1+sizeof "XDG_STATE_HOME");
-        if(!xdg || !xdg->len) xdg = drsh_env_get_env2(env, "XDG_DATA_HOME", -1+sizeof "XDG_DATA_HOME");
-        if(xdg && xdg->len){
-            err = drsh_gb_append_(b, xdg->txt, xdg->len);
+    pc->checked_ns = now;
+    err = EC_OK;
+    goto Lfinish;
+
+    Lfail:
+    // Start over next time.
+    pc->path = NULL;
+    drsh_path_cache_clear(pc);
+    Lfinish:
+    if(shared_base) drsh_unmap_file(shared_base, shared_size);
+    free(shared_file.data);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_resolve_prog_path(DrshEnvironment* env, DrshGrowBuffer* tmp, DrshStringView program, _Bool windows_style){
+    _Bool cacheable;
+    if(drsh_prog_has_dir(program, windows_style))
+        return drsh_env_search_path(env, tmp, program, windows_style, &cacheable);
+    const DrshAtom* path = drsh_env_get_env2(env, "PATH", 4);
+    if(!path) return EC_NOT_FOUND;
+    const DrshAtom* pathext = windows_style? drsh_env_get_env(env, env->at->special[ATOM_PATHEXT]) : NULL;
+    const DrshAtom* shared = drsh_env_get_env(env, env->at->special[ATOM_DRSH_PATH_INDEX]);
+    DrshPathCache* pc = &env->path_cache;
+    uint64_t checked = pc->checked_ns;
+    DrshEC err = drsh_path_cache_validate(pc, path, pathext, shared, windows_style, tmp, 0);
+    if(err) return err;
+    drsh_gb_clear(tmp);
+    pc->lookups++;
+    DrshPathCacheEntry* e = drsh_path_cache_find(pc, drsh_atom_hash(program.txt, program.length), program.txt, program.length);
+    if(e){
+        pc->hits++;
+        e->hits++;
+        if(!e->path) return EC_NOT_FOUND;
+        return drsh_gb_append_(tmp, e->path->txt, e->path->len+1);
+    }
+    if(!windows_style){
+        // PATHEXT and the current directory don't matter, so the index
+        // has the answer.
+        size_t i = drsh_path_cache_which_dir(pc, program.txt, program.length);
+        if(i == (size_t)-1 && pc->checked_ns == checked){
+            // Before deciding it doesn't exist, make sure it wasn't just
+            // put there, like by the previous command.
+            err = drsh_path_cache_validate(pc, path, pathext, shared, windows_style, tmp, 1);
             if(err) return err;
+            drsh_gb_clear(tmp);
+            i = drsh_path_cache_which_dir(pc, program.txt, program.length);
         }
-        else{
-            const DrshAtom*_Nullable home = env->home;
-            if(!home || !home->len) return EC_NOT_FOUND;
-            err = drsh_gb_append_(b, home->txt, home->len);
-            if(err) return err;
-            err = drsh_gb_append_(b, "/.local/state", -1+sizeof "/.local/state");
+        err = EC_NOT_FOUND;
+        if(i != (size_t)-1){
+            const DrshPathDir* d = &((const DrshPathDir*)pc->dirs.data)[i];
+            const char* dir = path->txt + d->off;
+            err = drsh_gb_append_(tmp, dir, d->len);
+            if(!err && dir[d->len-1] != '/')
+                err = drsh_gb_append_(tmp, "/", 1);
+            if(!err) err = drsh_gb_append_(tmp, program.txt, program.length);
+            if(!err) err = drsh_gb_append_(tmp, "\0", 1);
             if(err) return err;
         }
+        cacheable = 1;
+    }
+    else
+        err = drsh_env_search_path(env, tmp, program, windows_style, &cacheable);
+    if(err && err != EC_NOT_FOUND) return err;
+    if(cacheable){
+        DrshEC e2 = drsh_path_cache_add(pc, env->at, program, err? NULL : tmp->data, err? 0 : tmp->count-1);
+        (void)e2;
+    }
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_at_init(DrshAtomTable* at){
+    drsh_hash_select();
+    for(size_t i = 0; i < DRSH_AT_SHARDS; i++){
+        DrshAtomShard* sh = &at->shards[i];
+        sh->initial = (DrshAtomSlots){DRSH_AT_INITIAL_CAP, sh->initial_slots, sh->initial_atoms};
+        sh->slots = &sh->initial;
+        sh->arena.chunk_size = DRSH_AT_CHUNK_SIZE;
+        drsh_mutex_init(&sh->lock);
+    }
+    // The hashes only depend on the hash function, so they are the same
+    // for every table. 0 is never a hash.
+    if(!drsh_static_atoms[0].hash){
+        for(size_t i = 0; i < ATOM_MAX; i++){
+            DrshStaticAtom* a = &drsh_static_atoms[i];
+            uint32_t hash = drsh_hash_align1(a->txt, a->len);
+            if(!hash) hash = 1024;
+            a->hash = hash;
+        }
+    }
+    for(size_t i = 0; i < ATOM_MAX; i++){
+        DrshAtom* a = drsh_static_atom(i);
+        at->special[i] = a;
+        DrshEC err = drsh_shard_insert(drsh_at_shard(at, a->hash), 0, a);
+        if(err) return err;
+    }
+    at->gc_threshold = 4096;
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hist_add(DrshInput* inp, const DrshAtom* atom){
+    if(!atom->len) return EC_OK;
+    DrshReadBuffer rb = drsh_gb_readable_buffer(&inp->hist_buffer);
+    DRSH_SLICE(const DrshAtom* const) atoms = {rb.length/sizeof(const DrshAtom*), rb.ptr};
+    inp->hist_cursor = atoms.length;
+    if(atoms.length && atoms.ptr[atoms.length-1] == atom)
+        return EC_OK;
+    DrshEC err = drsh_gb_append_(&inp->hist_buffer, &atom, sizeof atom);
+    if(err) return err;
+    inp->hist_cursor = atoms.length+1;
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hist_dump(const DrshInput* input, DrshEnvironment* env){
+    DrshEC err = EC_OK;
+    const DrshAtom* hist_path;
+    err = drsh_env_get_history_path(env, &hist_path);
+    if(err) return err;
+    if(!hist_path || !hist_path->len) return EC_NOT_FOUND;
+    DrshReadBuffer rb = drsh_gb_readable_buffer(&input->hist_buffer);
+    DRSH_SLICE(const DrshAtom* const) atoms = {rb.length/sizeof(const DrshAtom*), rb.ptr};
+    FileHandle fh;
+    err = drsh_open_file_for_appending_with_mkdirs(hist_path->txt, hist_path->len, &fh);
+    if(err) return err;
+    for(size_t i = input->hist_start; i < atoms.length; i++){
+        const DrshAtom* atom = atoms.ptr[i];
+        err = drsh_append_to_file(fh, atom->txt, atom->len);
+        (void)err;
+    }
+    err = drsh_close_file(fh);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_snapshot_path(const DrshAtom* hist_path, DrshGrowBuffer* out){
+    drsh_gb_clear(out);
+    DrshEC err = drsh_gb_append_(out, hist_path->txt, hist_path->len);
+    if(!err) err = drsh_gb_append_(out, DRSH_SNAPSHOT_SUFFIX, sizeof DRSH_SNAPSHOT_SUFFIX);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hist_load_snapshot(DrshInput* inp, DrshAtomTable* at, const DrshAtom* hist_path){
+    DrshGrowBuffer path = {0};
+    DrshEC err = drsh_snapshot_path(hist_path, &path);
+    if(!err) err = drsh_at_map_snapshot(at, path.data);
+    free(path.data);
+    if(err) return err;
+    uint64_t size;
+    int64_t mtime;
+    err = drsh_file_stamp(hist_path->txt, &size, &mtime);
+    if(err) return err;
+    const DrshAtomSnapshot* snap = &at->frozen;
+    if(size != snap->header->hist_size || mtime != snap->header->hist_mtime)
+        return EC_NOT_FOUND;
+    size_t count = snap->header->hist_count;
+    err = drsh_gb_reserve(&inp->hist_buffer, count * sizeof(const DrshAtom*));
+    if(err) return err;
+    for(size_t i = 0; i < count; i++){
+        const DrshAtom* a = (const DrshAtom*)(snap->base + snap->offsets[snap->history[i]]);
+        // Atoms interned before the snapshot was mapped (the environment,
+        // the config) take precedence over their frozen copies.
+        const DrshAtom* live = drsh_shard_find(drsh_at_shard(at, a->hash), a->hash, a->txt, a->len);
+        if(live) a = live;
+        err = drsh_gb_append(&inp->hist_buffer, &a, sizeof a);
+        if(err) return err;
+    }
+    inp->hist_cursor = count;
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hist_build_snapshot(const DrshInput* inp, uint64_t hist_size, int64_t hist_mtime, DrshGrowBuffer* out){
+    DrshReadBuffer rb = drsh_gb_readable_buffer(&inp->hist_buffer);
+    DRSH_SLICE(const DrshAtom* const) hist = {rb.length/sizeof(const DrshAtom*), rb.ptr};
+    if(hist.length >= UINT32_MAX) return EC_VALUE_ERROR;
+    DrshEC err = EC_OK;
+    DrshHashIndex index = {0};
+    const DrshAtom** uniq = malloc((hist.length+1) * sizeof *uniq);
+    uint32_t* history = malloc((hist.length+1) * sizeof *history);
+    if(!uniq || !history){
+        err = EC_OOM;
+        goto Lfinish;
+    }
+    size_t count = 0;
+    size_t atom_bytes = 0;
+    for(size_t i = 0; i < hist.length; i++){
+        const DrshAtom* a = hist.ptr[i];
+        size_t mask = index.cap-1;
+        size_t s = index.cap? a->hash & mask : 0;
+        for(; index.cap && index.slots[s].idx; s = (s+1) & mask){
+            if(index.slots[s].hash == a->hash && uniq[index.slots[s].idx-1] == a)
+                break;
+        }
+        if(index.cap && index.slots[s].idx){
+            history[i] = index.slots[s].idx-1;
+            continue;
+        }
+        err = drsh_hi_reserve1(&index, count);
+        if(err) goto Lfinish;
+        uniq[count] = a;
+        history[i] = (uint32_t)count;
+        count++;
+        drsh_hi_insert(&index, a->hash, (uint32_t)count);
+        atom_bytes += (sizeof(DrshAtom) + a->len + 1 + 7) & ~(size_t)7;
+    }
+    if(!index.cap){
+        err = drsh_hi_resize(&index, 32);
+        if(err) goto Lfinish;
+    }
+    size_t atoms_start = sizeof(DrshSnapshotHeader) + index.cap*sizeof(DrshHashSlot) + (count+hist.length)*sizeof(uint32_t);
+    atoms_start = (atoms_start + 7) & ~(size_t)7;
+    size_t size = atoms_start + atom_bytes;
+    // Offsets are 32 bits.
+    if(size > UINT32_MAX){
+        err = EC_VALUE_ERROR;
+        goto Lfinish;
+    }
+    drsh_gb_clear(out);
+    err = drsh_gb_reserve(out, size);
+    if(err) goto Lfinish;
+    char* base = out->data;
+    memset(base, 0, size);
+    DrshSnapshotHeader* h = (DrshSnapshotHeader*)base;
+    DrshHashSlot* slots = (DrshHashSlot*)(base + sizeof *h);
+    uint32_t* offsets = (uint32_t*)(slots + index.cap);
+    memcpy(slots, index.slots, index.cap * sizeof *slots);
+    memcpy(offsets + count, history, hist.length * sizeof *history);
+    size_t off = atoms_start;
+    for(size_t i = 0; i < count; i++){
+        const DrshAtom* a = uniq[i];
+        DrshAtom* dst = (DrshAtom*)(base + off);
+        dst->len = a->len;
+        dst->hash = a->hash;
+        memcpy(dst->txt, a->txt, a->len);
+        offsets[i] = (uint32_t)off;
+        off += (sizeof(DrshAtom) + a->len + 1 + 7) & ~(size_t)7;
+    }
+    memcpy(h->magic, DRSH_SNAPSHOT_MAGIC, sizeof h->magic);
+    h->version = DRSH_SNAPSHOT_VERSION;
+    h->hash_kind = (uint32_t)drsh_hash_kind();
+    h->atom_size = sizeof(DrshAtom);
+    h->size = size;
+    h->cap = (uint32_t)index.cap;
+    h->count = (uint32_t)count;
+    h->hist_count = (uint32_t)hist.length;
+    h->hist_size = hist_size;
+    h->hist_mtime = hist_mtime;
+    h->checksum = drsh_hash_align1(base + sizeof *h, size - sizeof *h);
+    out->count = size;
+
+    Lfinish:
+    free(index.slots);
+    free(uniq);
+    free(history);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_hist_save_snapshot(DrshInput* inp, DrshAtomTable* at, DrshEnvironment* env){
+    const DrshAtom* hist_path;
+    DrshEC err = drsh_env_get_history_path(env, &hist_path);
+    if(err) return err;
+    if(!hist_path || !hist_path->len) return EC_NOT_FOUND;
+    // The history file was just appended to, so this is what the next
+    // shell will see.
+    uint64_t size;
+    int64_t mtime;
+    err = drsh_file_stamp(hist_path->txt, &size, &mtime);
+    if(err) return err;
+    // Nothing was added, so the mapped snapshot is still good.
+    if(at->frozen.base && at->frozen.header->hist_size == size && at->frozen.header->hist_mtime == mtime)
+        return EC_OK;
+    // If another shell appended to the history too, our history is
+    // missing its lines, so leave it to the next shell to read the file.
+    uint64_t expected = inp->hist_file_size;
+    {
+        DrshReadBuffer rb = drsh_gb_readable_buffer(&inp->hist_buffer);
+        DRSH_SLICE(const DrshAtom* const) atoms = {rb.length/sizeof(const DrshAtom*), rb.ptr};
+        for(size_t i = inp->hist_start; i < atoms.length; i++)
+            expected += atoms.ptr[i]->len + 1;
+    }
+    if(size != expected) return EC_NOT_FOUND;
+    DrshGrowBuffer snapshot = {0};
+    DrshGrowBuffer path = {0};
+    err = drsh_hist_build_snapshot(inp, size, mtime, &snapshot);
+    if(!err) err = drsh_snapshot_path(hist_path, &path);
+    if(err) goto Lfinish;
+    // The history and the path could be frozen atoms, but everything
+    // needed has been copied out of them by now. Windows can't replace
+    // a file that is mapped.
+    drsh_gb_clear(&inp->hist_buffer);
+    inp->hist_cursor = 0;
+    drsh_at_unmap_snapshot(at);
+    err = drsh_write_file_replacing(path.data, snapshot.data, snapshot.count, 0600);
+
+    Lfinish:
+    free(snapshot.data);
+    free(path.data);
+    return err;
+}
+
+DRSH_INTERNAL
+void
+drsh_collect_garbage(DrshAtomTable* at, DrshEnvironment* env, DrshInput* inp){
+    DrshAtomGc gc;
+    if(drsh_at_gc_begin(at, &gc)){
+        // Not enough memory to copy into, try again once the table grew.
+        at->gc_threshold = 2*drsh_at_count(at);
+        return;
+    }
+    {
+        const DrshAtom** atoms = env->data;
+        for(size_t i = 0; i < 2*env->count; i++)
+            drsh_at_gc_forward(&gc, &atoms[i]);
+        drsh_at_gc_forward(&gc, &env->home);
+        DrshEnvOverlay* overlays = (DrshEnvOverlay*)env->overlays.data;
+        for(size_t i = 0; i < env->overlays.count/sizeof *overlays; i++){
+            drsh_at_gc_forward(&gc, &overlays[i].key);
+            drsh_at_gc_forward(&gc, &overlays[i].value);
+        }
+        DrshPathCache* pc = &env->path_cache;
+        drsh_at_gc_forward(&gc, &pc->path);
+        drsh_at_gc_forward(&gc, &pc->pathext);
+        DrshPathCacheEntry* entries = (DrshPathCacheEntry*)pc->entries.data;
+        for(size_t i = 0; i < pc->entries.count/sizeof *entries; i++){
+            drsh_at_gc_forward(&gc, &entries[i].name);
+            drsh_at_gc_forward(&gc, &entries[i].path);
+        }
+    }
+    {
+        const DrshAtom** atoms = (const DrshAtom**)inp->hist_buffer.data;
+        size_t len = inp->hist_buffer.count/sizeof *atoms;
+        for(size_t i = 0; i < len; i++)
+            drsh_at_gc_forward(&gc, &atoms[i]);
+    }
+    {
+        DrshWord* words = (DrshWord*)inp->tab_completions.data;
+        size_t len = inp->tab_completions.count/sizeof *words;
+        for(size_t i = 0; i < len; i++)
+            drsh_at_gc_forward(&gc, &words[i].a);
+    }
+    drsh_at_gc_end(&gc);
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_refresh_size(DrshTermState* ts, DrshEnvironment* env){
+    if(!ts->out_is_terminal) return EC_OK;
+    {
+    #ifdef _WIN32
+        CONSOLE_SCREEN_BUFFER_INFO csbi;
+        BOOL success = GetConsoleScreenBufferInfo(ts->out_fd, &csbi);
+        if(!success) return EC_IO_ERROR;
+        env->cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+        env->lines = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+    #else
+        struct winsize w;
+        int e = ioctl(ts->out_fd, TIOCGWINSZ, &w);
+        if(e == -1) return EC_IO_ERROR;
+        env->lines = w.ws_row;
+        env->cols = w.ws_col;
+    #endif
+    }
+    DrshEC err;
+    char buff[16];
+    int n;
+    const DrshAtom* value;
+    n = snprintf(buff, sizeof buff, "%d", env->lines);
+    err = drsh_at_atomize(env->at, buff, n, &value);
+    if(err) return err;
+    err = drsh_env_set_local(env, env->at->special[ATOM_LINES], value);
+    if(err) return err;
+    n = snprintf(buff, sizeof buff, "%d", env->cols);
+    err = drsh_at_atomize(env->at, buff, n, &value);
+    if(err) return err;
+    err = drsh_env_set_local(env, env->at->special[ATOM_COLUMNS], value);
+    if(err) return err;
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+DrshEC
+drsh_ts_printf(DrshTermState*restrict ts, const char*restrict fmt, ...){
+    va_list va;
+    va_start(va, fmt);
+    DrshEC err = drsh_ts_vprintf(ts, fmt, va);
+    va_end(va);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_ts_vprintf(DrshTermState*restrict ts, const char*restrict fmt, va_list va){
+    DrshGrowBuffer* b = &ts->tmp;
+    drsh_gb_clear(b);
+    DrshEC err = drsh_gb_vsprintf(b, fmt, va);
+    if(err) return err;
+    DrshReadBuffer rb = drsh_gb_readable_buffer(b);
+    return drsh_ts_write(ts, rb.ptr, rb.length);
+}
+
+DRSH_INTERNAL
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+DRSH_WARN_UNUSED
+DrshEC
+drsh_gb_sprintf(DrshGrowBuffer* gb, const char* fmt, ...){
+    va_list va;
+    va_start(va, fmt);
+    DrshEC err = drsh_gb_vsprintf(gb, fmt, va);
+    va_end(va);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_gb_vsprintf(DrshGrowBuffer* b, const char* fmt, va_list va){
+    // Most output is a line or two, so try a small buffer first and grow
+    // to the exact size if it didn't fit.
+    for(size_t want = 256;;){
+        DrshEC err = drsh_gb_ensure(b, want);
+        if(err) return err;
+        DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
+        va_list va2;
+        va_copy(va2, va);
+        int n = vsnprintf(wb.ptr, wb.length, fmt, va2);
+        va_end(va2);
+        if(n < 0) return EC_ASSERTION_ERROR;
+        if((size_t)n < wb.length){
+            b->count += n;
+            return EC_OK;
+        }
+        want = (size_t)n+1;
+    }
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_get_history_path(DrshEnvironment* env, const DrshAtom** hist){
+    {
+        const DrshAtom* h = drsh_env_get_env(env, env->at->special[ATOM_DRSH_HISTORY]);
+        if(h){
+            *hist = h;
+            return EC_OK;
+        }
+    }
+    DrshEC err = EC_UNIMPLEMENTED_ERROR;
+    DrshGrowBuffer* b = &env->tmp;
+    drsh_gb_clear(b);
+    OsFlavor os_flavor = env->os_flavor;
+    if(os_flavor == OS_APPLE) {
+        const DrshAtom*_Nullable home = env->home;
+        if(!home || !home->len) return EC_NOT_FOUND;
+        err = drsh_gb_append_(b, home->txt, home->len);
+        if(err) return err;
+        err = drsh_gb_append_(b, "/Library/Application Support", -1+sizeof "/Library/Application Support");
+        if(err) return err;
+    }
+    else if(os_flavor == OS_WINDOWS){
+        const DrshAtom*_Nullable localdata = drsh_env_get_env2(env, "LOCALAPPDATA", -1+sizeof "LOCALAPPDATA");
+        if(!localdata || !localdata->len) return EC_NOT_FOUND;
+        err = drsh_gb_append_(b, localdata->txt, localdata->len);
+        if(err) return err;
+    }
+    else { // linux or other
+        // use xdg
+        const DrshAtom*_Nullable xdg = drsh_env_get_env2(env, "XDG_STATE_HOME", -1+sizeof "XDG_STATE_HOME");
+        if(!xdg || !xdg->len) xdg = drsh_env_get_env2(env, "XDG_DATA_HOME", -1+sizeof "XDG_DATA_HOME");
+        if(xdg && xdg->len){
+            err = drsh_gb_append_(b, xdg->txt, xdg->len);
+            if(err) return err;
+        }
+        else{
+            const DrshAtom*_Nullable home = env->home;
+            if(!home || !home->len) return EC_NOT_FOUND;
+            err = drsh_gb_append_(b, home->txt, home->len);
+            if(err) return err;
+            err = drsh_gb_append_(b, "/.local/state", -1+sizeof "/.local/state");
+            if(err) return err;
+        }
+    }
+    err = drsh_gb_append_(b, "/drsh/drsh_history.txt", -1+sizeof "/drsh/drsh_history.txt");
+    DrshReadBuffer rb = drsh_gb_readable_buffer(b);
+    err = drsh_at_atomize(env->at, rb.ptr, rb.length, hist);
+    if(err) return err;
+    err = drsh_env_set_local(env, env->at->special[ATOM_DRSH_HISTORY], *hist);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_env_get_config_path(DrshEnvironment* env, DrshGrowBuffer*b){
+    DrshEC err = EC_UNIMPLEMENTED_ERROR;
+    drsh_gb_clear(b);
+    OsFlavor os_flavor = env->os_flavor;
+    if(os_flavor == OS_APPLE) {
+        const DrshAtom*_Nullable home = env->home;
+        if(!home || !home->len) return EC_NOT_FOUND;
+        err = drsh_gb_append_(b, home->txt, home->len);
+        if(err) return err;
+        err = drsh_gb_append_(b, "/Library/Application Support", -1+sizeof "/Library/Application Support");
+        if(err) return err;
+    }
+    else if(os_flavor == OS_WINDOWS){
+        const DrshAtom*_Nullable localdata = drsh_env_get_env2(env, "LOCALAPPDATA", -1+sizeof "LOCALAPPDATA");
+        if(!localdata || !localdata->len) return EC_NOT_FOUND;
+        err = drsh_gb_append_(b, localdata->txt, localdata->len);
+        if(err) return err;
+    }
+    else { // linux or other
+        // use xdg
+        const DrshAtom*_Nullable xdg_config = drsh_env_get_env2(env, "XDG_CONFIG_HOME", -1+sizeof "XDG_CONFIG_HOME");
+        if(xdg_config && xdg_config->len){
+            err = drsh_gb_append_(b, xdg_config->txt, xdg_config->len);
+            if(err) return err;
+        }
+        else{
+            const DrshAtom*_Nullable home = env->home;
+            if(!home || !home->len) return EC_NOT_FOUND;
+            err = drsh_gb_append_(b, home->txt, home->len);
+            if(err) return err;
+            err = drsh_gb_append_(b, "/.config", -1+sizeof "/.config");
+            if(err) return err;
+        }
+    }
+    err = drsh_gb_append_(b, "/drsh/drsh_config.drsh", -1+sizeof "/drsh/drsh_config.drsh");
+    return err;
+}
+
+DRSH_INTERNAL
+DrshEC
+drsh_env_set_shell_path(DrshEnvironment* env){
+    DrshEC err = EC_UNIMPLEMENTED_ERROR;
+    DrshGrowBuffer* b = &env->tmp;
+    drsh_gb_clear(b);
+#ifdef _WIN32
+    err = drsh_gb_ensure(b, MAX_PATH);
+    if(err) return err;
+    DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
+    DWORD len = GetModuleFileNameA(NULL, wb.ptr, (DWORD)wb.length);
+    if(!len) return EC_NOT_FOUND;
+    b->count = len;
+#elif defined(__APPLE__)
+    err = drsh_gb_ensure(b, MAXPATHLEN);
+    if(err) return err;
+    DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
+    uint32_t bufsize = (uint32_t)wb.length;
+    int e = _NSGetExecutablePath(wb.ptr, &bufsize);
+    if(e < 0){
+        err = drsh_gb_ensure(b, bufsize);
+        if(err) return err;
+        wb = drsh_gb_writable_buffer(b);
+        bufsize = (uint32_t)wb.length;
+        e = _NSGetExecutablePath(wb.ptr, &bufsize);
+        if(e < 0) return EC_NOT_FOUND;
+    }
+    b->count = strlen(wb.ptr);
+#elif defined(__linux__)
+    err = drsh_gb_ensure(b, MAXPATHLEN);
+    if(err) return err;
+    DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
+    ssize_t ret = readlink("/proc/self/exe", wb.ptr, wb.length);
+    if(ret < 0) return EC_NOT_FOUND;
+    b->count = (size_t)ret;
+#else
+    return EC_UNIMPLEMENTED_ERROR;
+#endif
+    DrshReadBuffer rb = drsh_gb_readable_buffer(b);
+    err = drsh_env_set_env3(env, env->at->special[ATOM_SHELL], rb.ptr, rb.length);
+    return err;
+}
+
+DRSH_INTERNAL
+DrshEC
+drsh_env_increment_shlvl(DrshEnvironment* env){
+    const DrshAtom* lvl_ = drsh_env_get_env(env, env->at->special[ATOM_SHLVL]);
+    int lvl = 0;
+    if(lvl_) lvl = atoi(lvl_->txt);
+    lvl++;
+    drsh_gb_clear(&env->tmp);
+    DrshEC err = drsh_gb_sprintf(&env->tmp, "%d", lvl);
+    if(err) return err;
+    DrshReadBuffer rb = drsh_gb_readable_buffer(&env->tmp);
+    err = drsh_env_set_env3(env, env->at->special[ATOM_SHLVL], rb.ptr, rb.length);
+    return err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_process_line(const DrshReadBuffer *input_line, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp){
+    if(input_line->length == 1){
+        char c = ((const char*)input_line->ptr)[0];
+        if(c == '\r' || c == '\n')
+            return EC_OK;
+    }
+    DrshEC err;
+    err = drsh_tokenize_line(input_line, tokens);
+    if(err) return EC_OK;
+    DrshReadBuffer toks = drsh_gb_readable_buffer(&tokens->token_buffer);
+    DrshArenaMark mark = drsh_arena_mark(&tokens->argv_arena);
+    DrshArgv targv;
+    size_t nassign = drsh_tokens_assignments(toks);
+    err = drsh_tokens_to_argv(toks, nassign, env, &tokens->argv_arena, tok_argv, &targv);
+    if(!err)
+        err = drsh_execute(&targv, nassign, env, at, tokens, tok_argv, ts, tmp);
+    else
+        err = EC_OK;
+    drsh_arena_release(&tokens->argv_arena, mark);
+    return err;
+}
+
+typedef struct DrshExecCtx DrshExecCtx;
+struct DrshExecCtx {
+    DrshEnvironment* env;
+    DrshAtomTable* at;
+    DrshTokenized* tokens;
+    DrshGrowBuffer* tok_argv;
+    DrshTermState* ts;
+    DrshGrowBuffer* tmp;
+};
+
+typedef DrshEC DrshBuiltinFunc(DrshExecCtx* ctx, const DrshArgv* argv);
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_cd(DrshExecCtx* ctx, const DrshArgv* argv){
+    DrshEC err = drsh_chdir(ctx->env, argv);
+    (void)err;
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_echo(DrshExecCtx* ctx, const DrshArgv* argv){
+    for(size_t i = 1; i < argv->length; i++){
+        const char* p = argv->ptr[i];
+        if(p) {
+            drsh_ts_printf(ctx->ts, "%s ", p);
+        }
+    }
+    drsh_ts_write(ctx->ts, "\r\n", 2);
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_exit(DrshExecCtx* ctx, const DrshArgv* argv){
+    (void)ctx;
+    (void)argv;
+    return EC_EXIT;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_pwd(DrshExecCtx* ctx, const DrshArgv* argv){
+    (void)argv;
+    const DrshAtom* PWD = drsh_env_get_env(ctx->env, ctx->at->special[ATOM_pwd]);
+    if(PWD) {
+        drsh_ts_printf(ctx->ts, "%s\r\n", PWD->txt);
+    }
+    return EC_OK;
+}
+
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_print_vars(DrshExecCtx* ctx, DrshEnvWhich which){
+    DrshEC err = drsh_env_merged_pairs(ctx->env, ctx->tmp, which);
+    if(err) return err;
+    const DrshAtom*const* atoms = (const DrshAtom*const*)ctx->tmp->data;
+    size_t len = ctx->tmp->count/(2*sizeof *atoms);
+    for(size_t i = 0; i < len; i++){
+        const DrshAtom* key = atoms[i*2];
+        const DrshAtom* value = atoms[i*2+1];
+        if(IS_WINDOWS)
+        {
+            const DrshAtom* ikey;
+            err = drsh_at_iatom(ctx->at, key, &ikey);
+            if(err) return err;
+            drsh_ts_printf(ctx->ts, "%s (%s)=%s\r\n", key->txt, ikey->txt, value->txt);
+        }
+        else
+            drsh_ts_printf(ctx->ts, "%s=%s\r\n", key->txt, value->txt);
+    }
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_set(DrshExecCtx* ctx, const DrshArgv* argv){
+    DrshEnvironment* env = ctx->env;
+    DrshEC err;
+    if(argv->length == 2){
+        err = drsh_print_vars(ctx, DRSH_ENV_ALL);
+        if(err) return err;
+    }
+    if(argv->length != 4) return EC_OK;
+    if(!argv->lens[1]) return EC_OK;
+    const DrshAtom* key;
+    err = drsh_at_atomize(ctx->at, argv->ptr[1], argv->lens[1], &key);
+    if(err) return EC_OK;
+    const DrshAtom* value;
+    err = drsh_at_atomize(ctx->at, argv->ptr[2], argv->lens[2], &value);
+    if(err) return EC_OK;
+    err = drsh_env_set_env(env, key, value);
+    if(err) return EC_OK;
+    return EC_OK;
+}
+
+//
+// export and local: with no arguments, lists the exported (or local)
+// variables. Otherwise marks each NAME or NAME=value as such, setting it
+// first if given a value.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_export_or_local(DrshExecCtx* ctx, const DrshArgv* argv, _Bool exported){
+    DrshEnvironment* env = ctx->env;
+    DrshEC err;
+    if(argv->length == 2)
+        return drsh_print_vars(ctx, exported? DRSH_ENV_EXPORTED : DRSH_ENV_UNEXPORTED);
+    for(size_t i = 1; i < argv->length-1; i++){
+        size_t klen = drsh_assignment_name_len(argv->ptr[i], argv->lens[i]);
+        if(!klen) klen = argv->lens[i];
+        if(!klen) continue;
+        const DrshAtom* key;
+        err = drsh_at_atomize(ctx->at, argv->ptr[i], klen, &key);
+        if(err) return EC_OK;
+        if(klen != argv->lens[i]){
+            const DrshAtom* value;
+            err = drsh_at_atomize(ctx->at, argv->ptr[i]+klen+1, argv->lens[i]-klen-1, &value);
+            if(err) return EC_OK;
+            err = drsh_env_set_env(env, key, value);
+            if(err) return EC_OK;
+        }
+        err = drsh_env_set_exported(env, key, exported);
+        if(err == EC_NOT_FOUND)
+            drsh_ts_printf(ctx->ts, "%s: not set\r\n", key->txt);
+        else if(err == EC_VALUE_ERROR)
+            drsh_ts_printf(ctx->ts, "%s: only set for this command, so it stays exported\r\n", key->txt);
+    }
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_export(DrshExecCtx* ctx, const DrshArgv* argv){
+    return drsh_export_or_local(ctx, argv, 1);
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_local(DrshExecCtx* ctx, const DrshArgv* argv){
+    return drsh_export_or_local(ctx, argv, 0);
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_unset(DrshExecCtx* ctx, const DrshArgv* argv){
+    for(size_t i = 1; i < argv->length-1; i++){
+        DrshEC err = drsh_env_unset(ctx->env, argv->ptr[i], argv->lens[i]);
+        (void)err;
+    }
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_debug(DrshExecCtx* ctx, const DrshArgv* argv){
+    DrshAtomTable* at = ctx->at;
+    if(argv->length > 2){
+        const DrshAtom* val = drsh_at_lookup(at, argv->ptr[1], argv->lens[1]);
+        if(val == at->special[ATOM_on] || val == at->special[ATOM_true] || val == at->special[ATOM_1]){
+            ctx->env->debug = 1;
+        }
+        else if(val == at->special[ATOM_off] || val == at->special[ATOM_false] || val == at->special[ATOM_0]){
+            ctx->env->debug = 0;
+        }
+    }
+    else
+        drsh_ts_printf(ctx->ts, "debug = %s\r\n", ctx->env->debug?"true":"false");
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_source(DrshExecCtx* ctx, const DrshArgv* argv){
+    if(argv->length > 2)
+        return drsh_source_file(argv->ptr[1], ctx->env, ctx->at, ctx->tokens, ctx->tok_argv, ctx->ts, ctx->tmp);
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_stats(DrshExecCtx* ctx, const DrshArgv* argv){
+    (void)argv;
+    DrshAtomTable* at = ctx->at;
+    DrshTermState* ts = ctx->ts;
+    size_t count = 0, bytes = 0, chunks = 0, unfolded = 0;
+    for(size_t i = 0; i < DRSH_AT_SHARDS; i++){
+        const DrshAtomShard* sh = &at->shards[i];
+        count += sh->count;
+        bytes += sh->arena.used;
+        chunks += sh->arena.nchunks;
+        for(size_t j = 0; j < sh->count; j++){
+            const DrshAtom* a = sh->slots->atoms[j];
+            size_t id = drsh_atom_special_id(a);
+            unfolded += !(id == ATOM_MAX? a->iatom : at->special_iatom[id]);
+        }
+    }
+    drsh_ts_printf(ts, "atoms: %zu (%zu bytes in %zu chunks, %d shards)\r\n", count, bytes, chunks, (int)DRSH_AT_SHARDS);
+    drsh_ts_printf(ts, "gc runs: %zu, next at %zu atoms\r\n", at->gc_runs, at->gc_threshold);
+    drsh_ts_printf(ts, "gc last reclaimed: %zu atoms, %zu bytes\r\n", at->gc_last_atoms, at->gc_last_bytes);
+    drsh_ts_printf(ts, "gc total reclaimed: %zu atoms, %zu bytes\r\n", at->gc_total_atoms, at->gc_total_bytes);
+    drsh_ts_printf(ts, "case folds: %zu computed (%zu twins), %zu atoms never folded\r\n", at->folds, at->fold_twins, unfolded);
+    drsh_ts_printf(ts, "buffers: %zu reallocs (%zu bytes grown), %zu trims (%zu bytes returned)\r\n", drsh_gb_stats.reallocs, drsh_gb_stats.grown_bytes, drsh_gb_stats.trims, drsh_gb_stats.trimmed_bytes);
+    if(at->frozen.base)
+        drsh_ts_printf(ts, "snapshot: %u atoms, %u history entries (%zu bytes mapped)\r\n", (unsigned)at->frozen.header->count, (unsigned)at->frozen.header->hist_count, at->frozen.size);
+    const DrshPathCache* pc = &ctx->env->path_cache;
+    drsh_ts_printf(ts, "path cache: %zu lookups, %zu hits, %zu flushes\r\n", pc->lookups, pc->hits, pc->flushes);
+    drsh_ts_printf(ts, "path index: %zu names in %zu directories, %zu directory reads, %zu taken from DRSH_PATH_INDEX\r\n", pc->names.count/sizeof(DrshPathName), pc->dirs.count/sizeof(DrshPathDir), pc->scans, pc->shared_loads);
+    drsh_ts_printf(ts, "path directory stats: %zu, %zu io_uring batches, %zu threaded batches\r\n", pc->dir_stats, pc->stat_batches, pc->thread_batches);
+    return EC_OK;
+}
+
+//
+// hash: lists where commands were found, with how often each was looked
+// up since, and the cache's hit rate.
+// hash -r: forgets them all.
+// hash NAME ...: looks them up, so they are cached.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_hash(DrshExecCtx* ctx, const DrshArgv* argv){
+    DrshPathCache* pc = &ctx->env->path_cache;
+    if(argv->length == 3 && argv->lens[1] == 2 && memcmp(argv->ptr[1], "-r", 2) == 0){
+        drsh_path_cache_clear(pc);
+        // Read the directories again too.
+        pc->path = NULL;
+        return EC_OK;
+    }
+    if(argv->length > 2){
+        for(size_t i = 1; i < argv->length-1; i++){
+            drsh_gb_clear(ctx->tmp);
+            DrshEC err = drsh_env_resolve_prog_path(ctx->env, ctx->tmp, (DrshStringView){.length=argv->lens[i], .txt=argv->ptr[i]}, IS_WINDOWS);
+            if(err == EC_NOT_FOUND)
+                drsh_ts_printf(ctx->ts, "%s: not found\r\n", argv->ptr[i]);
+        }
+        return EC_OK;
+    }
+    const DrshPathCacheEntry* entries = (const DrshPathCacheEntry*)pc->entries.data;
+    size_t count = pc->entries.count/sizeof *entries;
+    drsh_ts_printf(ctx->ts, "hits\tcommand\r\n");
+    for(size_t i = 0; i < count; i++){
+        const DrshPathCacheEntry* e = &entries[i];
+        if(e->path)
+            drsh_ts_printf(ctx->ts, "%zu\t%s\r\n", e->hits, e->path->txt);
+        else
+            drsh_ts_printf(ctx->ts, "%zu\t%s (not found)\r\n", e->hits, e->name->txt);
+    }
+    drsh_ts_printf(ctx->ts, "%zu cached, %zu lookups, %zu hits (%.1f%%), %zu flushes\r\n", count, pc->lookups, pc->hits, pc->lookups? 100.*(double)pc->hits/(double)pc->lookups : 0., pc->flushes);
+    return EC_OK;
+}
+
+//
+// Performance counters for `time --counters`.
+//
+// They are opened on the shell itself, disabled, with inherit and
+// enable_on_exec. The command (and whatever it runs) inherits them when
+// it is spawned, and they start counting when it execs, so none of the
+// shell's own work is counted. The counts of the children are added to
+// the shell's counters as they exit.
+//
+enum {
+    DRSH_COUNTER_TASK_CLOCK,
+    DRSH_COUNTER_CONTEXT_SWITCHES,
+    DRSH_COUNTER_CPU_MIGRATIONS,
+    DRSH_COUNTER_PAGE_FAULTS,
+    DRSH_COUNTER_CYCLES,
+    DRSH_COUNTER_INSTRUCTIONS,
+    DRSH_COUNTER_CACHE_MISSES,
+    DRSH_COUNTER_BRANCH_MISSES,
+    DRSH_COUNTERS,
+};
+
+typedef struct DrshCounterDef DrshCounterDef;
+struct DrshCounterDef {
+    const char* name;
+    const char* key; // in `time --json`
+    _Bool hardware;
+    unsigned config; // PERF_COUNT_SW_* or PERF_COUNT_HW_*
+};
+
+#ifdef DRSH_PERF_EVENTS
+#define DRSH_COUNTER(config) config
+#else
+#define DRSH_COUNTER(config) 0
+#endif
+
+static const DrshCounterDef drsh_counter_defs[DRSH_COUNTERS] = {
+    [DRSH_COUNTER_TASK_CLOCK]       = {"task-clock",       "task_clock_ns",    0, DRSH_COUNTER(PERF_COUNT_SW_TASK_CLOCK)},
+    [DRSH_COUNTER_CONTEXT_SWITCHES] = {"context-switches", "context_switches", 0, DRSH_COUNTER(PERF_COUNT_SW_CONTEXT_SWITCHES)},
+    [DRSH_COUNTER_CPU_MIGRATIONS]   = {"cpu-migrations",   "cpu_migrations",   0, DRSH_COUNTER(PERF_COUNT_SW_CPU_MIGRATIONS)},
+    [DRSH_COUNTER_PAGE_FAULTS]      = {"page-faults",      "page_faults",      0, DRSH_COUNTER(PERF_COUNT_SW_PAGE_FAULTS)},
+    [DRSH_COUNTER_CYCLES]           = {"cycles",           "cycles",           1, DRSH_COUNTER(PERF_COUNT_HW_CPU_CYCLES)},
+    [DRSH_COUNTER_INSTRUCTIONS]     = {"instructions",     "instructions",     1, DRSH_COUNTER(PERF_COUNT_HW_INSTRUCTIONS)},
+    [DRSH_COUNTER_CACHE_MISSES]     = {"cache-misses",     "cache_misses",     1, DRSH_COUNTER(PERF_COUNT_HW_CACHE_MISSES)},
+    [DRSH_COUNTER_BRANCH_MISSES]    = {"branch-misses",    "branch_misses",    1, DRSH_COUNTER(PERF_COUNT_HW_BRANCH_MISSES)},
+};
+#undef DRSH_COUNTER
+
+typedef struct DrshCounters DrshCounters;
+struct DrshCounters {
+    int fds[DRSH_COUNTERS]; // -1 if it isn't open
+    _Bool supported[DRSH_COUNTERS]; // it could be opened
+    _Bool counted[DRSH_COUNTERS]; // values[i] is valid
+    _Bool scaled[DRSH_COUNTERS]; // it was multiplexed, values[i] is an estimate
+    uint64_t values[DRSH_COUNTERS];
+    _Bool user_only; // the kernel only allowed counting user space
+};
+
+//
+// Opens whichever counters the kernel allows. Hardware counters are
+// often unavailable (in VMs) or restricted by perf_event_paranoid, which
+// just leaves the software ones.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_counters_open(DrshCounters* c){
+    *c = (DrshCounters){0};
+    for(int i = 0; i < DRSH_COUNTERS; i++)
+        c->fds[i] = -1;
+#ifndef DRSH_PERF_EVENTS
+    return EC_UNIMPLEMENTED_ERROR;
+#else
+    size_t opened = 0;
+    for(int i = 0; i < DRSH_COUNTERS; i++){
+        struct perf_event_attr attr = {
+            .size = sizeof attr,
+            .type = drsh_counter_defs[i].hardware? PERF_TYPE_HARDWARE : PERF_TYPE_SOFTWARE,
+            .config = drsh_counter_defs[i].config,
+            .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING,
+            .disabled = 1,
+            .inherit = 1,
+            .enable_on_exec = 1,
+            .exclude_kernel = c->user_only,
+            .exclude_hv = c->user_only,
+        };
+        long fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if(fd < 0 && (errno == EACCES || errno == EPERM) && !c->user_only){
+            // Not allowed to count the kernel, so count just user space
+            // from here on, so the counts are comparable.
+            c->user_only = 1;
+            for(int j = 0; j < i; j++){
+                if(c->fds[j] >= 0) close(c->fds[j]);
+                c->fds[j] = -1;
+                c->supported[j] = 0;
+            }
+            opened = 0;
+            i = -1;
+            continue;
+        }
+        if(fd < 0) continue;
+        c->fds[i] = (int)fd;
+        c->supported[i] = 1;
+        opened++;
+    }
+    return opened? EC_OK : EC_IO_ERROR;
+#endif
+}
+
+// Reads the counters and closes them.
+DRSH_INTERNAL
+void
+drsh_counters_close(DrshCounters* c){
+#ifdef DRSH_PERF_EVENTS
+    for(int i = 0; i < DRSH_COUNTERS; i++){
+        if(c->fds[i] < 0) continue;
+        uint64_t v[3]; // value, time enabled, time running
+        if(read(c->fds[i], v, sizeof v) == (ssize_t)sizeof v && v[2]){
+            c->counted[i] = 1;
+            c->values[i] = v[0];
+            if(v[2] < v[1]){
+                c->scaled[i] = 1;
+                c->values[i] = (uint64_t)((double)v[0] * (double)v[1] / (double)v[2]);
+            }
+        }
+        close(c->fds[i]);
+        c->fds[i] = -1;
+    }
+#else
+    (void)c;
+#endif
+}
+
+DRSH_INTERNAL
+void
+drsh_print_counters(DrshTermState* ts, const DrshCounters* c){
+    drsh_ts_printf(ts, "counters%s:\r\n", c->user_only? " (user space only)" : "");
+    for(int i = 0; i < DRSH_COUNTERS; i++){
+        drsh_ts_printf(ts, "  %-17s", drsh_counter_defs[i].name);
+        if(!c->supported[i])
+            drsh_ts_printf(ts, "not supported");
+        else if(!c->counted[i])
+            drsh_ts_printf(ts, "not counted");
+        else if(i == DRSH_COUNTER_TASK_CLOCK)
+            drsh_ts_printf(ts, "%.3f ms", (double)c->values[i]/1e6);
+        else
+            drsh_ts_printf(ts, "%llu", (unsigned long long)c->values[i]);
+        if(i == DRSH_COUNTER_INSTRUCTIONS && c->counted[i] && c->counted[DRSH_COUNTER_CYCLES] && c->values[DRSH_COUNTER_CYCLES])
+            drsh_ts_printf(ts, " (%.2f per cycle)", (double)c->values[i]/(double)c->values[DRSH_COUNTER_CYCLES]);
+        if(c->scaled[i])
+            drsh_ts_printf(ts, " (estimated, multiplexed)");
+        drsh_ts_printf(ts, "\r\n");
+    }
+}
+
+// Appends txt as a quoted json string.
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_gb_append_json_string(DrshGrowBuffer* b, const char* txt, size_t len){
+    DrshEC err = drsh_gb_append_(b, "\"", 1);
+    for(size_t i = 0; !err && i < len; i++){
+        unsigned char c = (unsigned char)txt[i];
+        if(c == '"' || c == '\\'){
+            char esc[2] = {'\\', (char)c};
+            err = drsh_gb_append_(b, esc, 2);
+        }
+        else if(c < 0x20)
+            err = drsh_gb_sprintf(b, "\\u%04x", c);
+        else
+            err = drsh_gb_append_(b, &txt[i], 1);
+    }
+    if(!err) err = drsh_gb_append_(b, "\"", 1);
+    return err;
+}
+
+// Appends the command and what it cost (and counted) as a json object.
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_proc_stats_json(DrshGrowBuffer* b, const DrshArgv* argv, const DrshProcStats* st, const DrshCounters*_Nullable counters){
+    DrshEC err = drsh_gb_append_(b, "{\"command\":[", -1+sizeof "{\"command\":[");
+    for(size_t i = 0; !err && i < argv->length-1; i++){
+        if(i) err = drsh_gb_append_(b, ",", 1);
+        if(!err) err = drsh_gb_append_json_string(b, argv->ptr[i], argv->lens[i]);
+    }
+    if(err) return err;
+    err = drsh_gb_sprintf(b, "],\"exit_code\":%d,\"wall_ns\":%llu,\"user_us\":%llu,\"system_us\":%llu,\"max_rss\":%llu,"
+            "\"minor_faults\":%llu,\"major_faults\":%llu,\"voluntary_switches\":%llu,\"involuntary_switches\":%llu,"
+            "\"blocks_in\":%llu,\"blocks_out\":%llu,\"max_rss_floored\":%s",
+            st->exit_code, (unsigned long long)st->wall_ns, (unsigned long long)st->user_us, (unsigned long long)st->system_us,
+            (unsigned long long)st->max_rss, (unsigned long long)st->minor_faults, (unsigned long long)st->major_faults,
+            (unsigned long long)st->voluntary_switches, (unsigned long long)st->involuntary_switches,
+            (unsigned long long)st->blocks_in, (unsigned long long)st->blocks_out, st->max_rss_floored? "true" : "false");
+    if(!err && st->have_io)
+        err = drsh_gb_sprintf(b, ",\"read_chars\":%llu,\"write_chars\":%llu,\"read_calls\":%llu,\"write_calls\":%llu",
+            (unsigned long long)st->read_chars, (unsigned long long)st->write_chars,
+            (unsigned long long)st->read_calls, (unsigned long long)st->write_calls);
+    if(!err && st->have_disk_io)
+        err = drsh_gb_sprintf(b, ",\"read_bytes\":%llu,\"write_bytes\":%llu",
+            (unsigned long long)st->read_bytes, (unsigned long long)st->write_bytes);
+    if(!err && counters){
+        err = drsh_gb_sprintf(b, ",\"counters_user_only\":%s,\"counters\":{", counters->user_only? "true" : "false");
+        _Bool first = 1;
+        for(int i = 0; !err && i < DRSH_COUNTERS; i++){
+            if(!counters->counted[i]) continue;
+            err = drsh_gb_sprintf(b, "%s\"%s\":%llu", first? "" : ",", drsh_counter_defs[i].key, (unsigned long long)counters->values[i]);
+            first = 0;
+        }
+        if(!err) err = drsh_gb_append_(b, "}", 1);
+    }
+    if(!err) err = drsh_gb_append_(b, "}", 1);
+    return err;
+}
+
+DRSH_INTERNAL
+void
+drsh_print_proc_stats(DrshTermState* ts, const DrshProcStats* st){
+    drsh_ts_printf(ts, "wall   time: %.6fs\r\n", (double)st->wall_ns/1e9);
+    drsh_ts_printf(ts, "user   time: %.6fs\r\n", (double)st->user_us/1e6);
+    drsh_ts_printf(ts, "system time: %.6fs\r\n", (double)st->system_us/1e6);
+    drsh_ts_printf(ts, "max rss: %llu KiB", (unsigned long long)st->max_rss/1024);
+    if(st->max_rss_floored) drsh_ts_printf(ts, " (no more than the shell's own, so unreliable)");
+    drsh_ts_printf(ts, "\r\n");
+    drsh_ts_printf(ts, "page faults: %llu minor, %llu major\r\n", (unsigned long long)st->minor_faults, (unsigned long long)st->major_faults);
+    drsh_ts_printf(ts, "context switches: %llu voluntary, %llu involuntary\r\n", (unsigned long long)st->voluntary_switches, (unsigned long long)st->involuntary_switches);
+    drsh_ts_printf(ts, "blocks: %llu in, %llu out\r\n", (unsigned long long)st->blocks_in, (unsigned long long)st->blocks_out);
+    if(st->have_io){
+        drsh_ts_printf(ts, "read:  %llu bytes in %llu calls", (unsigned long long)st->read_chars, (unsigned long long)st->read_calls);
+        if(st->have_disk_io) drsh_ts_printf(ts, ", %llu from storage", (unsigned long long)st->read_bytes);
+        drsh_ts_printf(ts, "\r\nwrite: %llu bytes in %llu calls", (unsigned long long)st->write_chars, (unsigned long long)st->write_calls);
+        if(st->have_disk_io) drsh_ts_printf(ts, ", %llu to storage", (unsigned long long)st->write_bytes);
+        drsh_ts_printf(ts, "\r\n");
+    }
+    if(st->exit_code < 0)
+        drsh_ts_printf(ts, "killed by signal %d\r\n", -st->exit_code);
+    else
+        drsh_ts_printf(ts, "exit code: %d\r\n", st->exit_code);
+}
+
+//
+// time [--json] [--counters] COMMAND ...
+//
+// Runs the command and prints what it cost. With --counters, also what
+// the performance counters (linux only) counted while it ran. With
+// --json, it is printed as one json object on one line instead.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_time(DrshExecCtx* ctx, const DrshArgv* argv){
+    _Bool json = 0, counters = 0;
+    size_t first = 1;
+    for(; first < argv->length-1; first++){
+        if(strcmp(argv->ptr[first], "--json") == 0) json = 1;
+        else if(strcmp(argv->ptr[first], "--counters") == 0) counters = 1;
+        else break;
+    }
+    if(argv->length > first+1){
+        DrshArgv sub = {argv->length-first, argv->ptr+first, argv->lens+first};
+        DrshProcStats stats = {0};
+        DrshCounters c;
+        if(counters && drsh_counters_open(&c)){
+            drsh_ts_printf(ctx->ts, "time: unable to open performance counters\r\n");
+            counters = 0;
+        }
+        DrshEC err = drsh_spawn_process_and_wait(ctx->ts, ctx->env, ctx->tmp, &sub, &stats, 0);
+        if(counters) drsh_counters_close(&c);
+        if(err){
+            drsh_ts_printf(ctx->ts, "error\r\n");
+            return EC_OK;
+        }
+        if(!json){
+            drsh_print_proc_stats(ctx->ts, &stats);
+            if(counters) drsh_print_counters(ctx->ts, &c);
+            return EC_OK;
+        }
+        drsh_gb_clear(ctx->tmp);
+        err = drsh_proc_stats_json(ctx->tmp, &sub, &stats, counters? &c : NULL);
+        if(!err) err = drsh_gb_append_(ctx->tmp, "\r\n", 2);
+        if(err) return err;
+        drsh_ts_write(ctx->ts, ctx->tmp->data, ctx->tmp->count);
+    }
+    return EC_OK;
+}
+
+enum {
+    DRSH_BENCH_WALL,
+    DRSH_BENCH_USER,
+    DRSH_BENCH_SYSTEM,
+    DRSH_BENCH_RSS,
+    DRSH_BENCH_METRICS,
+};
+
+static const char* const drsh_bench_metric_names[DRSH_BENCH_METRICS] = {
+    [DRSH_BENCH_WALL]   = "wall",
+    [DRSH_BENCH_USER]   = "user",
+    [DRSH_BENCH_SYSTEM] = "system",
+    [DRSH_BENCH_RSS]    = "max rss",
+};
+
+// Named like the fields `time --json` prints.
+static const char* const drsh_bench_metric_keys[DRSH_BENCH_METRICS] = {
+    [DRSH_BENCH_WALL]   = "wall_ns",
+    [DRSH_BENCH_USER]   = "user_us",
+    [DRSH_BENCH_SYSTEM] = "system_us",
+    [DRSH_BENCH_RSS]    = "max_rss",
+};
+
+DRSH_INTERNAL
+double
+drsh_bench_metric(const DrshProcStats* st, int metric){
+    switch(metric){
+        case DRSH_BENCH_WALL:   return (double)st->wall_ns;
+        case DRSH_BENCH_USER:   return (double)st->user_us;
+        case DRSH_BENCH_SYSTEM: return (double)st->system_us;
+        default:                return (double)st->max_rss;
     }
-    err = drsh_gb_append_(b, "/drsh/drsh_history.txt", -1+sizeof "/drsh/drsh_history.txt");
-    DrshReadBuffer rb = drsh_gb_readable_buffer(b);
-    err = drsh_at_atomize(env->at, rb.ptr, rb.length, hist);
-    if(err) return err;
-    err = drsh_env_set_env(env, env->at->special[ATOM_DRSH_HISTORY], *hist);
-    return err;
 }
 
+typedef struct DrshBenchSummary DrshBenchSummary;
+struct DrshBenchSummary {
+    double mean, stddev, median, min, max;
+    // Outside of 1.5 interquartile ranges from the quartiles.
+    size_t outliers;
+};
+
+// The build is just `cc drsh.c`, which doesn't link libm.
 DRSH_INTERNAL
-DRSH_WARN_UNUSED
-DrshEC
-drsh_env_get_config_path(DrshEnvironment* env, DrshGrowBuffer*b){
-    DrshEC err = EC_UNIMPLEMENTED_ERROR;
-    drsh_gb_clear(b);
-    OsFlavor os_flavor = env->os_flavor;
-    if(os_flavor == OS_APPLE) {
-        const DrshAtom*_Nullable home = env->home;
-        if(!home || !home->len) return EC_NOT_FOUND;
-        err = drsh_gb_append_(b, home->txt, home->len);
-        if(err) return err;
-        err = drsh_gb_append_(b, "/Library/Application Support", -1+sizeof "/Library/Application Support");
-        if(err) return err;
-    }
-    else if(os_flavor == OS_WINDOWS){
-        const DrshAtom*_Nullable localdata = drsh_env_get_env2(env, "LOCALAPPDATA", -1+sizeof "LOCALAPPDATA");
-        if(!localdata || !localdata->len) return EC_NOT_FOUND;
-        err = drsh_gb_append_(b, localdata->txt, localdata->len);
-        if(err) return err;
+double
+drsh_sqrt(double x){
+    if(!(x > 0)) return 0;
+    // Newton's method from above only goes down until it converges.
+    double r = x > 1? x : 1;
+    for(;;){
+        double next = (r + x/r) / 2;
+        if(next >= r) return r;
+        r = next;
     }
-    else { // linux or other
-        // use xdg
-        const DrshAtom*_Nullable xdg_config = drsh_env_get_env2(env, "XDG_CONFIG_HOME", -1+sizeof "XDG_CONFIG_HOME");
-        if(xdg_config && xdg_config->len){
-            err = drsh_gb_append_(b, xdg_config->txt, xdg_config->len);
-            if(err) return err;
-        }
-        else{
-            const DrshAtom*_Nullable home = env->home;
-            if(!home || !home->len) return EC_NOT_FOUND;
-            err = drsh_gb_append_(b, home->txt, home->len);
-            if(err) return err;
-            err = drsh_gb_append_(b, "/.config", -1+sizeof "/.config");
-            if(err) return err;
-        }
+}
+
+DRSH_INTERNAL
+int
+drsh_cmp_double(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts values to summarize them.
+DRSH_INTERNAL
+DrshBenchSummary
+drsh_bench_summarize(double* values, size_t n){
+    DrshBenchSummary sum = {0};
+    if(!n) return sum;
+    qsort(values, n, sizeof *values, drsh_cmp_double);
+    double total = 0;
+    for(size_t i = 0; i < n; i++)
+        total += values[i];
+    sum.mean = total / (double)n;
+    double sq = 0;
+    for(size_t i = 0; i < n; i++)
+        sq += (values[i] - sum.mean) * (values[i] - sum.mean);
+    sum.stddev = n > 1? drsh_sqrt(sq / (double)(n-1)) : 0;
+    sum.median = n & 1? values[n/2] : (values[n/2-1] + values[n/2]) / 2;
+    sum.min = values[0];
+    sum.max = values[n-1];
+    double q1 = values[n/4], q3 = values[(3*n)/4];
+    double iqr = q3 - q1;
+    for(size_t i = 0; i < n; i++)
+        sum.outliers += values[i] < q1 - 1.5*iqr || values[i] > q3 + 1.5*iqr;
+    return sum;
+}
+
+// Prints v (in the unit of the metric) in a unit that suits it.
+DRSH_INTERNAL
+void
+drsh_bench_print_value(DrshTermState* ts, int metric, double v){
+    if(metric == DRSH_BENCH_RSS){
+        drsh_ts_printf(ts, "%8.1f KiB", v / 1024);
+        return;
     }
-    err = drsh_gb_append_(b, "/drsh/drsh_config.drsh", -1+sizeof "/drsh/drsh_config.drsh");
-    return err;
+    double us = metric == DRSH_BENCH_WALL? v / 1000 : v;
+    if(us >= 1e6) drsh_ts_printf(ts, "%8.3f s  ", us / 1e6);
+    else if(us >= 1e3) drsh_ts_printf(ts, "%8.3f ms ", us / 1e3);
+    else drsh_ts_printf(ts, "%8.1f µs ", us);
 }
 
+//
+// Expands a command given as one argument to bench, like it was a line
+// of its own. The argv is allocated out of the tokens' arena, so it
+// lasts until the line running bench is done. Its first out_nassign
+// arguments are assignments, see drsh_bench_spawn.
+//
 DRSH_INTERNAL
+DRSH_WARN_UNUSED
 DrshEC
-drsh_env_set_shell_path(DrshEnvironment* env){
-    DrshEC err = EC_UNIMPLEMENTED_ERROR;
-    DrshGrowBuffer* b = &env->tmp;
-    drsh_gb_clear(b);
-#ifdef _WIN32
-    err = drsh_gb_ensure(b, MAX_PATH);
+drsh_bench_argv(DrshExecCtx* ctx, const char* txt, size_t len, DrshArgv* out, size_t* out_nassign){
+    DrshReadBuffer line = {len, txt};
+    DrshEC err = drsh_tokenize_line(&line, ctx->tokens);
     if(err) return err;
-    DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
-    DWORD len = GetModuleFileNameA(NULL, wb.ptr, (DWORD)wb.length);
-    if(!len) return EC_NOT_FOUND;
-    b->count = len;
-#elif defined(__APPLE__)
-    err = drsh_gb_ensure(b, MAXPATHLEN);
+    DrshReadBuffer toks = drsh_gb_readable_buffer(&ctx->tokens->token_buffer);
+    size_t nassign = drsh_tokens_assignments(toks);
+    err = drsh_tokens_to_argv(toks, nassign, ctx->env, &ctx->tokens->argv_arena, ctx->tok_argv, out);
     if(err) return err;
-    DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
-    uint32_t bufsize = (uint32_t)wb.length;
-    int e = _NSGetExecutablePath(wb.ptr, &bufsize);
-    if(e < 0){
-        err = drsh_gb_ensure(b, bufsize);
-        if(err) return err;
-        wb = drsh_gb_writable_buffer(b);
-        bufsize = (uint32_t)wb.length;
-        e = _NSGetExecutablePath(wb.ptr, &bufsize);
-        if(e < 0) return EC_NOT_FOUND;
+    // Only assignments, nothing to run.
+    if(out->length < nassign + 2) return EC_VALUE_ERROR;
+    *out_nassign = nassign;
+    return EC_OK;
+}
+
+//
+// Runs a command from drsh_bench_argv and waits for it, with its
+// assignments set for it alone like `FOO=x cmd`.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_bench_spawn(DrshExecCtx* ctx, const DrshArgv* argv, size_t nassign, DrshProcStats* st, unsigned flags){
+    DrshEnvironment* env = ctx->env;
+    DrshArgv rest = {
+        .length = argv->length - nassign,
+        .ptr = argv->ptr + nassign,
+        .lens = argv->lens + nassign,
+    };
+    size_t mark = drsh_env_push_layer(env);
+    DrshEC err = EC_OK;
+    for(size_t i = 0; i < nassign; i++){
+        size_t klen = drsh_assignment_name_len(argv->ptr[i], argv->lens[i]);
+        const DrshAtom* key;
+        err = drsh_at_atomize(ctx->at, argv->ptr[i], klen, &key);
+        if(err) goto Lfinish;
+        const DrshAtom* value;
+        err = drsh_at_atomize(ctx->at, argv->ptr[i]+klen+1, argv->lens[i]-klen-1, &value);
+        if(err) goto Lfinish;
+        err = drsh_env_set_overlay(env, key, value);
+        if(err) goto Lfinish;
     }
-    b->count = strlen(wb.ptr);
-#elif defined(__linux__)
-    err = drsh_gb_ensure(b, MAXPATHLEN);
-    if(err) return err;
-    DrshWriteBuffer wb = drsh_gb_writable_buffer(b);
-    ssize_t ret = readlink("/proc/self/exe", wb.ptr, wb.length);
-    if(ret < 0) return EC_NOT_FOUND;
-    b->count = (size_t)ret;
-#else
-    return EC_UNIMPLEMENTED_ERROR;
-#endif
-    DrshReadBuffer rb = drsh_gb_readable_buffer(b);
-    err = drsh_env_set_env3(env, env->at->special[ATOM_SHELL], rb.ptr, rb.length);
+    err = drsh_spawn_process_and_wait(ctx->ts, env, ctx->tmp, &rest, st, flags);
+    Lfinish:
+    drsh_env_pop_layer(env, mark);
     return err;
 }
 
 DRSH_INTERNAL
+DRSH_WARN_UNUSED
 DrshEC
-drsh_env_increment_shlvl(DrshEnvironment* env){
-    const DrshAtom* lvl_ = drsh_env_get_env(env, env->at->special[ATOM_SHLVL]);
-    int lvl = 0;
-    if(lvl_) lvl = atoi(lvl_->txt);
-    lvl++;
-    drsh_gb_clear(&env->tmp);
-    DrshEC err = drsh_gb_sprintf(&env->tmp, "%d", lvl);
-    if(err) return err;
-    DrshReadBuffer rb = drsh_gb_readable_buffer(&env->tmp);
-    err = drsh_env_set_env3(env, env->at->special[ATOM_SHLVL], rb.ptr, rb.length);
+drsh_bench_csv(const char* path, const DrshArgv* argv, const size_t* cmds, size_t ncmds, size_t runs, const DrshBenchSummary* sums){
+    DrshGrowBuffer b = {0};
+    DrshEC err = drsh_gb_sprintf(&b, "command,metric,mean,stddev,median,min,max,outliers,runs\n");
+    for(size_t c = 0; !err && c < ncmds; c++){
+        for(int m = 0; !err && m < DRSH_BENCH_METRICS; m++){
+            const DrshBenchSummary* sum = &sums[c*DRSH_BENCH_METRICS+m];
+            // Quoted, with quotes doubled.
+            err = drsh_gb_append_(&b, "\"", 1);
+            const char* txt = argv->ptr[cmds[c]];
+            for(size_t i = 0; !err && i < argv->lens[cmds[c]]; i++)
+                err = txt[i] == '"'? drsh_gb_append_(&b, "\"\"", 2) : drsh_gb_append_(&b, &txt[i], 1);
+            if(!err) err = drsh_gb_sprintf(&b, "\",%s,%.17g,%.17g,%.17g,%.17g,%.17g,%zu,%zu\n",
+                drsh_bench_metric_keys[m], sum->mean, sum->stddev, sum->median, sum->min, sum->max, sum->outliers, runs);
+        }
+    }
+    if(!err) err = drsh_write_file_replacing(path, b.data, b.count, 0644);
+    free(b.data);
     return err;
 }
 
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_process_line(const DrshReadBuffer *input_line, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp){
-    if(input_line->length == 1){
-        char c = ((const char*)input_line->ptr)[0];
-        if(c == '\r' || c == '\n')
-            return EC_OK;
-    }
-    DrshEC err;
-    err = drsh_tokenize_line(input_line, tokens);
-    if(err) return EC_OK;
-    DrshReadBuffer toks = drsh_gb_readable_buffer(&tokens->token_buffer);
-    drsh_gb_clear(tok_argv);
-    err = drsh_tokens_to_argv(toks, env, at, tok_argv);
-    if(err) return EC_OK;
-    DrshArgv targv;
-    {
-        DrshReadBuffer targv_ = drsh_gb_readable_buffer(tok_argv);
-        targv.ptr = targv_.ptr;
-        targv.length = targv_.length/sizeof(const char*);
-    }
-    const DrshAtom* first = drsh_unsafe_string_to_atom(targv.ptr[0]);
-    if(first == at->special[ATOM_cd]){
-        err = drsh_chdir(env, &targv);
-        (void)err;
-        return EC_OK;
+drsh_bench_json(const char* path, const DrshArgv* argv, const size_t* cmds, size_t ncmds, size_t runs, const DrshBenchSummary* sums, const DrshProcStats* results){
+    DrshGrowBuffer b = {0};
+    DrshEC err = drsh_gb_sprintf(&b, "{\"runs\":%zu,\"results\":[", runs);
+    for(size_t c = 0; !err && c < ncmds; c++){
+        const DrshProcStats* res = &results[c*runs];
+        err = drsh_gb_append_(&b, c? ",{\"command\":" : "{\"command\":", c? 12 : 11);
+        if(!err) err = drsh_gb_append_json_string(&b, argv->ptr[cmds[c]], argv->lens[cmds[c]]);
+        if(!err) err = drsh_gb_sprintf(&b, ",\"exit_codes\":[");
+        for(size_t r = 0; !err && r < runs; r++)
+            err = drsh_gb_sprintf(&b, r? ",%d" : "%d", res[r].exit_code);
+        if(!err) err = drsh_gb_sprintf(&b, "],\"max_rss_floored\":[");
+        for(size_t r = 0; !err && r < runs; r++)
+            err = drsh_gb_sprintf(&b, r? ",%s" : "%s", res[r].max_rss_floored? "true" : "false");
+        if(!err) err = drsh_gb_append_(&b, "]", 1);
+        for(int m = 0; !err && m < DRSH_BENCH_METRICS; m++){
+            const DrshBenchSummary* sum = &sums[c*DRSH_BENCH_METRICS+m];
+            err = drsh_gb_sprintf(&b, ",\"%s\":{\"mean\":%.17g,\"stddev\":%.17g,\"median\":%.17g,\"min\":%.17g,\"max\":%.17g,\"outliers\":%zu,\"values\":[",
+                drsh_bench_metric_keys[m], sum->mean, sum->stddev, sum->median, sum->min, sum->max, sum->outliers);
+            for(size_t r = 0; !err && r < runs; r++)
+                err = drsh_gb_sprintf(&b, r? ",%.17g" : "%.17g", drsh_bench_metric(&res[r], m));
+            if(!err) err = drsh_gb_append_(&b, "]}", 2);
+        }
+        if(!err) err = drsh_gb_append_(&b, "}", 1);
     }
-    if(first == at->special[ATOM_echo]){
-        for(size_t i = 1; i < targv.length; i++){
-            const char* p = targv.ptr[i];
-            if(p) {
-                drsh_ts_printf(ts, "%s ", p);
-            }
+    if(!err) err = drsh_gb_append_(&b, "]}\n", 3);
+    if(!err) err = drsh_write_file_replacing(path, b.data, b.count, 0644);
+    free(b.data);
+    return err;
+}
+
+//
+// bench [-n RUNS] [-w WARMUP] [-p PREPARE] [--show-output]
+//       [--csv FILE] [--json FILE] COMMAND ...
+//
+// Runs each command (each one argument, expanded like a line of its own,
+// so it can start with assignments) RUNS times after WARMUP untimed runs,
+// running PREPARE before every run, and prints statistics of each and how
+// they compare. Output of the commands is discarded unless --show-output
+// is given.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_builtin_bench(DrshExecCtx* ctx, const DrshArgv* argv){
+    DrshTermState* ts = ctx->ts;
+    size_t runs = 10, warmup = 0;
+    const char*_Nullable prepare = NULL;
+    size_t prepare_len = 0;
+    const char*_Nullable csv = NULL;
+    const char*_Nullable json = NULL;
+    unsigned flags = DRSH_SPAWN_NULL_STDIO;
+    size_t nargs = argv->length-1;
+    size_t i = 1;
+    for(; i < nargs && argv->ptr[i][0] == '-'; i++){
+        const char* opt = argv->ptr[i];
+        if(strcmp(opt, "--show-output") == 0){
+            flags &= ~(unsigned)DRSH_SPAWN_NULL_STDIO;
+            continue;
         }
-        drsh_ts_write(ts, "\r\n", 2);
-        return EC_OK;
+        if(i+1 >= nargs) goto Lusage;
+        const char* val = argv->ptr[++i];
+        if(strcmp(opt, "-n") == 0 || strcmp(opt, "-w") == 0){
+            char* end;
+            unsigned long long n = strtoull(val, &end, 10);
+            if(*end || !*val || val[0] == '-' || n > 1000000) goto Lusage;
+            if(opt[1] == 'n') runs = (size_t)n;
+            else warmup = (size_t)n;
+        }
+        else if(strcmp(opt, "-p") == 0){
+            prepare = val;
+            prepare_len = argv->lens[i];
+        }
+        else if(strcmp(opt, "--csv") == 0) csv = val;
+        else if(strcmp(opt, "--json") == 0) json = val;
+        else goto Lusage;
     }
-    if(first == at->special[ATOM_exit]){
-        return EC_EXIT;
+    if(i >= nargs || !runs) goto Lusage;
+    size_t first = i;
+    size_t ncmds = nargs - first;
+    DrshEC err = EC_OK;
+    size_t* cmds = malloc(ncmds * sizeof *cmds);
+    DrshProcStats* results = calloc(ncmds * runs, sizeof *results);
+    DrshBenchSummary* sums = calloc(ncmds * DRSH_BENCH_METRICS, sizeof *sums);
+    double* values = malloc(runs * sizeof *values);
+    if(!cmds || !results || !sums || !values){
+        err = EC_OOM;
+        goto Lfinish;
     }
-    if(first == at->special[ATOM_pwd]){
-        const DrshAtom* PWD = drsh_env_get_env(env, at->special[ATOM_pwd]);
-        if(PWD) {
-            drsh_ts_printf(ts, "%s\r\n", PWD->txt);
+    DrshArgv prep = {0};
+    size_t prep_nassign = 0;
+    if(prepare){
+        err = drsh_bench_argv(ctx, prepare, prepare_len, &prep, &prep_nassign);
+        if(err){
+            drsh_ts_printf(ts, "bench: bad prepare command\r\n");
+            goto Lfinish;
         }
-        return EC_OK;
     }
-    if(first == at->special[ATOM_set]){
-        if(targv.length == 2){
-            drsh_env_sort_env(env);
-            const DrshAtom** atoms = env->data;
-            size_t len = env->count;
-            for(size_t i = 0; i < len; i++){
-                const DrshAtom* key = atoms[i*2];
-                const DrshAtom* value = atoms[i*2+1];
-                if(IS_WINDOWS)
-                    drsh_ts_printf(ts, "%s (%s)=%s\r\n", key->txt, key->iatom->txt, value->txt);
-                else
-                    drsh_ts_printf(ts, "%s=%s\r\n", key->txt, value->txt);
-            }
+    for(size_t c = 0; c < ncmds; c++){
+        cmds[c] = first + c;
+        DrshArgv cmd;
+        size_t nassign;
+        err = drsh_bench_argv(ctx, argv->ptr[cmds[c]], argv->lens[cmds[c]], &cmd, &nassign);
+        if(err){
+            drsh_ts_printf(ts, "bench: bad command '%s'\r\n", argv->ptr[cmds[c]]);
+            goto Lfinish;
         }
-        if(targv.length != 4) return EC_OK;
-        const DrshAtom* key = drsh_unsafe_string_to_atom(targv.ptr[1]);
-        const DrshAtom* value = drsh_unsafe_string_to_atom(targv.ptr[2]);
-        if(!key->len) return EC_OK;
-        err = drsh_env_set_env(env, key, value);
-        if(err) return EC_OK;
-        return EC_OK;
-    }
-    if(first == at->special[ATOM_debug]){
-        if(targv.length > 2){
-            const DrshAtom* val = drsh_unsafe_string_to_atom(targv.ptr[1]);
-            if(val == at->special[ATOM_on] || val == at->special[ATOM_true] || val == at->special[ATOM_1]){
-                env->debug = 1;
+        drsh_ts_printf(ts, "Benchmark %zu: %s\r\n", c+1, argv->ptr[cmds[c]]);
+        size_t failed = 0, prep_failed = 0;
+        for(size_t r = 0; r < warmup + runs; r++){
+            DrshProcStats st = {0};
+            if(prep.length){
+                err = drsh_bench_spawn(ctx, &prep, prep_nassign, &st, flags);
+                if(err) goto Lfinish;
+                if(r >= warmup) prep_failed += st.exit_code != 0;
             }
-            else if(val == at->special[ATOM_off] || val == at->special[ATOM_false] || val == at->special[ATOM_0]){
-                env->debug = 0;
+            st = (DrshProcStats){0};
+            err = drsh_bench_spawn(ctx, &cmd, nassign, &st, flags);
+            if(err) goto Lfinish;
+            if(r < warmup) continue;
+            results[c*runs + r-warmup] = st;
+            failed += st.exit_code != 0;
+        }
+        for(int m = 0; m < DRSH_BENCH_METRICS; m++){
+            for(size_t r = 0; r < runs; r++)
+                values[r] = drsh_bench_metric(&results[c*runs+r], m);
+            DrshBenchSummary* sum = &sums[c*DRSH_BENCH_METRICS+m];
+            *sum = drsh_bench_summarize(values, runs);
+            drsh_ts_printf(ts, "  %-8s", drsh_bench_metric_names[m]);
+            drsh_bench_print_value(ts, m, sum->mean);
+            drsh_ts_printf(ts, " ± ");
+            drsh_bench_print_value(ts, m, sum->stddev);
+            drsh_ts_printf(ts, " median");
+            drsh_bench_print_value(ts, m, sum->median);
+            drsh_ts_printf(ts, " range");
+            drsh_bench_print_value(ts, m, sum->min);
+            drsh_ts_printf(ts, " …");
+            drsh_bench_print_value(ts, m, sum->max);
+            if(sum->outliers)
+                drsh_ts_printf(ts, " (%zu outlier%s)", sum->outliers, sum->outliers == 1? "" : "s");
+            if(m == DRSH_BENCH_RSS){
+                size_t floored = 0;
+                for(size_t r = 0; r < runs; r++)
+                    floored += results[c*runs+r].max_rss_floored;
+                if(floored) drsh_ts_printf(ts, " (unreliable in %zu run%s, no more than the shell's own)", floored, floored == 1? "" : "s");
             }
+            drsh_ts_printf(ts, "\r\n");
         }
-        else
-            drsh_ts_printf(ts, "debug = %s\r\n", env->debug?"true":"false");
-        return EC_OK;
+        drsh_ts_printf(ts, "  %zu runs", runs);
+        if(failed) drsh_ts_printf(ts, ", %zu exited non-zero", failed);
+        if(prep_failed) drsh_ts_printf(ts, ", prepare exited non-zero before %zu", prep_failed);
+        drsh_ts_printf(ts, "\r\n");
     }
-    if(first == at->special[ATOM_source] || first == at->special[ATOM_DOT]){
-        if(targv.length > 2){
-            const DrshAtom* path = drsh_unsafe_string_to_atom(targv.ptr[1]);
-            err = drsh_source_file(path, env, at, tokens, tok_argv, ts, tmp);
-            return err;
+    if(ncmds > 1){
+        size_t fastest = 0;
+        for(size_t c = 1; c < ncmds; c++)
+            if(sums[c*DRSH_BENCH_METRICS].mean < sums[fastest*DRSH_BENCH_METRICS].mean)
+                fastest = c;
+        const DrshBenchSummary* f = &sums[fastest*DRSH_BENCH_METRICS];
+        drsh_ts_printf(ts, "Summary\r\n  %s ran\r\n", argv->ptr[cmds[fastest]]);
+        for(size_t c = 0; c < ncmds; c++){
+            if(c == fastest) continue;
+            const DrshBenchSummary* o = &sums[c*DRSH_BENCH_METRICS];
+            double ratio = f->mean > 0? o->mean / f->mean : 0;
+            double err_f = f->mean > 0? f->stddev / f->mean : 0;
+            double err_o = o->mean > 0? o->stddev / o->mean : 0;
+            drsh_ts_printf(ts, "    %.2f ± %.2f times faster than %s\r\n", ratio, ratio*drsh_sqrt(err_f*err_f + err_o*err_o), argv->ptr[cmds[c]]);
         }
-        return EC_OK;
     }
-    if(first == at->special[ATOM_time]){
-        if(targv.length > 2){
-            err = drsh_spawn_process_and_wait(ts, env, tmp, targv.ptr+1, 1);
-            if(err){
-                drsh_ts_printf(ts, "error\r\n");
-            }
+    if(csv && drsh_bench_csv(csv, argv, cmds, ncmds, runs, sums))
+        drsh_ts_printf(ts, "bench: unable to write %s\r\n", csv);
+    if(json && drsh_bench_json(json, argv, cmds, ncmds, runs, sums, results))
+        drsh_ts_printf(ts, "bench: unable to write %s\r\n", json);
+
+    Lfinish:
+    if(err == EC_OOM) drsh_ts_printf(ts, "bench: out of memory\r\n");
+    free(cmds);
+    free(results);
+    free(sums);
+    free(values);
+    return EC_OK;
+
+    Lusage:
+    drsh_ts_printf(ts, "usage: bench [-n RUNS] [-w WARMUP] [-p PREPARE] [--show-output] [--csv FILE] [--json FILE] COMMAND ...\r\n");
+    return EC_OK;
+}
+
+//
+// Builtins by the id of their special atom.
+//
+static DrshBuiltinFunc*_Nullable const drsh_builtins[ATOM_MAX] = {
+    [ATOM_cd]     = drsh_builtin_cd,
+    [ATOM_echo]   = drsh_builtin_echo,
+    [ATOM_exit]   = drsh_builtin_exit,
+    [ATOM_pwd]    = drsh_builtin_pwd,
+    [ATOM_set]    = drsh_builtin_set,
+    [ATOM_export] = drsh_builtin_export,
+    [ATOM_local]  = drsh_builtin_local,
+    [ATOM_unset]  = drsh_builtin_unset,
+    [ATOM_hash]   = drsh_builtin_hash,
+    [ATOM_debug]  = drsh_builtin_debug,
+    [ATOM_source] = drsh_builtin_source,
+    [ATOM_DOT]    = drsh_builtin_source,
+    [ATOM_stats]  = drsh_builtin_stats,
+    [ATOM_time]   = drsh_builtin_time,
+    [ATOM_bench]  = drsh_builtin_bench,
+};
+
+//
+// Runs `NAME=value ... cmd args`. The assignments go in a layer that is
+// popped once cmd finishes, so they are only seen by cmd (and whatever it
+// runs, if it is `source`). A line of only assignments sets them for
+// good.
+//
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_execute_with_assignments(const DrshArgv* argv, size_t nassign, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp){
+    _Bool scoped = argv->ptr[nassign] != NULL;
+    size_t mark = drsh_env_push_layer(env);
+    DrshEC err = EC_OK;
+    for(size_t i = 0; i < nassign; i++){
+        size_t klen = drsh_assignment_name_len(argv->ptr[i], argv->lens[i]);
+        const DrshAtom* key;
+        err = drsh_at_atomize(at, argv->ptr[i], klen, &key);
+        if(err) goto Lfinish;
+        const DrshAtom* value;
+        err = drsh_at_atomize(at, argv->ptr[i]+klen+1, argv->lens[i]-klen-1, &value);
+        if(err) goto Lfinish;
+        if(scoped)
+            err = drsh_env_set_overlay(env, key, value);
+        else
+            err = drsh_env_set_env(env, key, value);
+        if(err) goto Lfinish;
+    }
+    if(scoped){
+        DrshArgv rest = {
+            .length = argv->length - nassign,
+            .ptr = argv->ptr + nassign,
+            .lens = argv->lens + nassign,
+        };
+        err = drsh_execute(&rest, 0, env, at, tokens, tok_argv, ts, tmp);
+    }
+    Lfinish:
+    drsh_env_pop_layer(env, mark);
+    return err == EC_OOM? EC_OK : err;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_execute(const DrshArgv* argv, size_t nassign, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp){
+    if(!argv->ptr[0]) return EC_OK;
+    if(nassign)
+        return drsh_execute_with_assignments(argv, nassign, env, at, tokens, tok_argv, ts, tmp);
+    // Builtins are all special atoms, so anything not already interned
+    // can't be one.
+    const DrshAtom* first = drsh_at_lookup(at, argv->ptr[0], argv->lens[0]);
+    if(first){
+        DrshBuiltinFunc* builtin = NULL;
+        size_t id = drsh_atom_special_id(first);
+        if(id != ATOM_MAX) builtin = drsh_builtins[id];
+        if(builtin){
+            DrshExecCtx ctx = {env, at, tokens, tok_argv, ts, tmp};
+            return builtin(&ctx, argv);
         }
-        return EC_OK;
     }
-    err = drsh_spawn_process_and_wait(ts, env, tmp, targv.ptr, 0);
+    DrshEC err = drsh_spawn_process_and_wait(ts, env, tmp, argv, NULL, 0);
     if(err){
         drsh_ts_printf(ts, "error\r\n");
     }
@@ -3904,12 +8197,13 @@ drsh_process_line(const DrshReadBuffer *input_line, DrshEnvironment* env, DrshAt
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
-drsh_source_file(const DrshAtom* path, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp){
+drsh_source_file(const char* path, DrshEnvironment* env, DrshAtomTable* at, DrshTokenized *tokens, DrshGrowBuffer* tok_argv, DrshTermState* ts, DrshGrowBuffer* tmp){
     DrshEC err = EC_OK;
-    drsh_gb_clear(tmp);
-    err = drsh_read_file(path->txt, tmp);
+    // The script needs its own buffer as running the lines clobbers tmp.
+    DrshGrowBuffer script = {0};
+    err = drsh_read_file(path, &script);
     if(!err){
-        DrshReadBuffer txt = drsh_gb_readable_buffer(tmp);
+        DrshReadBuffer txt = drsh_gb_readable_buffer(&script);
         DrshReadBuffer line;
         for(;;){
             size_t len = drsh_rb_to_line(&txt, &line);
@@ -3917,9 +8211,11 @@ drsh_source_file(const DrshAtom* path, DrshEnvironment* env, DrshAtomTable* at,
             drsh_rb_shift(&txt, len);
             err = drsh_process_line(&line, env, at, tokens, tok_argv, ts, tmp);
             if(err == EC_EXIT)
-                return EC_EXIT;
+                break;
         }
     }
+    free(script.data);
+    if(err == EC_EXIT) return EC_EXIT;
     return EC_OK;
 }
 
@@ -3942,7 +8238,7 @@ drsh_read_file(const char*restrict filepath, DrshGrowBuffer* outbuff){
     }
     size_t nbytes = size.QuadPart;
     DrshEC err;
-    err = drsh_gb_ensure(outbuff, nbytes);
+    err = drsh_gb_reserve(outbuff, outbuff->count + nbytes);
     if(err){
         CloseHandle(handle);
         return err;
@@ -3972,7 +8268,7 @@ drsh_read_file(const char*restrict filepath, DrshGrowBuffer* outbuff){
     }
     else {
         off_t length = s.st_size;
-        DrshEC err = drsh_gb_ensure(outbuff, length);
+        DrshEC err = drsh_gb_reserve(outbuff, outbuff->count + length);
         if(err) {
             close(fd);
             return err;
@@ -3988,6 +8284,146 @@ drsh_read_file(const char*restrict filepath, DrshGrowBuffer* outbuff){
 #endif
 }
 
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_map_file(const char* path, const void*_Nullable*_Nonnull out, size_t* size){
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(handle == INVALID_HANDLE_VALUE) return EC_IO_ERROR;
+    LARGE_INTEGER sz;
+    if(!GetFileSizeEx(handle, &sz) || !sz.QuadPart){
+        CloseHandle(handle);
+        return EC_IO_ERROR;
+    }
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+    if(!mapping) return EC_IO_ERROR;
+    void* p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(!p) return EC_IO_ERROR;
+    *out = p;
+    *size = (size_t)sz.QuadPart;
+    return EC_OK;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return EC_IO_ERROR;
+    struct stat s;
+    if(fstat(fd, &s) == -1 || !S_ISREG(s.st_mode) || !s.st_size){
+        close(fd);
+        return EC_IO_ERROR;
+    }
+    void* p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return EC_IO_ERROR;
+    *out = p;
+    *size = s.st_size;
+    return EC_OK;
+#endif
+}
+
+DRSH_INTERNAL
+void
+drsh_unmap_file(const void* p, size_t size){
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(p);
+#else
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wcast-qual"
+    munmap((void*)p, size);
+    #pragma GCC diagnostic pop
+#endif
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_file_stamp(const char* path, uint64_t* size, int64_t* mtime){
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if(!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return EC_IO_ERROR;
+    *size = (uint64_t)data.nFileSizeHigh << 32 | data.nFileSizeLow;
+    *mtime = (int64_t)((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat s;
+    if(stat(path, &s) == -1) return EC_IO_ERROR;
+    *size = s.st_size;
+    #ifdef __APPLE__
+    *mtime = (int64_t)s.st_mtimespec.tv_sec*1000000000 + s.st_mtimespec.tv_nsec;
+    #else
+    *mtime = (int64_t)s.st_mtim.tv_sec*1000000000 + s.st_mtim.tv_nsec;
+    #endif
+#endif
+    return EC_OK;
+}
+
+DRSH_INTERNAL
+DRSH_WARN_UNUSED
+DrshEC
+drsh_write_file_replacing(const char* path, const void* data, size_t length, unsigned mode){
+    DrshGrowBuffer tmp_path = {0};
+    DrshEC err = drsh_gb_append_(&tmp_path, path, strlen(path));
+    if(err) goto Lfinish;
+    size_t path_len = tmp_path.count;
+    #ifdef _WIN32
+    (void)mode;
+    unsigned long pid = (unsigned long)GetCurrentProcessId();
+    #else
+    unsigned long pid = (unsigned long)getpid();
+    #endif
+    // A file left over by a dead shell that had the same pid is in the
+    // way, so try a few names.
+    for(unsigned attempt = 0; attempt < 16; attempt++){
+        char suffix[48];
+        int n = snprintf(suffix, sizeof suffix, ".%lu.%u.tmp", pid, attempt);
+        tmp_path.count = path_len;
+        err = drsh_gb_append_(&tmp_path, suffix, (size_t)n+1);
+        if(err) goto Lfinish;
+        err = EC_IO_ERROR;
+#ifdef _WIN32
+        HANDLE handle = CreateFileA(tmp_path.data, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+        if(handle == INVALID_HANDLE_VALUE){
+            if(GetLastError() == ERROR_FILE_EXISTS) continue;
+            goto Lfinish;
+        }
+        DWORD written;
+        BOOL ok = WriteFile(handle, data, (DWORD)length, &written, NULL) && written == length;
+        CloseHandle(handle);
+        if(ok && MoveFileExA(tmp_path.data, path, MOVEFILE_REPLACE_EXISTING))
+            err = EC_OK;
+        else
+            DeleteFileA(tmp_path.data);
+#else
+        int fd = open(tmp_path.data, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, (mode_t)mode);
+        if(fd < 0){
+            if(errno == EEXIST) continue;
+            goto Lfinish;
+        }
+        const char* p = data;
+        size_t remaining = length;
+        while(remaining){
+            ssize_t w = write(fd, p, remaining);
+            if(w < 0){
+                if(errno == EINTR) continue;
+                break;
+            }
+            p += w;
+            remaining -= w;
+        }
+        close(fd);
+        if(!remaining && rename(tmp_path.data, path) == 0)
+            err = EC_OK;
+        else
+            unlink(tmp_path.data);
+#endif
+        break;
+    }
+    Lfinish:
+    free(tmp_path.data);
+    return err;
+}
+
 DRSH_INTERNAL
 DRSH_WARN_UNUSED
 DrshEC
@@ -0,0 +1,236 @@
+//
+// Model check of the environment table. Random sets, unsets, exports and
+// layers of overlays are applied both to the environment and to a plain
+// array, and after every step lookups, the sorted listing and (on posix
+// style) envp must agree with the array. Runs case sensitive with an
+// inherited environment, then case insensitive.
+//
+// Best built with sanitizers:
+//
+//    make check TEST_CFLAGS="-O1 -g -fsanitize=address,undefined"
+//    ./tests/env_model [STEPS [SEED]]
+//
+#define DRSH_INTERNAL static __attribute__((__unused__))
+#define main drsh_main
+#include "../drsh.c"
+#undef main
+
+// Atom tables and environments are never freed, which isn't a leak worth
+// reporting when built with -fsanitize=address.
+const char* __asan_default_options(void);
+const char*
+__asan_default_options(void){
+    return "detect_leaks=0";
+}
+
+enum {POOL = 97, VALUES = 13};
+
+typedef struct ModelVar ModelVar;
+struct ModelVar {
+    _Bool set;
+    _Bool exported;
+    char name[32]; // as last set, which is what listings show
+    char value[32];
+};
+
+static uint64_t rng_state;
+
+static
+uint64_t
+rng(void){
+    uint64_t x = rng_state;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return rng_state = x;
+}
+
+static _Bool insensitive;
+static size_t step;
+
+static
+_Noreturn
+void
+fail(const char* what, const char* name){
+    fprintf(stderr, "FAIL at step %zu (%s): %s %s\n", step, insensitive? "case insensitive" : "case sensitive", what, name);
+    exit(1);
+}
+
+// Pool name i, in a random case if that doesn't matter.
+static
+void
+spell(char* buff, size_t i){
+    snprintf(buff, 32, "Var_%zu", i);
+    if(!insensitive) return;
+    for(char* p = buff; *p; p++)
+        if(rng() & 1) *p = (char)(*p >= 'a' && *p <= 'z'? *p-32 : *p >= 'A' && *p <= 'Z'? *p+32 : *p);
+}
+
+// The order listings are sorted in, see drsh_atom_icmp.
+static
+int
+cmp_name(const char* a, const char* b){
+    if(!insensitive) return strcmp(a, b);
+    for(;; a++, b++){
+        unsigned x = *a? 0x20|(unsigned char)*a : 0;
+        unsigned y = *b? 0x20|(unsigned char)*b : 0;
+        if(x != y) return x < y? -1 : 1;
+        if(!x) return 0;
+    }
+}
+
+static
+const DrshAtom*
+atom(DrshAtomTable* at, const char* txt){
+    const DrshAtom* a;
+    if(drsh_at_atomize(at, txt, strlen(txt), &a)) fail("atomize", txt);
+    return a;
+}
+
+static
+void
+check(DrshEnvironment* env, const ModelVar* model, const ModelVar*_Nullable overlay){
+    DrshAtomTable* at = env->at;
+    size_t count = 0;
+    for(size_t i = 0; i < POOL; i++){
+        char name[32];
+        spell(name, i);
+        const ModelVar* m = overlay && overlay[i].set? &overlay[i] : &model[i];
+        const DrshAtom* v = drsh_env_get_env2(env, name, strlen(name));
+        if(m->set){
+            if(!v || strcmp(v->txt, m->value) != 0) fail("wrong value for", name);
+        }
+        else if(v)
+            fail("should be unset:", name);
+        if(drsh_env_get_env(env, atom(at, name)) != v) fail("get_env disagrees with get_env2 for", name);
+        count += model[i].set;
+    }
+    if(env->count != count) fail("wrong count", "");
+    if(overlay) return;
+
+    // The listing is sorted and holds exactly what is set.
+    DrshGrowBuffer pairs = {0};
+    if(drsh_env_merged_pairs(env, &pairs, DRSH_ENV_ALL)) fail("merged_pairs", "");
+    const DrshAtom** p = (const DrshAtom**)pairs.data;
+    size_t n = pairs.count/(2*sizeof *p);
+    if(n != count) fail("listing has the wrong length", "");
+    for(size_t k = 0; k < n; k++){
+        if(k && cmp_name(p[2*(k-1)]->txt, p[2*k]->txt) >= 0) fail("listing out of order at", p[2*k]->txt);
+        size_t i = (size_t)atoi(p[2*k]->txt+4);
+        if(i >= POOL || !model[i].set || strcmp(p[2*k]->txt, model[i].name) != 0 || strcmp(p[2*k+1]->txt, model[i].value) != 0)
+            fail("listing has", p[2*k]->txt);
+    }
+    free(pairs.data);
+
+    // envp holds every exported variable, once.
+    if(insensitive) return;
+    char** envp = drsh_env_get_envp(env, 0);
+    if(!envp) fail("get_envp", "");
+    size_t exported = 0, seen = 0;
+    for(size_t i = 0; i < POOL; i++)
+        exported += model[i].set && model[i].exported;
+    for(char** e = envp; *e; e++){
+        seen++;
+        const char* eq = strchr(*e, '=');
+        if(!eq) fail("envp entry without '=':", *e);
+        size_t i = (size_t)atoi(*e+4);
+        if(i >= POOL || !model[i].set || !model[i].exported) fail("envp shouldn't have", *e);
+        if(strncmp(*e, model[i].name, (size_t)(eq-*e)) != 0 || strcmp(eq+1, model[i].value) != 0)
+            fail("envp has the wrong entry", *e);
+    }
+    if(seen != exported) fail("envp has the wrong number of entries", "");
+}
+
+static
+void
+run(size_t steps, _Bool windows_style){
+    insensitive = windows_style;
+    static ModelVar model[POOL], overlay[POOL];
+    memset(model, 0, sizeof model);
+    DrshAtomTable* at = calloc(1, sizeof *at);
+    DrshEnvironment* env = calloc(1, sizeof *env);
+    if(!at || !env || drsh_at_init(at)) fail("init", "");
+    // Start with some inherited variables, which are imported lazily.
+    char* inherited[POOL/3+1];
+    char block[POOL/3*32+1];
+    size_t nblock = 0;
+    for(size_t i = 0; i < POOL/3; i++){
+        ModelVar* m = &model[3*i];
+        m->set = m->exported = 1;
+        snprintf(m->name, sizeof m->name, "Var_%zu", 3*i);
+        snprintf(m->value, sizeof m->value, "inherited %zu", i);
+        inherited[i] = malloc(64);
+        if(!inherited[i]) fail("malloc", "");
+        int n = snprintf(inherited[i], 64, "%s=%s", m->name, m->value);
+        memcpy(block+nblock, inherited[i], (size_t)n+1);
+        nblock += (size_t)n+1;
+    }
+    inherited[POOL/3] = NULL;
+    block[nblock] = 0;
+    if(drsh_env_init(env, at, windows_style? (void*)block : (void*)inherited, windows_style))
+        fail("env_init", "");
+    check(env, model, NULL);
+    for(step = 0; step < steps; step++){
+        size_t i = (size_t)(rng() % POOL);
+        ModelVar* m = &model[i];
+        char name[32];
+        spell(name, i);
+        const DrshAtom* key = atom(at, name);
+        uint64_t r = rng() % 100;
+        if(r < 40){
+            char value[32];
+            snprintf(value, sizeof value, "value %u", (unsigned)(rng() % VALUES));
+            _Bool export_new = rng() & 1;
+            if(drsh_env_set(env, key, atom(at, value), NULL, export_new)) fail("set", name);
+            if(!m->set) m->exported = export_new;
+            m->set = 1;
+            snprintf(m->name, sizeof m->name, "%s", name);
+            snprintf(m->value, sizeof m->value, "%s", value);
+        }
+        else if(r < 70){
+            if(drsh_env_unset(env, name, strlen(name))) fail("unset", name);
+            m->set = 0;
+        }
+        else if(r < 95){
+            _Bool exported = rng() & 1;
+            DrshEC err = drsh_env_set_exported(env, key, exported);
+            if(m->set? err != EC_OK : err != EC_NOT_FOUND) fail("set_exported", name);
+            if(m->set) m->exported = exported;
+        }
+        else {
+            // A layer of overlays, like `NAME=value cmd`, which must leave
+            // everything as it was once popped.
+            memset(overlay, 0, sizeof overlay);
+            size_t mark = drsh_env_push_layer(env);
+            for(size_t k = 0, nk = 1 + rng() % 4; k < nk; k++){
+                size_t j = (size_t)(rng() % POOL);
+                char oname[32], value[32];
+                spell(oname, j);
+                snprintf(value, sizeof value, "overlay %zu", k);
+                if(drsh_env_set_overlay(env, atom(at, oname), atom(at, value))) fail("set_overlay", oname);
+                overlay[j].set = 1;
+                snprintf(overlay[j].value, sizeof overlay[j].value, "%s", value);
+                // Set only in the layer, so it is exported and can't be
+                // made local.
+                if(!model[j].set){
+                    if(drsh_env_set_exported(env, atom(at, oname), 1) != EC_OK) fail("export overlay", oname);
+                    if(drsh_env_set_exported(env, atom(at, oname), 0) != EC_VALUE_ERROR) fail("local overlay", oname);
+                }
+            }
+            check(env, model, overlay);
+            if(!windows_style && !drsh_env_get_envp(env, 0)) fail("get_envp with overlays", "");
+            drsh_env_pop_layer(env, mark);
+        }
+        check(env, model, NULL);
+    }
+    // The environment and table are leaked, there is no way to free them.
+}
+
+int
+main(int argc, char** argv){
+    size_t steps = argc > 1? (size_t)strtoull(argv[1], NULL, 10) : 20000;
+    rng_state = argc > 2? strtoull(argv[2], NULL, 10) : 88172645463325252ull;
+    if(!rng_state) rng_state = 1;
+    run(steps, 0);
+    run(steps, 1);
+    printf("ok: %zu steps each\n", steps);
+    return 0;
+}
@@ -0,0 +1,186 @@
+//
+// Stress test for the atom table's concurrent mode.
+//
+// Several threads intern an overlapping set of strings (and fold them with
+// drsh_at_iatom, which interns the twins) while the shards grow under them.
+// Afterwards every thread must have gotten the same atom for the same
+// text, nothing may have been interned twice, and the table must survive a
+// collection. Prints the interning throughput as it goes.
+//
+//    make check
+//    ./tests/stress_at [THREADS] [KEYS] [ROUNDS]
+//
+#define DRSH_INTERNAL static __attribute__((__unused__))
+#define main drsh_main
+#include "../drsh.c"
+#undef main
+
+// Atom tables and environments are never freed, which isn't a leak worth
+// reporting when built with -fsanitize=address.
+const char* __asan_default_options(void);
+const char*
+__asan_default_options(void){
+    return "detect_leaks=0";
+}
+
+static
+uint64_t
+now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + (uint64_t)t.tv_nsec;
+}
+
+enum {MAX_THREADS = 64};
+
+typedef struct StressThread StressThread;
+struct StressThread {
+    DrshAtomTable* at;
+    pthread_t thread;
+    unsigned id;
+    unsigned nthreads;
+    unsigned nkeys;
+    const DrshAtom*_Nullable*_Nonnull shared; // nkeys of them
+    const DrshAtom*_Nullable*_Nonnull folded; // nkeys of them
+    unsigned failures;
+};
+
+static
+void*_Nullable
+stress_thread(void* p){
+    StressThread* t = p;
+    char buff[64];
+    // Everyone walks the shared keys from a different starting point with
+    // a stride coprime to nkeys, so inserts into the same shard interleave.
+    unsigned stride = 7919;
+    unsigned start = t->id * (t->nkeys / t->nthreads + 1);
+    for(unsigned n = 0; n < t->nkeys; n++){
+        unsigned i = (unsigned)(((uint64_t)start + (uint64_t)n * stride) % t->nkeys);
+        int len = snprintf(buff, sizeof buff, "SharedKey%u", i);
+        const DrshAtom* a;
+        if(drsh_at_atomize(t->at, buff, (size_t)len, &a)){
+            t->failures++;
+            continue;
+        }
+        t->shared[i] = a;
+        const DrshAtom* f;
+        if(drsh_at_iatom(t->at, a, &f)){
+            t->failures++;
+            continue;
+        }
+        t->folded[i] = f;
+        // And some that nobody else touches.
+        len = snprintf(buff, sizeof buff, "private%u.%u", t->id, i);
+        if(drsh_at_atomize(t->at, buff, (size_t)len, &a))
+            t->failures++;
+        else if(drsh_at_lookup(t->at, buff, (size_t)len) != a)
+            t->failures++;
+    }
+    return NULL;
+}
+
+static
+int
+check(_Bool ok, const char* what){
+    if(!ok) fprintf(stderr, "FAIL: %s\n", what);
+    return !ok;
+}
+
+int
+main(int argc, char** argv){
+    unsigned nthreads = argc > 1? (unsigned)atoi(argv[1]) : 8;
+    unsigned nkeys = argc > 2? (unsigned)atoi(argv[2]) : 50000;
+    unsigned rounds = argc > 3? (unsigned)atoi(argv[3]) : 3;
+    if(!nthreads || nthreads > MAX_THREADS || !nkeys || !rounds){
+        fprintf(stderr, "usage: %s [THREADS<=%d] [KEYS] [ROUNDS]\n", argv[0], MAX_THREADS);
+        return 2;
+    }
+    int failures = 0;
+    static DrshAtomTable at;
+    if(drsh_at_init(&at)){
+        fprintf(stderr, "drsh_at_init failed\n");
+        return 1;
+    }
+    size_t base = drsh_at_count(&at);
+    const DrshAtom** results = calloc((size_t)nthreads*2*nkeys, sizeof *results);
+    if(!results) return 1;
+    for(unsigned r = 0; r < rounds; r++){
+        StressThread threads[MAX_THREADS];
+        memset(results, 0, (size_t)nthreads*2*nkeys*sizeof *results);
+        drsh_at_set_concurrent(&at, 1);
+        uint64_t t0 = now_ns();
+        for(unsigned i = 0; i < nthreads; i++){
+            threads[i] = (StressThread){
+                .at = &at,
+                .id = i,
+                .nthreads = nthreads,
+                .nkeys = nkeys,
+                .shared = results + (size_t)i*2*nkeys,
+                .folded = results + (size_t)i*2*nkeys + nkeys,
+            };
+            if(pthread_create(&threads[i].thread, NULL, stress_thread, &threads[i]) != 0){
+                fprintf(stderr, "pthread_create failed\n");
+                return 1;
+            }
+        }
+        for(unsigned i = 0; i < nthreads; i++)
+            pthread_join(threads[i].thread, NULL);
+        uint64_t t1 = now_ns();
+        drsh_at_set_concurrent(&at, 0);
+
+        unsigned thread_failures = 0;
+        for(unsigned i = 0; i < nthreads; i++)
+            thread_failures += threads[i].failures;
+        failures += check(!thread_failures, "atomize/iatom/lookup in a thread");
+        // The first round interns everything, later rounds only find them.
+        size_t expected = base + 2*(size_t)nkeys + (size_t)nthreads*nkeys;
+        failures += check(drsh_at_count(&at) == expected, "every string interned exactly once");
+        char buff[64];
+        unsigned mismatches = 0;
+        for(unsigned k = 0; k < nkeys; k++){
+            int len = snprintf(buff, sizeof buff, "SharedKey%u", k);
+            const DrshAtom* a = drsh_at_lookup(&at, buff, (size_t)len);
+            for(int j = 0; j < len; j++)
+                buff[j] = (char)(0x20|(unsigned char)buff[j]);
+            const DrshAtom* f = drsh_at_lookup(&at, buff, (size_t)len);
+            if(!a || !f){
+                mismatches++;
+                continue;
+            }
+            for(unsigned i = 0; i < nthreads; i++){
+                if(threads[i].shared[k] != a) mismatches++;
+                if(threads[i].folded[k] != f) mismatches++;
+            }
+            if(a->iatom != f || f->iatom != f) mismatches++;
+        }
+        failures += check(!mismatches, "all threads agree on every atom");
+        double secs = (double)(t1-t0)/1e9;
+        double ops = (double)nthreads*nkeys*3;
+        printf("round %u: %u threads, %.0f interns in %.3fs (%.2f M/s)\n",
+            r, nthreads, ops, secs, ops/secs/1e6);
+    }
+
+    // Collect, keeping only the shared keys, and check they survived the move.
+    DrshAtomGc gc;
+    failures += check(!drsh_at_gc_begin(&at, &gc), "gc_begin");
+    for(unsigned k = 0; k < nkeys; k++)
+        drsh_at_gc_forward(&gc, &results[k]);
+    drsh_at_gc_end(&gc);
+    failures += check(drsh_at_count(&at) == base + 2*(size_t)nkeys, "gc kept exactly the live atoms");
+    unsigned lost = 0;
+    char buff[64];
+    for(unsigned k = 0; k < nkeys; k++){
+        int len = snprintf(buff, sizeof buff, "SharedKey%u", k);
+        const DrshAtom* a = drsh_at_lookup(&at, buff, (size_t)len);
+        if(a != results[k] || a->len != (size_t)len || memcmp(a->txt, buff, (size_t)len) != 0)
+            lost++;
+    }
+    failures += check(!lost, "atoms intact after gc");
+    free(results);
+    if(failures){
+        fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}